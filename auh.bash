@@ -0,0 +1,21 @@
+# bash completion for auh                                  -*- shell-script -*-
+#
+# Candidates come from "auh __complete", which answers from the local
+# name index without running pacman or contacting the AUR.
+
+_auh ()
+{
+  local cur=${COMP_WORDS[COMP_CWORD]}
+  local IFS=$'\n'
+
+  if [[ $cur == -* ]]; then
+    return
+  fi
+  if (( COMP_CWORD == 1 )); then
+    COMPREPLY=($(auh __complete "$cur" 2>/dev/null))
+  else
+    COMPREPLY=($(auh __complete "${COMP_WORDS[1]}" "$cur" 2>/dev/null))
+  fi
+}
+
+complete -F _auh auh
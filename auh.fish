@@ -0,0 +1,15 @@
+# fish completion for auh. Candidates come from "auh __complete", which
+# answers from the local name index without running pacman or contacting
+# the AUR.
+
+function __auh_complete
+    set -l tokens (commandline -opc)
+    set -l current (commandline -ct)
+    if test (count $tokens) -le 1
+        auh __complete "$current" 2>/dev/null
+    else
+        auh __complete $tokens[2] "$current" 2>/dev/null
+    end
+end
+
+complete -c auh -f -a '(__auh_complete)'
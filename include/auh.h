@@ -0,0 +1,300 @@
+/*
+ * auh - Arch User Helper
+ * A modern AUR helper for Arch Linux
+ *
+ * Copyright (C) 2024 Harsha Bhattacharyya
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Contact: harshabhattacharyya510@duck.com
+ */
+
+/*
+ * libauh - the auh engine as a library
+ *
+ * The batch API classifies, resolves, plans, fetches, builds and installs
+ * whole vectors of packages, returns its results as structs and reports
+ * progress through a callback, so a program can drive auh without forking
+ * it and parsing its output. The command functions below it are what the
+ * auh executable calls; they print to stdout and return an exit status.
+ *
+ * Link with -lauh -pthread.
+ */
+
+#ifndef AUH_H
+#define AUH_H
+
+#include <cstddef>    // For size_t
+#include <functional> // For std::function
+#include <string>     // For std::string
+#include <vector>     // For std::vector
+
+namespace auh
+{
+
+/**
+ * struct options - Settings shared by every operation
+ * @offline: Work from local caches only (the --offline option)
+ * @lockfile: Lockfile whose pinned commits AUR builds use, or empty to
+ *            build the current head (the --locked option)
+ * @jobs: Packages fetched or built at the same time
+ * @json: Report results of the commands as JSON Lines on stdout and move
+ *        all other output, including pacman's and makepkg's, to stderr
+ *        (the --json option)
+ */
+struct options
+{
+  bool offline = false;
+  std::string lockfile;
+  unsigned jobs = 4;
+  bool json = false;
+};
+
+/**
+ * configure - Apply options to all later calls
+ * @opts: Options
+ * @error: Receives a message on failure
+ *
+ * The options are process-wide state read by every other call, so
+ * configure() is not thread-safe: call it before starting operations,
+ * never while another thread is inside libauh.
+ *
+ * Return: true on success, false if the lockfile could not be read or
+ *         the output descriptors could not be set up
+ */
+bool configure (const options &opts, std::string &error);
+
+/* Where a package name comes from */
+enum class origin
+{
+  installed,
+  repo,
+  aur,
+  missing
+};
+
+/**
+ * struct classification - Result of classify() for one name
+ * @name: Package name
+ * @where: Origin; installed wins over repo, repo over aur
+ * @version: Installed, sync database or AUR version; empty if missing
+ */
+struct classification
+{
+  std::string name;
+  origin where;
+  std::string version;
+};
+
+/**
+ * struct pkg_info - Details of one repo or AUR package
+ *
+ * Fields a source does not provide stay empty.
+ */
+struct pkg_info
+{
+  std::string name;
+  std::string source; // repository name or "aur"
+  std::string version;
+  std::string description;
+  std::string url;
+  std::string depends; // space-separated
+  std::string makedepends;
+  std::string maintainer;
+  std::string votes;
+  std::string popularity;
+  std::string last_modified;
+  std::string out_of_date;
+};
+
+/**
+ * struct install_plan - What install() has to do for a set of names
+ * @installed: Already installed; nothing to do
+ * @repo: Installed from the sync databases in one pacman transaction
+ * @aur: Fetched and built from the AUR
+ * @missing: Found nowhere
+ */
+struct install_plan
+{
+  std::vector<std::string> installed;
+  std::vector<std::string> repo;
+  std::vector<std::string> aur;
+  std::vector<std::string> missing;
+};
+
+/* Step of a batch operation that a progress report belongs to */
+enum class stage
+{
+  classify,
+  fetch,
+  build,
+  install
+};
+
+/**
+ * struct progress - One progress report
+ * @step: Stage the report belongs to
+ * @package: Package concerned, or empty for the whole batch
+ * @message: What happened
+ * @done: Packages finished in this stage so far
+ * @total: Packages in this stage
+ */
+struct progress
+{
+  stage step;
+  std::string package;
+  std::string message;
+  size_t done;
+  size_t total;
+};
+
+/*
+ * Progress callback. Reports from parallel fetches and builds are
+ * serialized, so the callback needs no locking of its own.
+ */
+typedef std::function<void (const progress &)> progress_callback;
+
+/**
+ * struct result - Outcome of one package in fetch(), build() or install()
+ * @package: Package name
+ * @ok: Whether the step succeeded
+ * @detail: Clone directory (fetch), built package files separated by
+ *          spaces (build and install), or the error message
+ */
+struct result
+{
+  std::string package;
+  bool ok;
+  std::string detail;
+};
+
+/**
+ * classify - Find where each package name comes from
+ * @names: Package names
+ *
+ * Return: One classification per name, in the order of @names
+ */
+std::vector<classification> classify (const std::vector<std::string> &names);
+
+/**
+ * resolve - Look up details of repo and AUR packages
+ * @names: Package names
+ *
+ * Repo packages are described by one pacman run, AUR packages by batched
+ * RPC requests (or the local metadata when offline).
+ *
+ * Return: Details of every name found, in the order of @names
+ */
+std::vector<pkg_info> resolve (const std::vector<std::string> &names);
+
+/**
+ * plan - Split package names by what installing them takes
+ * @names: Package names
+ *
+ * Return: The plan; invalid names are listed as missing
+ */
+install_plan plan (const std::vector<std::string> &names);
+
+/**
+ * fetch - Bring the cached clones of AUR packages up to date
+ * @packages: AUR package names
+ * @report: Progress callback, may be empty
+ *
+ * Return: One result per package, in the order of @packages
+ */
+std::vector<result> fetch (const std::vector<std::string> &packages,
+                           const progress_callback &report
+                           = progress_callback ());
+
+/**
+ * build - Build fetched AUR packages without installing them
+ * @packages: AUR package names whose clones fetch() prepared
+ * @report: Progress callback, may be empty
+ *
+ * Missing dependencies are installed by makepkg; the built packages are
+ * kept in the package cache.
+ *
+ * Return: One result per package, in the order of @packages
+ */
+std::vector<result> build (const std::vector<std::string> &packages,
+                           const progress_callback &report
+                           = progress_callback ());
+
+/**
+ * install - Install packages from the sync databases and the AUR
+ * @names: Package names
+ * @report: Progress callback, may be empty
+ *
+ * Plans @names, installs the repo packages in one pacman transaction,
+ * fetches and builds the AUR packages in parallel and installs what was
+ * built in one more transaction.
+ *
+ * Return: One result per name, in the order of @names
+ */
+std::vector<result> install (const std::vector<std::string> &names,
+                             const progress_callback &report
+                             = progress_callback ());
+
+/*
+ * Commands of the auh executable. They print to stdout and stderr and
+ * return 0 on success, 1 on failure.
+ */
+
+/**
+ * struct aur_query - Predicates of an "auh query" run
+ *
+ * Negative numeric fields and empty strings mean "no constraint".
+ */
+struct aur_query
+{
+  long votes_below = -1;
+  long votes_above = -1;
+  double popularity_below = -1;
+  long updated_before_days = -1;
+  long updated_within_days = -1;
+  std::string maintainer;
+  bool flagged = false;
+  bool orphaned = false;
+  bool installed = false;
+};
+
+int install_packages_parallel (const std::vector<std::string> &packages,
+                               bool use_aur);
+bool is_aur_up ();
+int remove_pkg (const std::string &package, bool autoremove = false,
+                bool purge = false);
+int update_pkg (const std::string &package);
+int update_vcs ();
+int autoremove ();
+int clean_cache ();
+int sync_explicit ();
+int outdated (bool vcs = false);
+int audit (bool security = false,
+           const std::string &advisories = std::string ());
+int lock_packages (std::vector<std::string> packages,
+                   const std::string &path);
+int apply_manifest (const std::string &path, bool prune);
+int search (const std::vector<std::string> &terms, size_t limit);
+int info (const std::vector<std::string> &packages);
+int query (const aur_query &q, bool count_only);
+int rebuild_index ();
+int apply_index_delta (const std::vector<std::string> &targets);
+int index_owner (const std::string &path);
+int index_required_by (const std::string &package);
+int run_daemon ();
+int complete (int argc, char **argv);
+
+} // namespace auh
+
+#endif /* AUH_H */
@@ -0,0 +1,8329 @@
+/*
+ * auh - Arch User Helper
+ * A modern AUR helper for Arch Linux
+ *
+ * Copyright (C) 2024 Harsha Bhattacharyya
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Contact: harshabhattacharyya510@duck.com
+ */
+
+#include <algorithm>  // For remove, find
+#include <array>      // For fixed-size arrays
+#include <atomic>     // For atomic work counters
+#include <cerrno>     // For errno
+#include <chrono>     // For steady_clock timings
+#include <cmath>      // For log1p
+#include <condition_variable> // For condition_variable
+#include <cstdint>    // For fixed-width integers
+#include <cstdio>     // For FILE, popen, pclose
+#include <cstdlib>    // For system, exit
+#include <cstring>    // For memset, strcpy
+#include <ctime>      // For time
+#include <dirent.h>   // For fdopendir, readdir
+#include <fcntl.h>    // For openat, O_DIRECTORY
+#include <fstream>    // For ifstream
+#include <functional> // For function
+#include <getopt.h>   // For getopt_long
+#include <iostream>   // For cout, cerr
+#include <linux/fs.h> // For FICLONE
+#include <map>        // For ordered key/value tables
+#include <memory>     // For unique_ptr
+#include <mutex>      // For mutex, lock_guard, call_once
+#include <poll.h>     // For poll
+#include <queue>      // For priority_queue
+#include <set>        // For ordered sets
+#include <signal.h>   // For signal, SIGPIPE
+#include <sstream>    // For istringstream
+#include <string>     // For string operations
+#include <sys/file.h> // For flock
+#include <sys/inotify.h> // For inotify_init1, inotify_add_watch
+#include <sys/mman.h> // For mmap
+#include <sys/ioctl.h> // For ioctl
+#include <sys/socket.h> // For socket, bind, listen, accept
+#include <sys/stat.h> // For fstatat, fchmod
+#include <sys/statvfs.h> // For statvfs
+#include <sys/un.h>   // For sockaddr_un
+#include <sys/wait.h> // For wait, WIFEXITED, WEXITSTATUS
+#include <thread>     // For background and parallel cleanup
+#include <tuple>      // For tuple, make_tuple
+#include <unistd.h>   // For fork, pid_t, unlinkat
+#include <unordered_map> // For hash tables
+#include <vector>     // For dynamic arrays
+
+#include "auh.h" // Public interface of libauh
+
+using namespace std;
+
+#ifndef FICLONE
+#define FICLONE _IOW (0x94, 9, int)
+#endif
+
+namespace auh
+{
+
+/**
+ * is_valid_package_name - Validate package name format
+ * @name: Package name to validate
+ *
+ * Checks if a package name contains only allowed characters to prevent
+ * command injection and ensure compatibility with pacman/AUR standards.
+ * Package names should only contain: alphanumeric characters, dash (-),
+ * underscore (_), dot (.), and plus (+).
+ *
+ * Return: true if the package name is valid, false otherwise
+ */
+static bool
+is_valid_package_name (const string &name)
+{
+  // Package names should only contain alphanumeric, dash, underscore, dot, and
+  // plus
+  if (name.empty ())
+    return false;
+  for (char c : name)
+    {
+      if (!isalnum (c) && c != '-' && c != '_' && c != '.' && c != '+')
+        return false;
+    }
+  return true;
+}
+
+// Bytes requested per read() from a command's output pipe
+static const size_t pipe_chunk = 64 * 1024;
+
+/**
+ * shell_quote - Quote a string for the shell
+ * @s: String
+ *
+ * Return: @s in single quotes, with embedded single quotes escaped
+ */
+static string
+shell_quote (const string &s)
+{
+  string out = "'";
+  for (char c : s)
+    out += c == '\'' ? string ("'\\''") : string (1, c);
+  return out + "'";
+}
+
+/**
+ * run_capture - Execute command and capture output
+ * @cmd: Shell command to execute
+ *
+ * Executes a shell command using popen and reads its standard output with
+ * large read() calls straight into the result string. The pipe is
+ * automatically closed via unique_ptr with custom deleter. Callers that
+ * go through the output line by line should use for_each_output_line()
+ * instead.
+ *
+ * Return: Captured output as string, or empty string on failure
+ */
+static string
+run_capture (const string &cmd)
+{
+  string out;
+  // Use unique_ptr with pclose as deleter to ensure pipe is closed
+  unique_ptr<FILE, decltype (&pclose)> pipe (popen (cmd.c_str (), "r"),
+                                             pclose);
+  if (!pipe)
+    return {};
+  int fd = fileno (pipe.get ());
+  size_t have = 0;
+  for (;;)
+    {
+      if (out.size () - have < pipe_chunk)
+        out.resize (have + pipe_chunk);
+      ssize_t n = read (fd, &out[have], out.size () - have);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      have += n;
+    }
+  out.resize (have);
+  return out;
+}
+
+/**
+ * for_each_output_line - Run a command and stream its output line by line
+ * @cmd: Shell command to execute
+ * @on_line: Called as on_line (const char *line, size_t len) for every
+ *           line of standard output, without its newline
+ *
+ * Reads the pipe with large read() calls into one reusable buffer and
+ * finds line ends with memchr, handing each line out in place as soon as
+ * it arrives, so processing overlaps with the command and no line is
+ * copied. A line is only valid during its callback. A last line without
+ * a newline is delivered too.
+ *
+ * Return: true if the command could be started, false otherwise
+ */
+template <typename F>
+static bool
+for_each_output_line (const string &cmd, F on_line)
+{
+  unique_ptr<FILE, decltype (&pclose)> pipe (popen (cmd.c_str (), "r"),
+                                             pclose);
+  if (!pipe)
+    return false;
+  int fd = fileno (pipe.get ());
+  vector<char> buf (pipe_chunk);
+  size_t have = 0;
+  for (;;)
+    {
+      // A line longer than the buffer grows it
+      if (have == buf.size ())
+        buf.resize (buf.size () * 2);
+      ssize_t n = read (fd, buf.data () + have, buf.size () - have);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+
+      // Only the new bytes can hold the next newline
+      const char *line = buf.data ();
+      const char *scan = buf.data () + have;
+      const char *end = scan + n;
+      const char *nl;
+      while ((nl = (const char *)memchr (scan, '\n', end - scan)) != NULL)
+        {
+          on_line (line, (size_t)(nl - line));
+          line = scan = nl + 1;
+        }
+
+      // Keep the partial last line at the front for the next read
+      have = end - line;
+      memmove (buf.data (), line, have);
+    }
+  if (have)
+    on_line (buf.data (), have);
+  return true;
+}
+
+/**
+ * next_field - Split the next space-separated field off a line
+ * @p: Current position; advanced past the field and its separators
+ * @end: End of the line
+ * @len: Receives the field length
+ *
+ * Return: Start of the field; @len is 0 when the line is exhausted
+ */
+static const char *
+next_field (const char *&p, const char *end, size_t &len)
+{
+  while (p < end && *p == ' ')
+    ++p;
+  const char *start = p;
+  while (p < end && *p != ' ')
+    ++p;
+  len = p - start;
+  return start;
+}
+
+/**
+ * remove_tree_at - Delete everything below an open directory
+ * @dirfd: Directory file descriptor; ownership passes to this function
+ *
+ * Walks the directory with readdir and removes entries with unlinkat,
+ * descending into subdirectories through openat so no path strings are
+ * rebuilt per file. Directories left read-only by a build (Go module
+ * caches, for example) are made writable and the unlink is retried.
+ *
+ * Return: true if every entry was removed, false otherwise
+ */
+static bool
+remove_tree_at (int dirfd)
+{
+  DIR *dir = fdopendir (dirfd);
+  if (!dir)
+    {
+      close (dirfd);
+      return false;
+    }
+
+  bool ok = true;
+  bool made_writable = false;
+  struct dirent *ent;
+  while ((ent = readdir (dir)) != NULL)
+    {
+      const char *name = ent->d_name;
+      if (name[0] == '.'
+          && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        continue;
+
+      bool is_dir = ent->d_type == DT_DIR;
+      if (ent->d_type == DT_UNKNOWN)
+        {
+          struct stat st;
+          if (fstatat (dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            is_dir = S_ISDIR (st.st_mode);
+        }
+
+      if (is_dir)
+        {
+          int sub = openat (dirfd, name,
+                            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+          if (sub < 0 || !remove_tree_at (sub))
+            ok = false;
+        }
+
+      int flags = is_dir ? AT_REMOVEDIR : 0;
+      if (unlinkat (dirfd, name, flags) != 0)
+        {
+          // Retry once after granting ourselves write access to the parent
+          if (errno == EACCES && !made_writable
+              && fchmod (dirfd, S_IRWXU) == 0)
+            {
+              made_writable = true;
+              if (unlinkat (dirfd, name, flags) == 0)
+                continue;
+            }
+          ok = false;
+        }
+    }
+
+  closedir (dir);
+  return ok;
+}
+
+/**
+ * collect_subdirs - List the directories directly below a path
+ * @path: Directory to scan
+ *
+ * Return: Paths of the immediate subdirectories of @path (symlinks excluded)
+ */
+static vector<string>
+collect_subdirs (const string &path)
+{
+  vector<string> dirs;
+  DIR *dir = opendir (path.c_str ());
+  if (!dir)
+    return dirs;
+
+  struct dirent *ent;
+  while ((ent = readdir (dir)) != NULL)
+    {
+      string name = ent->d_name;
+      if (name == "." || name == "..")
+        continue;
+      bool is_dir = ent->d_type == DT_DIR;
+      if (ent->d_type == DT_UNKNOWN)
+        {
+          struct stat st;
+          if (fstatat (dirfd (dir), name.c_str (), &st, AT_SYMLINK_NOFOLLOW)
+              == 0)
+            is_dir = S_ISDIR (st.st_mode);
+        }
+      if (is_dir)
+        dirs.push_back (path + "/" + name);
+    }
+  closedir (dir);
+  return dirs;
+}
+
+/**
+ * remove_tree - Recursively delete a directory without spawning rm
+ * @path: Directory to delete
+ *
+ * Replaces "rm -rf" for build directories. Subtrees one and two levels
+ * below @path are handed to a small pool of threads which empty them in
+ * parallel; the remaining skeleton is then removed sequentially. A missing
+ * @path is not an error.
+ *
+ * Return: true if @path no longer exists, false otherwise
+ */
+static bool
+remove_tree (const string &path)
+{
+  struct stat st;
+  if (lstat (path.c_str (), &st) != 0)
+    return errno == ENOENT;
+  if (!S_ISDIR (st.st_mode))
+    return unlink (path.c_str ()) == 0;
+
+  // Fan out over the first two levels so that a build tree with a single
+  // top-level src/ directory still gets split across workers
+  unsigned workers = thread::hardware_concurrency ();
+  workers = max (1u, min (workers, 8u));
+  vector<string> subtrees = collect_subdirs (path);
+  if (subtrees.size () < workers)
+    {
+      vector<string> deeper;
+      for (const auto &d : subtrees)
+        {
+          vector<string> below = collect_subdirs (d);
+          deeper.insert (deeper.end (), below.begin (), below.end ());
+        }
+      if (deeper.size () > subtrees.size ())
+        subtrees.swap (deeper);
+    }
+
+  if (workers > 1 && subtrees.size () > 1)
+    {
+      atomic<size_t> next (0);
+      vector<thread> pool;
+      for (unsigned i = 0; i < min<size_t> (workers, subtrees.size ()); ++i)
+        pool.emplace_back ([&] () {
+          size_t idx;
+          while ((idx = next++) < subtrees.size ())
+            {
+              int fd = open (subtrees[idx].c_str (),
+                             O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+              if (fd >= 0)
+                remove_tree_at (fd);
+            }
+        });
+      for (auto &t : pool)
+        t.join ();
+    }
+
+  int fd = open (path.c_str (),
+                 O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  remove_tree_at (fd);
+  return rmdir (path.c_str ()) == 0;
+}
+
+// Background deletions started by remove_tree_async, tagged with the pid
+// that started them so forked children never join their parent's threads
+struct pending_cleanup
+{
+  pid_t owner;
+  thread *worker;
+  shared_ptr<atomic<bool> > done; // set by the worker when it finishes
+};
+static vector<pending_cleanup> pending_cleanups;
+static mutex pending_cleanups_lock;
+
+/**
+ * wait_for_cleanup - Finish background deletions started by this process
+ *
+ * Joins every thread started by remove_tree_async in the current process.
+ * Entries inherited from a parent across fork() are left alone, since
+ * their threads do not exist in the child.
+ */
+static void
+wait_for_cleanup ()
+{
+  lock_guard<mutex> guard (pending_cleanups_lock);
+  pid_t self = getpid ();
+  for (auto &p : pending_cleanups)
+    {
+      if (p.owner != self || !p.worker)
+        continue;
+      p.worker->join ();
+      delete p.worker;
+      p.worker = NULL;
+    }
+}
+
+/**
+ * remove_tree_async - Delete a directory in the background
+ * @path: Directory to delete
+ *
+ * Renames @path out of the way first so the caller can immediately reuse
+ * the name for the next clone, then deletes the renamed tree on a
+ * background thread. Each call joins the threads that have finished, so a
+ * long-lived process holds only the deletions still running.
+ * wait_for_cleanup() must run before the process exits; the first call
+ * registers it with atexit. Falls back to a synchronous delete if the
+ * rename fails.
+ */
+static void
+remove_tree_async (const string &path)
+{
+  struct stat st;
+  if (lstat (path.c_str (), &st) != 0)
+    return;
+
+  static atomic<unsigned> serial (0);
+  string trash = path + ".auh-trash-" + to_string (getpid ()) + "-"
+                 + to_string (serial++);
+  if (rename (path.c_str (), trash.c_str ()) != 0)
+    {
+      remove_tree (path);
+      return;
+    }
+
+  lock_guard<mutex> guard (pending_cleanups_lock);
+  static bool registered = false;
+  if (!registered)
+    registered = atexit (wait_for_cleanup) == 0;
+
+  pid_t self = getpid ();
+  auto finished = [self] (pending_cleanup &p) {
+    if (p.owner != self || !p.worker || !*p.done)
+      return false;
+    p.worker->join ();
+    delete p.worker;
+    return true;
+  };
+  pending_cleanups.erase (remove_if (pending_cleanups.begin (),
+                                     pending_cleanups.end (), finished),
+                          pending_cleanups.end ());
+
+  shared_ptr<atomic<bool> > done (new atomic<bool> (false));
+  thread *worker = new thread ([trash, done] () {
+    remove_tree (trash);
+    *done = true;
+  });
+  pending_cleanups.push_back ({ self, worker, done });
+}
+
+/**
+ * temp_path - Name a private temporary file next to a file
+ * @path: File the temporary file will be renamed over
+ *
+ * The name is unique to the process and the call, so concurrent writers
+ * of @path never truncate or rename each other's half-written file.
+ *
+ * Return: @path with a ".tmp.<pid>.<n>" suffix
+ */
+static string
+temp_path (const string &path)
+{
+  static atomic<unsigned> serial (0);
+  return path + ".tmp." + to_string (getpid ()) + "." + to_string (serial++);
+}
+
+/**
+ * make_dirs - Create a directory and any missing parents
+ * @path: Directory to create
+ *
+ * Return: true if @path exists as a directory afterwards, false otherwise
+ */
+static bool
+make_dirs (const string &path)
+{
+  for (size_t pos = 1; pos <= path.size (); ++pos)
+    {
+      if (pos != path.size () && path[pos] != '/')
+        continue;
+      string part = path.substr (0, pos);
+      if (mkdir (part.c_str (), 0755) != 0 && errno != EEXIST)
+        return false;
+    }
+  struct stat st;
+  return stat (path.c_str (), &st) == 0 && S_ISDIR (st.st_mode);
+}
+
+/**
+ * cache_dir - Locate the per-user auh cache directory
+ *
+ * Uses $XDG_CACHE_HOME/auh, falling back to ~/.cache/auh, and creates it
+ * on first use.
+ *
+ * Return: Path of the cache directory
+ */
+static string
+cache_dir ()
+{
+  string base;
+  const char *xdg = getenv ("XDG_CACHE_HOME");
+  const char *home = getenv ("HOME");
+  if (xdg && *xdg)
+    base = xdg;
+  else if (home && *home)
+    base = string (home) + "/.cache";
+  else
+    base = "/tmp";
+  string dir = base + "/auh";
+  make_dirs (dir);
+  return dir;
+}
+
+/**
+ * format_bytes - Render a byte count for humans
+ * @bytes: Number of bytes
+ *
+ * Return: String such as "512 B", "3.4 MiB" or "1.2 GiB"
+ */
+static string
+format_bytes (unsigned long long bytes)
+{
+  static const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+  double value = bytes;
+  size_t unit = 0;
+  while (value >= 1024 && unit + 1 < sizeof (units) / sizeof (units[0]))
+    {
+      value /= 1024;
+      unit++;
+    }
+  char buf[32];
+  if (unit == 0)
+    snprintf (buf, sizeof (buf), "%llu B", bytes);
+  else
+    snprintf (buf, sizeof (buf), "%.1f %s", value, units[unit]);
+  return buf;
+}
+
+// Set by --offline or AUH_OFFLINE: work from caches, never the network
+static bool offline_mode = false;
+
+/**
+ * is_commit_id - Check whether a git ref is a full commit id
+ * @ref: Ref to check
+ *
+ * Return: true if @ref is 40 lowercase hexadecimal digits
+ */
+static bool
+is_commit_id (const string &ref)
+{
+  return ref.size () == 40
+         && ref.find_first_not_of ("0123456789abcdef") == string::npos;
+}
+
+/**
+ * fetch_cached_clone - Bring the cached clone of a package up to date
+ * @cache_name: Directory name below the clone cache
+ * @url: Git URL of the package repository
+ * @ref: Remote ref to check out ("HEAD" for the default branch)
+ * @shallow: If true, clone and fetch with --depth=1
+ *
+ * Keeps one clone per package under <cache_dir>/clones so that repeated
+ * builds only fetch new commits instead of cloning from scratch. An
+ * existing clone is fetched and hard-reset to @ref; a clone whose update
+ * fails is discarded and cloned again. In offline mode an existing clone
+ * is returned untouched and a missing one fails at once.
+ *
+ * A full commit id as @ref (from a lockfile) is checked out directly when
+ * the clone already contains it; otherwise only that commit is fetched.
+ *
+ * Return: Path of the up-to-date clone, or empty string on failure
+ */
+static string
+fetch_cached_clone (const string &cache_name, const string &url,
+                    const string &ref, bool shallow)
+{
+  string root = cache_dir () + "/clones";
+  make_dirs (root);
+  string dir = root + "/" + cache_name;
+  string depth = shallow ? " --depth=1" : "";
+  bool have = access ((dir + "/.git").c_str (), F_OK) == 0;
+
+  // A pinned commit the clone already has needs no network at all
+  bool pinned = is_commit_id (ref);
+  if (pinned && have)
+    {
+      string rcmd = "git -C " + dir + " cat-file -e " + ref
+                    + "^{commit} 2>/dev/null && git -C " + dir
+                    + " reset -q --hard " + ref + " 2>/dev/null";
+      if (system (rcmd.c_str ()) == 0)
+        return dir;
+    }
+
+  // Offline, the cached clone is used as last fetched
+  if (offline_mode)
+    {
+      if (have && !pinned)
+        return dir;
+      cerr << cache_name << (pinned ? " commit " + ref : string ())
+           << " is not in the clone cache; cannot fetch it offline\n";
+      return {};
+    }
+
+  if (have)
+    {
+      string fcmd = "git -C " + dir + " fetch -q" + depth + " origin " + ref
+                    + " 2>/dev/null && git -C " + dir
+                    + " reset -q --hard FETCH_HEAD 2>/dev/null";
+      if (system (fcmd.c_str ()) == 0)
+        return dir;
+      remove_tree (dir);
+    }
+
+  int rc;
+  if (pinned)
+    {
+      // Ask for the commit itself; servers that refuse unadvertised
+      // commits get a full clone that is then reset to it
+      string fcmd = "(git init -q " + dir + " && git -C " + dir
+                    + " remote add origin " + url + " && git -C " + dir
+                    + " fetch -q" + depth + " origin " + ref + " && git -C "
+                    + dir + " reset -q --hard FETCH_HEAD) 2>/dev/null";
+      rc = system (fcmd.c_str ());
+      if (rc != 0)
+        {
+          remove_tree (dir);
+          string ccmd = "(git clone -q " + url + " " + dir + " && git -C "
+                        + dir + " reset -q --hard " + ref + ") 2>/dev/null";
+          rc = system (ccmd.c_str ());
+        }
+    }
+  else
+    {
+      string branch = ref == "HEAD" ? "" : " --single-branch --branch " + ref;
+      string ccmd = "git clone -q" + branch + depth + " " + url + " " + dir
+                    + " 2>/dev/null";
+      rc = system (ccmd.c_str ());
+    }
+  if (rc != 0)
+    {
+      remove_tree (dir);
+      return {};
+    }
+  return dir;
+}
+
+// Per-workspace accounting reported by materialize_tree
+struct materialize_stats
+{
+  unsigned long long files = 0;
+  unsigned long long bytes = 0;
+  unsigned long long reflinked = 0; // bytes shared through FICLONE
+  unsigned long long hardlinked = 0; // bytes shared through link()
+  unsigned long long copied = 0;     // bytes physically copied
+};
+
+/**
+ * copy_file_data - Copy file contents between descriptors in the kernel
+ * @in: Source descriptor
+ * @out: Destination descriptor
+ * @size: Number of bytes to copy
+ *
+ * Uses copy_file_range, falling back to a read/write loop when the kernel
+ * or filesystem pair does not support it.
+ *
+ * Return: true on success, false otherwise
+ */
+static bool
+copy_file_data (int in, int out, unsigned long long size)
+{
+  unsigned long long done = 0;
+  while (done < size)
+    {
+      ssize_t n = copy_file_range (in, NULL, out, NULL, size - done, 0);
+      if (n > 0)
+        {
+          done += n;
+          continue;
+        }
+      if (n == 0)
+        return true;
+      if (errno != ENOSYS && errno != EXDEV && errno != EINVAL
+          && errno != EOPNOTSUPP)
+        return false;
+
+      // Kernel cannot do it: plain userspace copy of the remainder
+      array<char, 65536> buf;
+      ssize_t r;
+      while ((r = read (in, buf.data (), buf.size ())) > 0)
+        {
+          for (ssize_t off = 0; off < r;)
+            {
+              ssize_t w = write (out, buf.data () + off, r - off);
+              if (w < 0)
+                return false;
+              off += w;
+            }
+        }
+      return r == 0;
+    }
+  return true;
+}
+
+/**
+ * materialize_at - Recreate one directory of a cached clone
+ * @src: Source directory descriptor
+ * @dst: Destination directory descriptor
+ * @stats: Accounting updated for every file
+ * @top: True for the root of the tree, where .git is skipped
+ *
+ * Read-only files are hardlinked, other regular files are reflinked with
+ * FICLONE and copied with copy_file_range when the filesystem cannot share
+ * extents (or @src and @dst live on different filesystems).
+ *
+ * Return: true on success, false otherwise
+ */
+static bool
+materialize_at (int src, int dst, materialize_stats &stats, bool top)
+{
+  DIR *dir = fdopendir (dup (src));
+  if (!dir)
+    return false;
+
+  bool ok = true;
+  struct dirent *ent;
+  while (ok && (ent = readdir (dir)) != NULL)
+    {
+      string name = ent->d_name;
+      if (name == "." || name == ".." || (top && name == ".git"))
+        continue;
+
+      struct stat st;
+      if (fstatat (src, name.c_str (), &st, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+          ok = false;
+          break;
+        }
+
+      if (S_ISDIR (st.st_mode))
+        {
+          int in = openat (src, name.c_str (),
+                           O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+          int out = -1;
+          if (in >= 0 && mkdirat (dst, name.c_str (), st.st_mode & 07777) == 0)
+            out = openat (dst, name.c_str (),
+                          O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+          ok = in >= 0 && out >= 0 && materialize_at (in, out, stats, false);
+          if (in >= 0)
+            close (in);
+          if (out >= 0)
+            close (out);
+        }
+      else if (S_ISLNK (st.st_mode))
+        {
+          vector<char> target (st.st_size + 1);
+          ssize_t len = readlinkat (src, name.c_str (), target.data (),
+                                    target.size ());
+          ok = len >= 0
+               && symlinkat (string (target.data (), len).c_str (), dst,
+                             name.c_str ())
+                      == 0;
+        }
+      else if (S_ISREG (st.st_mode))
+        {
+          stats.files++;
+          stats.bytes += st.st_size;
+
+          // Inputs nobody may write to can safely share the inode
+          if ((st.st_mode & 0222) == 0
+              && linkat (src, name.c_str (), dst, name.c_str (), 0) == 0)
+            {
+              stats.hardlinked += st.st_size;
+              continue;
+            }
+
+          int in = openat (src, name.c_str (), O_RDONLY | O_CLOEXEC);
+          int out = openat (dst, name.c_str (),
+                            O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                            st.st_mode & 07777);
+          if (in < 0 || out < 0)
+            ok = false;
+          else if (ioctl (out, FICLONE, in) == 0)
+            stats.reflinked += st.st_size;
+          else if (copy_file_data (in, out, st.st_size))
+            stats.copied += st.st_size;
+          else
+            ok = false;
+          if (in >= 0)
+            close (in);
+          if (out >= 0)
+            close (out);
+        }
+    }
+
+  closedir (dir);
+  return ok;
+}
+
+/**
+ * materialize_tree - Set up a build directory from a cached clone
+ * @src: Cached clone to copy from
+ * @dst: Build directory to create; must not exist yet
+ * @stats: Filled with file and byte accounting
+ *
+ * The .git directory of @src is not copied; makepkg only needs the
+ * working tree.
+ *
+ * Return: true on success, false otherwise
+ */
+static bool
+materialize_tree (const string &src, const string &dst,
+                  materialize_stats &stats)
+{
+  struct stat st;
+  if (stat (src.c_str (), &st) != 0 || mkdir (dst.c_str (), 0755) != 0)
+    return false;
+
+  int in = open (src.c_str (), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  int out = open (dst.c_str (), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  bool ok = in >= 0 && out >= 0 && materialize_at (in, out, stats, true);
+  if (in >= 0)
+    close (in);
+  if (out >= 0)
+    close (out);
+  return ok;
+}
+
+/**
+ * prepare_workspace - Fetch a package into a fresh build directory
+ * @package: Package name, used for messages
+ * @cache_name: Name of the cached clone (see fetch_cached_clone)
+ * @url: Git URL of the package repository
+ * @ref: Remote ref to check out
+ * @shallow: If true, keep the cached clone shallow
+ * @workdir: Build directory to (re)create
+ *
+ * Updates the cached clone, moves any previous @workdir out of the way and
+ * materializes the clone into @workdir, reporting how many bytes were
+ * shared with the cache instead of copied.
+ *
+ * Return: true on success, false otherwise
+ */
+static bool
+prepare_workspace (const string &package, const string &cache_name,
+                   const string &url, const string &ref, bool shallow,
+                   const string &workdir)
+{
+  string clone = fetch_cached_clone (cache_name, url, ref, shallow);
+  if (clone.empty ())
+    return false;
+
+  remove_tree_async (workdir);
+  auto start = chrono::steady_clock::now ();
+  materialize_stats stats;
+  if (!materialize_tree (clone, workdir, stats))
+    {
+      cerr << "Failed to set up build directory " << workdir << '\n';
+      remove_tree (workdir);
+      return false;
+    }
+  auto ms = chrono::duration_cast<chrono::milliseconds> (
+                chrono::steady_clock::now () - start)
+                .count ();
+
+  cout << "Prepared " << package << " workspace: " << stats.files
+       << " files, " << format_bytes (stats.bytes) << ", "
+       << format_bytes (stats.reflinked + stats.hardlinked)
+       << " shared with cache (" << format_bytes (stats.reflinked)
+       << " reflinked, " << format_bytes (stats.hardlinked)
+       << " hardlinked), " << format_bytes (stats.copied) << " copied in "
+       << ms << " ms\n";
+  return true;
+}
+
+/**
+ * tree_size_at - Sum the disk usage below an open directory
+ * @dirfd: Directory file descriptor; ownership passes to this function
+ *
+ * Return: Allocated bytes (st_blocks) of everything below @dirfd
+ */
+static unsigned long long
+tree_size_at (int dirfd)
+{
+  DIR *dir = fdopendir (dirfd);
+  if (!dir)
+    {
+      close (dirfd);
+      return 0;
+    }
+
+  unsigned long long total = 0;
+  struct dirent *ent;
+  while ((ent = readdir (dir)) != NULL)
+    {
+      const char *name = ent->d_name;
+      if (name[0] == '.'
+          && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        continue;
+      struct stat st;
+      if (fstatat (dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        continue;
+      total += (unsigned long long)st.st_blocks * 512;
+      if (S_ISDIR (st.st_mode))
+        {
+          int sub = openat (dirfd, name,
+                            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+          if (sub >= 0)
+            total += tree_size_at (sub);
+        }
+    }
+  closedir (dir);
+  return total;
+}
+
+/**
+ * tree_size - Measure the disk usage of a directory tree
+ * @path: Directory to measure
+ *
+ * Return: Allocated bytes below @path, or 0 if it does not exist
+ */
+static unsigned long long
+tree_size (const string &path)
+{
+  int fd = open (path.c_str (), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  return fd < 0 ? 0 : tree_size_at (fd);
+}
+
+/**
+ * existing_ancestor - Find the nearest existing path at or above a path
+ * @path: Path that may not exist yet, such as a build directory
+ *
+ * Return: @path or its nearest existing parent, "." or "/" at worst
+ */
+static string
+existing_ancestor (const string &path)
+{
+  string probe = path.empty () ? "." : path;
+  struct stat st;
+  while (stat (probe.c_str (), &st) != 0 && probe != "." && probe != "/")
+    {
+      size_t slash = probe.find_last_of ('/');
+      if (slash == string::npos)
+        probe = ".";
+      else
+        probe = slash == 0 ? "/" : probe.substr (0, slash);
+    }
+  return probe;
+}
+
+/**
+ * free_space - Report space available to unprivileged writers
+ * @path: Any path on the filesystem of interest; if it does not exist yet,
+ *        its nearest existing parent is used
+ *
+ * Return: Available bytes (f_bavail), or 0 if nothing could be queried
+ */
+static unsigned long long
+free_space (const string &path)
+{
+  struct statvfs vfs;
+  if (statvfs (existing_ancestor (path).c_str (), &vfs) != 0)
+    return 0;
+  return (unsigned long long)vfs.f_bavail * vfs.f_frsize;
+}
+
+// Footprint estimates for packages without build history: the cached
+// clone size times a factor, but never less than the floor
+static const unsigned long long footprint_floor = 256ULL << 20;
+static const unsigned long long footprint_factor = 20;
+
+// Size past which the footprint history is rewritten with one line per
+// package
+static const off_t footprint_compact_size = 64 << 10;
+
+/**
+ * read_footprints - Parse footprint history lines
+ * @f: Open history file
+ * @footprints: Filled with the last entry of each package
+ *
+ * Return: Number of lines read
+ */
+static size_t
+read_footprints (FILE *f, map<string, unsigned long long> &footprints)
+{
+  char name[256];
+  unsigned long long bytes;
+  size_t lines = 0;
+  for (; fscanf (f, "%255s %llu", name, &bytes) == 2; lines++)
+    footprints[name] = bytes;
+  return lines;
+}
+
+/**
+ * load_footprints - Read recorded peak build sizes
+ *
+ * The history lives in <cache_dir>/footprints as "<package> <bytes>"
+ * lines appended after every successful build; the last entry wins.
+ * record_footprint() keeps the file compact.
+ *
+ * Return: Map from package name to its last recorded footprint
+ */
+static map<string, unsigned long long>
+load_footprints ()
+{
+  map<string, unsigned long long> footprints;
+  unique_ptr<FILE, decltype (&fclose)> f (
+      fopen ((cache_dir () + "/footprints").c_str (), "r"), fclose);
+  if (f)
+    read_footprints (f.get (), footprints);
+  return footprints;
+}
+
+/**
+ * compact_footprints - Rewrite the footprint history without stale lines
+ * @fd: History file, open for appending
+ * @path: Its path
+ *
+ * Only one process compacts at a time (an flock on @fd); the others keep
+ * appending. A line appended to the old file between reading and the
+ * rename is lost, which only costs that package its next estimate. The
+ * file is left alone when most of its lines are still current, so a host
+ * with many packages does not rewrite it after every build.
+ */
+static void
+compact_footprints (int fd, const string &path)
+{
+  if (flock (fd, LOCK_EX | LOCK_NB) != 0)
+    return;
+  map<string, unsigned long long> footprints;
+  size_t lines = 0;
+  {
+    unique_ptr<FILE, decltype (&fclose)> f (fopen (path.c_str (), "r"),
+                                            fclose);
+    if (f)
+      lines = read_footprints (f.get (), footprints);
+  }
+  if (footprints.size () * 2 <= lines)
+    {
+      string tmp = temp_path (path);
+      {
+        ofstream out (tmp, ios::trunc);
+        for (const auto &e : footprints)
+          out << e.first << ' ' << e.second << '\n';
+      }
+      if (rename (tmp.c_str (), path.c_str ()) != 0)
+        unlink (tmp.c_str ());
+    }
+  flock (fd, LOCK_UN);
+}
+
+/**
+ * record_footprint - Remember how much disk a build used
+ * @package: Package that was built
+ * @builddir: Its build directory, measured before cleanup
+ *
+ * Appends one line with O_APPEND so that parallel builds can record
+ * concurrently without locking, and compacts the history once it grows
+ * past footprint_compact_size.
+ */
+static void
+record_footprint (const string &package, const string &builddir)
+{
+  unsigned long long bytes = tree_size (builddir);
+  if (bytes == 0)
+    return;
+  string path = cache_dir () + "/footprints";
+  string line = package + " " + to_string (bytes) + "\n";
+  int fd = open (path.c_str (), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                 0644);
+  if (fd < 0)
+    return;
+  struct stat st;
+  if (write (fd, line.data (), line.size ()) < 0)
+    cerr << "Failed to record build footprint for " << package << '\n';
+  else if (fstat (fd, &st) == 0 && st.st_size > footprint_compact_size)
+    compact_footprints (fd, path);
+  close (fd);
+}
+
+/**
+ * struct vcs_source - Upstream repository a VCS package builds from
+ * @kind: "git" or "svn"
+ * @url: Repository URL without the VCS prefix and fragment
+ * @ref: Git ref that is built, "HEAD" or refs/heads/<branch>
+ * @dir: Name of its checkout below $SRCDEST, as makepkg names it
+ * @commit: Commit (git) or revision (svn) that was built
+ */
+struct vcs_source
+{
+  string kind;
+  string url;
+  string ref;
+  string dir;
+  string commit;
+};
+
+/**
+ * read_vcs_sources - List the VCS sources of a package that follow upstream
+ * @srcinfo: Path of the package's .SRCINFO
+ *
+ * Takes the git+ and svn+ entries of every source array. Sources pinned
+ * with a commit=, tag= or revision= fragment never move and are left out.
+ *
+ * Return: The sources, without @commit
+ */
+static vector<vcs_source>
+read_vcs_sources (const string &srcinfo)
+{
+  vector<vcs_source> sources;
+  ifstream in (srcinfo);
+  string line;
+  while (getline (in, line))
+    {
+      size_t key = line.find_first_not_of (" \t");
+      size_t eq = line.find (" = ");
+      if (key == string::npos || eq == string::npos
+          || line.compare (key, 6, "source") != 0)
+        continue;
+
+      // [<dir>::]<kind>+<url>[#<fragment>][?signed]
+      string entry = line.substr (eq + 3);
+      size_t colons = entry.find ("::");
+      vcs_source s;
+      s.url = colons == string::npos ? entry : entry.substr (colons + 2);
+      if (s.url.compare (0, 4, "git+") == 0)
+        s.kind = "git";
+      else if (s.url.compare (0, 4, "svn+") == 0)
+        s.kind = "svn";
+      else
+        continue;
+      s.url.erase (0, 4);
+      string fragment;
+      size_t hash = s.url.find ('#');
+      if (hash != string::npos)
+        {
+          fragment = s.url.substr (hash + 1);
+          fragment = fragment.substr (0, fragment.find ('?'));
+          s.url.erase (hash);
+        }
+      else if (s.url.size () > 7
+               && s.url.compare (s.url.size () - 7, 7, "?signed") == 0)
+        s.url.erase (s.url.size () - 7);
+      if (fragment.compare (0, 7, "commit=") == 0
+          || fragment.compare (0, 4, "tag=") == 0
+          || fragment.compare (0, 9, "revision=") == 0)
+        continue;
+      s.ref = fragment.compare (0, 7, "branch=") == 0
+                  ? "refs/heads/" + fragment.substr (7)
+                  : "HEAD";
+
+      if (colons != string::npos)
+        s.dir = entry.substr (0, colons);
+      else
+        {
+          s.dir = s.url;
+          while (!s.dir.empty () && s.dir.back () == '/')
+            s.dir.pop_back ();
+          s.dir.erase (0, s.dir.find_last_of ('/') + 1);
+          if (s.kind == "git")
+            s.dir = s.dir.substr (0, s.dir.find (".git"));
+        }
+      if (!s.url.empty () && !s.dir.empty ())
+        sources.push_back (s);
+    }
+  return sources;
+}
+
+/**
+ * makepkg_dest - Find where makepkg keeps downloaded sources or packages
+ * @var: "SRCDEST" or "PKGDEST"
+ * @own: Set to whether auh chose the directory itself, if not NULL
+ *
+ * As in makepkg, the environment wins over makepkg.conf. The
+ * configuration files are sourced by bash once per process. Only when
+ * neither sets @var does auh supply <cache_dir>/sources or
+ * <cache_dir>/packages, so a user's own choice is never overridden.
+ *
+ * Return: Directory holding sources or built packages
+ */
+static string
+makepkg_dest (const char *var, bool *own = NULL)
+{
+  static const vector<string> conf = [] () {
+    string out = run_capture (
+        "bash -c 'for f in /etc/makepkg.conf /etc/makepkg.conf.d/*.conf"
+        " \"${XDG_CONFIG_HOME:-$HOME/.config}/pacman/makepkg.conf\""
+        " \"$HOME/.makepkg.conf\"; do [ -r \"$f\" ] && . \"$f\"; done"
+        " >/dev/null 2>&1; printf \"%s\\n%s\\n\" \"$SRCDEST\" \"$PKGDEST\"'"
+        " 2>/dev/null");
+    vector<string> v (2);
+    size_t nl = out.find ('\n');
+    if (nl != string::npos)
+      {
+        v[0] = out.substr (0, nl);
+        v[1] = out.substr (nl + 1, out.find ('\n', nl + 1) - nl - 1);
+      }
+    return v;
+  }();
+
+  bool pkg = strcmp (var, "PKGDEST") == 0;
+  const char *env = getenv (var);
+  string dir = env && *env ? string (env) : conf[pkg];
+  if (own)
+    *own = dir.empty ();
+  return dir.empty () ? cache_dir () + (pkg ? "/packages" : "/sources") : dir;
+}
+
+/**
+ * record_vcs_commits - Remember which upstream commits a build used
+ * @package: Package that was built
+ * @builddir: Its build directory, holding .SRCINFO
+ *
+ * Reads the commit of each VCS source from makepkg's checkout in
+ * $SRCDEST and writes "<kind>\t<url>\t<ref>\t<commit>" lines to
+ * <cache_dir>/vcs/<package>, which list_vcs_moved() compares with the
+ * upstream heads. Packages without VCS sources leave no file.
+ */
+static void
+record_vcs_commits (const string &package, const string &builddir)
+{
+  vector<vcs_source> sources = read_vcs_sources (builddir + "/.SRCINFO");
+  if (sources.empty ())
+    return;
+  string srcdest = makepkg_dest ("SRCDEST");
+
+  string lines;
+  for (auto &s : sources)
+    {
+      string checkout = shell_quote (srcdest + "/" + s.dir);
+      string cmd = s.kind == "git"
+                       ? "git -C " + checkout + " rev-parse --verify -q "
+                             + shell_quote (s.ref + "^{commit}")
+                       : "svn info --show-item last-changed-revision "
+                             + checkout;
+      s.commit = run_capture (cmd + " 2>/dev/null");
+      while (!s.commit.empty () && isspace ((unsigned char)s.commit.back ()))
+        s.commit.pop_back ();
+      if (!s.commit.empty ())
+        lines += s.kind + "\t" + s.url + "\t" + s.ref + "\t" + s.commit + "\n";
+    }
+  if (lines.empty ())
+    return;
+
+  string dir = cache_dir () + "/vcs";
+  make_dirs (dir);
+  string path = dir + "/" + package, tmp = temp_path (path);
+  ofstream (tmp, ios::trunc) << lines;
+  if (rename (tmp.c_str (), path.c_str ()) != 0)
+    unlink (tmp.c_str ());
+}
+
+/**
+ * estimate_footprint - Predict the peak disk usage of a build
+ * @package: Package to build
+ * @footprints: History loaded by load_footprints()
+ * @known: Set to true if the estimate comes from build history
+ *
+ * Uses the last recorded footprint plus a 25% margin when available,
+ * otherwise the size of the cached clone times footprint_factor, bounded
+ * below by footprint_floor.
+ *
+ * Return: Estimated peak bytes
+ */
+static unsigned long long
+estimate_footprint (const string &package,
+                    const map<string, unsigned long long> &footprints,
+                    bool &known)
+{
+  auto it = footprints.find (package);
+  known = it != footprints.end ();
+  if (known)
+    return it->second + it->second / 4;
+  unsigned long long source = tree_size (cache_dir () + "/clones/" + package);
+  return max (footprint_floor, source * footprint_factor);
+}
+
+/**
+ * private_dir - Create or verify a directory only this user can change
+ * @dir: Directory path
+ * @create: Create @dir with mode 0700 if it does not exist
+ *
+ * Files in a directory that other users can write may be swapped for
+ * symlinks or planted outright, so lock files, state and sockets are
+ * only trusted in a directory that passes this check.
+ *
+ * Return: true if @dir is a directory (not a symlink) owned by the
+ *         effective user and writable by nobody else, false otherwise
+ */
+static bool
+private_dir (const string &dir, bool create)
+{
+  if (create)
+    mkdir (dir.c_str (), 0700);
+  struct stat st;
+  return lstat (dir.c_str (), &st) == 0 && S_ISDIR (st.st_mode)
+         && st.st_uid == geteuid () && (st.st_mode & 022) == 0;
+}
+
+/**
+ * lock_dir - Locate the directory of the coordination locks
+ *
+ * Lock files live in $AUH_LOCK_DIR, $XDG_RUNTIME_DIR/auh-locks or
+ * <cache_dir>/locks, and only if private_dir() accepts the directory: a
+ * lock file other users could write would let them redirect our writes
+ * through a symlink, forge a "done ok" state or hold a lock forever.
+ * Locks therefore coordinate the processes of one user; concurrent
+ * pacman runs of different users are still refused by pacman's own
+ * database lock.
+ *
+ * Return: Path of the lock directory, or empty string if there is no
+ *         trustworthy one
+ */
+static string
+lock_dir ()
+{
+  const char *env = getenv ("AUH_LOCK_DIR");
+  const char *runtime = getenv ("XDG_RUNTIME_DIR");
+  string dir = env && *env                 ? string (env)
+               : runtime && *runtime ? string (runtime) + "/auh-locks"
+                                     : cache_dir () + "/locks";
+  if (private_dir (dir, true))
+    return dir;
+
+  static once_flag warned;
+  call_once (warned, [&dir] () {
+    cerr << "Not using lock directory " << dir
+         << ": it must be owned by this user and not writable by others\n";
+  });
+  return {};
+}
+
+// A lock is waited for at most this many seconds (a long build may hold
+// a package lock for a while) before auh gives up
+static const unsigned lock_wait_timeout = 2 * 3600;
+
+/**
+ * struct host_lock - An flock held on a file in lock_dir()
+ * @fd: Open lock file, or -1 if locking was not possible
+ * @waited: True if another process held the lock when it was requested
+ * @previous: State the previous holder left behind ("done ok ..." or
+ *            "done failed ..."), set only when @waited is true
+ * @timed_out: True if auh gave up waiting; the caller must not proceed
+ * @outcome: Result recorded for the next holder when the lock is released
+ *
+ * The lock file doubles as a tiny state record: the holder writes
+ * "running <pid> <activity>" while it works and "done <outcome> <pid>
+ * <activity>" on release, so that a process that waited can tell whether
+ * the work it needed was just completed and reuse the result.
+ */
+struct host_lock
+{
+  int fd = -1;
+  bool waited = false;
+  bool timed_out = false;
+  string previous;
+  string outcome = "failed";
+  string activity;
+
+  ~host_lock ()
+  {
+    if (fd < 0)
+      return;
+    string state = "done " + outcome + " " + to_string (getpid ()) + " "
+                   + activity + "\n";
+    if (ftruncate (fd, 0) == 0)
+      pwrite (fd, state.data (), state.size (), 0);
+    flock (fd, LOCK_UN);
+    close (fd);
+  }
+
+  // A previous holder finished the same work successfully while we waited
+  bool
+  reusable () const
+  {
+    return waited && previous.compare (0, 8, "done ok ") == 0;
+  }
+};
+
+/**
+ * read_lock_state - Read the state line of a lock file
+ * @fd: Open lock file
+ *
+ * Return: First line of the file without the newline
+ */
+static string
+read_lock_state (int fd)
+{
+  char buf[256];
+  ssize_t n = pread (fd, buf, sizeof (buf) - 1, 0);
+  if (n <= 0)
+    return {};
+  string state (buf, n);
+  size_t nl = state.find ('\n');
+  return nl == string::npos ? state : state.substr (0, nl);
+}
+
+/**
+ * open_lock_file - Open or create a lock file in lock_dir()
+ * @path: Lock file
+ *
+ * Symlinks are refused (O_NOFOLLOW) and the result must be a regular
+ * file owned by the effective user, since its contents are truncated,
+ * rewritten and trusted by reusable().
+ *
+ * Return: Open file descriptor, or -1 on failure
+ */
+static int
+open_lock_file (const string &path)
+{
+  int fd = open (path.c_str (), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+                 0600);
+  struct stat st;
+  if (fd >= 0
+      && (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode)
+          || st.st_uid != geteuid ()))
+    {
+      close (fd);
+      fd = -1;
+    }
+  return fd;
+}
+
+/**
+ * acquire_host_lock - Take an exclusive lock shared by this user's auh runs
+ * @name: Lock name, such as "pkg-yay" or "pacman"
+ * @activity: What this process is about to do, shown to waiters
+ *
+ * Blocks until no other auh process of this user holds @name, for at
+ * most lock_wait_timeout seconds. While waiting, the other holder's
+ * activity is printed once. Failing to create the lock file is not fatal;
+ * the returned lock then simply does not exclude anyone. Giving up sets
+ * @timed_out in the returned lock.
+ *
+ * Return: The held lock; it is released when destroyed
+ */
+static unique_ptr<host_lock>
+acquire_host_lock (const string &name, const string &activity)
+{
+  unique_ptr<host_lock> lock (new host_lock);
+  lock->activity = activity;
+  string dir = lock_dir ();
+  int fd = dir.empty () ? -1 : open_lock_file (dir + "/" + name + ".lock");
+  if (fd < 0)
+    return lock;
+
+  if (flock (fd, LOCK_EX | LOCK_NB) != 0)
+    {
+      string holder = read_lock_state (fd);
+      cout << "Waiting for another auh process"
+           << (holder.empty () ? "" : " (" + holder + ")") << "...\n";
+      auto deadline = chrono::steady_clock::now ()
+                      + chrono::seconds (lock_wait_timeout);
+      while (flock (fd, LOCK_EX | LOCK_NB) != 0)
+        {
+          if (errno != EWOULDBLOCK && errno != EINTR)
+            {
+              close (fd);
+              return lock;
+            }
+          if (chrono::steady_clock::now () >= deadline)
+            {
+              cerr << "Gave up waiting for the " << name << " lock\n";
+              lock->timed_out = true;
+              close (fd);
+              return lock;
+            }
+          this_thread::sleep_for (chrono::milliseconds (200));
+        }
+      lock->waited = true;
+      lock->previous = read_lock_state (fd);
+    }
+
+  lock->fd = fd;
+  string state
+      = "running " + to_string (getpid ()) + " " + activity + "\n";
+  if (ftruncate (fd, 0) == 0)
+    pwrite (fd, state.data (), state.size (), 0);
+  return lock;
+}
+
+/**
+ * struct space_reservation - Disk space claimed by a running build
+ * @path: Reservation file in lock_dir(), removed on release
+ * @fd: Open reservation file, held with an exclusive flock
+ *
+ * The file, named space-<pid>-<package>.lock, records "<device> <bytes>
+ * <build directory>". reserved_space() counts what the build has not
+ * written yet against the free space other builds may plan with. The
+ * flock outlives neither the holder nor its forked children, so a file
+ * whose flock can be taken was left by a process that died.
+ */
+struct space_reservation
+{
+  string path;
+  int fd = -1;
+
+  ~space_reservation ()
+  {
+    unlink (path.c_str ());
+    close (fd);
+  }
+};
+
+/**
+ * reserve_space - Claim disk space for a build
+ * @package: Package to build
+ * @builddir: Directory it is built in; it may not exist yet
+ * @bytes: Expected peak footprint
+ *
+ * The file is written and locked under a temporary name and renamed into
+ * place, so reserved_space() never sees it unlocked.
+ *
+ * Return: The reservation, released when destroyed, or nullptr if there
+ *         is nothing to reserve or no trustworthy lock_dir()
+ */
+static unique_ptr<space_reservation>
+reserve_space (const string &package, const string &builddir,
+               unsigned long long bytes)
+{
+  string dir = lock_dir ();
+  struct stat st;
+  if (bytes == 0 || dir.empty ()
+      || stat (existing_ancestor (builddir).c_str (), &st) != 0)
+    return nullptr;
+  string path = dir + "/space-" + to_string (getpid ()) + "-" + package
+                + ".lock";
+  string tmp = temp_path (path);
+  int fd = open_lock_file (tmp);
+  if (fd < 0)
+    return nullptr;
+  string record = to_string ((unsigned long long)st.st_dev) + " "
+                  + to_string (bytes) + " " + builddir + "\n";
+  if (flock (fd, LOCK_EX | LOCK_NB) != 0
+      || write (fd, record.data (), record.size ()) != (ssize_t)record.size ()
+      || rename (tmp.c_str (), path.c_str ()) != 0)
+    {
+      unlink (tmp.c_str ());
+      close (fd);
+      return nullptr;
+    }
+  unique_ptr<space_reservation> claim (new space_reservation);
+  claim->path = path;
+  claim->fd = fd;
+  return claim;
+}
+
+/**
+ * reserved_space - Sum the space running builds have claimed but not used
+ * @path: Any path on the filesystem of interest
+ *
+ * Counts the reservations of this user's builds on the filesystem of
+ * @path, each less what its build directory already holds (that part is
+ * no longer free anyway). Stale reservations are removed.
+ *
+ * Return: Outstanding reserved bytes
+ */
+static unsigned long long
+reserved_space (const string &path)
+{
+  string dir = lock_dir ();
+  struct stat target;
+  if (dir.empty () || stat (existing_ancestor (path).c_str (), &target) != 0)
+    return 0;
+  vector<string> files;
+  DIR *d = opendir (dir.c_str ());
+  if (!d)
+    return 0;
+  struct dirent *ent;
+  while ((ent = readdir (d)) != NULL)
+    {
+      string name = ent->d_name;
+      if (name.compare (0, 6, "space-") == 0 && name.size () > 11
+          && name.compare (name.size () - 5, 5, ".lock") == 0)
+        files.push_back (dir + "/" + name);
+    }
+  closedir (d);
+
+  unsigned long long total = 0;
+  for (const auto &file : files)
+    {
+      int fd = open_lock_file (file);
+      if (fd < 0)
+        continue;
+      if (flock (fd, LOCK_SH | LOCK_NB) == 0)
+        {
+          unlink (file.c_str ());
+          close (fd);
+          continue;
+        }
+      char buf[4096];
+      ssize_t n = pread (fd, buf, sizeof (buf) - 1, 0);
+      close (fd);
+      unsigned long long dev, bytes;
+      int used = 0;
+      buf[n > 0 ? n : 0] = '\0';
+      if (sscanf (buf, "%llu %llu %n", &dev, &bytes, &used) != 2 || !used
+          || dev != (unsigned long long)target.st_dev)
+        continue;
+      string builddir (buf + used);
+      if (!builddir.empty () && builddir.back () == '\n')
+        builddir.pop_back ();
+      unsigned long long written = tree_size (builddir);
+      total += bytes > written ? bytes - written : 0;
+    }
+  return total;
+}
+
+/**
+ * space_available - Report free space not promised to running builds
+ * @path: Any path on the filesystem of interest
+ *
+ * Return: free_space() less reserved_space(), at least 0
+ */
+static unsigned long long
+space_available (const string &path)
+{
+  unsigned long long avail = free_space (path);
+  unsigned long long reserved = reserved_space (path);
+  return avail > reserved ? avail - reserved : 0;
+}
+
+/**
+ * run_pacman - Run a privileged pacman transaction under the host lock
+ * @args: Arguments passed to pacman
+ *
+ * Serializes pacman transactions between concurrent auh processes instead
+ * of letting the loser fail on pacman's own database lock.
+ *
+ * Return: Exit status from system()
+ */
+static int
+run_pacman (const string &args)
+{
+  unique_ptr<host_lock> lock = acquire_host_lock ("pacman", "pacman " + args);
+  if (lock->timed_out)
+    return 1;
+  int rc = system (("sudo pacman " + args).c_str ());
+  lock->outcome = rc == 0 ? "ok" : "failed";
+  return rc;
+}
+
+/**
+ * makepkg_command - Build a makepkg invocation that honours the pacman lock
+ * @args: Arguments passed to makepkg
+ *
+ * makepkg calls pacman itself to install dependencies and the built
+ * package. Pointing $PACMAN at a small flock(1) wrapper in the cache
+ * directory makes those calls take the same host lock as run_pacman().
+ * The wrapper runs as root under sudo, so it only opens the lock file
+ * for reading, which never creates it; auh creates it beforehand, and
+ * without a trustworthy lock_dir() makepkg runs plain pacman. Like
+ * acquire_host_lock(), the wrapper gives up after lock_wait_timeout
+ * seconds. It is written to a temporary file and renamed into place, so
+ * a concurrent build never runs a partial script.
+ *
+ * Downloaded sources and built packages are kept in <cache_dir>/sources
+ * and <cache_dir>/packages when neither the environment nor makepkg.conf
+ * sets $SRCDEST or $PKGDEST (see makepkg_dest()), which is what lets
+ * offline mode rebuild or reinstall a package. Offline, VCS sources are
+ * built at their checked-out revision (--holdver).
+ *
+ * Return: Shell command running makepkg with @args
+ */
+static string
+makepkg_command (const string &args)
+{
+  string dir = lock_dir (), lock = dir + "/pacman.lock", wrapper;
+  int lfd = dir.empty () ? -1 : open_lock_file (lock);
+  if (lfd >= 0)
+    {
+      close (lfd);
+      wrapper = cache_dir () + "/pacman-locked";
+    }
+
+  string script = "#!/bin/sh\nexec 9<" + shell_quote (lock)
+                  + " || exit 1\nflock -w " + to_string (lock_wait_timeout)
+                  + " 9 || exit 1\nexec pacman \"$@\"\n";
+  string current;
+  if (!wrapper.empty ())
+    {
+      ifstream in (wrapper);
+      getline (in, current, '\0');
+    }
+  if (!wrapper.empty ()
+      && (current != script || access (wrapper.c_str (), X_OK) != 0))
+    {
+      string tmp = temp_path (wrapper);
+      int fd = open (tmp.c_str (),
+                     O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+      bool ok = fd >= 0
+                && write (fd, script.data (), script.size ())
+                       == (ssize_t)script.size ()
+                && fchmod (fd, 0755) == 0;
+      if (fd >= 0)
+        close (fd);
+      ok = ok && rename (tmp.c_str (), wrapper.c_str ()) == 0;
+      if (!ok)
+        {
+          unlink (tmp.c_str ());
+          wrapper.clear ();
+        }
+    }
+
+  string env;
+  if (!wrapper.empty ())
+    env += "PACMAN=" + wrapper + " ";
+  for (const char *var : { "SRCDEST", "PKGDEST" })
+    {
+      bool own;
+      string dir = makepkg_dest (var, &own);
+      if (!own)
+        continue;
+      make_dirs (dir);
+      env += string (var) + "=" + shell_quote (dir) + " ";
+    }
+  return env + "makepkg " + args + (offline_mode ? " --holdver" : "");
+}
+
+/**
+ * rpmvercmp - Compare two version segments the way pacman does
+ * @a: First version string (without epoch or release)
+ * @b: Second version string
+ *
+ * Port of libalpm's rpmvercmp: versions are split into alternating runs of
+ * digits and letters, numeric runs compare numerically, alphabetic runs
+ * lexically, and a numeric run is newer than an alphabetic one.
+ *
+ * Return: -1 if @a is older, 0 if equal, 1 if @a is newer
+ */
+static int
+rpmvercmp (const string &a, const string &b)
+{
+  if (a == b)
+    return 0;
+
+  size_t one = 0, two = 0, ptr1 = 0, ptr2 = 0;
+  while (one < a.size () && two < b.size ())
+    {
+      while (one < a.size () && !isalnum ((unsigned char)a[one]))
+        one++;
+      while (two < b.size () && !isalnum ((unsigned char)b[two]))
+        two++;
+      if (one >= a.size () || two >= b.size ())
+        break;
+
+      // If the separator lengths were different, we are also finished
+      if (one - ptr1 != two - ptr2)
+        return one - ptr1 < two - ptr2 ? -1 : 1;
+
+      ptr1 = one;
+      ptr2 = two;
+      bool isnum = isdigit ((unsigned char)a[ptr1]);
+      if (isnum)
+        {
+          while (ptr1 < a.size () && isdigit ((unsigned char)a[ptr1]))
+            ptr1++;
+          while (ptr2 < b.size () && isdigit ((unsigned char)b[ptr2]))
+            ptr2++;
+        }
+      else
+        {
+          while (ptr1 < a.size () && isalpha ((unsigned char)a[ptr1]))
+            ptr1++;
+          while (ptr2 < b.size () && isalpha ((unsigned char)b[ptr2]))
+            ptr2++;
+        }
+
+      // Segments of different types: numeric is newer than alphabetic
+      if (two == ptr2)
+        return isnum ? 1 : -1;
+
+      string seg1 = a.substr (one, ptr1 - one);
+      string seg2 = b.substr (two, ptr2 - two);
+      if (isnum)
+        {
+          seg1.erase (0, min (seg1.find_first_not_of ('0'), seg1.size ()));
+          seg2.erase (0, min (seg2.find_first_not_of ('0'), seg2.size ()));
+          if (seg1.size () != seg2.size ())
+            return seg1.size () > seg2.size () ? 1 : -1;
+        }
+      int rc = seg1.compare (seg2);
+      if (rc != 0)
+        return rc < 0 ? -1 : 1;
+
+      one = ptr1;
+      two = ptr2;
+    }
+
+  bool end1 = one >= a.size (), end2 = two >= b.size ();
+  if (end1 && end2)
+    return 0;
+  // The remaining one is older if it is an alpha suffix ("1.0a" < "1.0"),
+  // newer otherwise ("1.0.1" > "1.0")
+  if ((end1 && !isalpha ((unsigned char)b[two]))
+      || (!end1 && isalpha ((unsigned char)a[one])))
+    return -1;
+  return 1;
+}
+
+/**
+ * vercmp - Compare two full package versions
+ * @a: First version, "[epoch:]version[-release]"
+ * @b: Second version
+ *
+ * Same ordering as vercmp(8): epochs first, then versions, then releases
+ * when both sides have one.
+ *
+ * Return: -1 if @a is older, 0 if equal, 1 if @a is newer
+ */
+static int
+vercmp (const string &a, const string &b)
+{
+  if (a == b)
+    return 0;
+
+  // Split "[epoch:]version[-release]" like libalpm's parseEVR
+  struct evr
+  {
+    string epoch, version, release;
+    bool has_release;
+  };
+  auto parse = [] (const string &s) {
+    evr r;
+    size_t digits = 0;
+    while (digits < s.size () && isdigit ((unsigned char)s[digits]))
+      digits++;
+    size_t dash = s.rfind ('-');
+    if (dash != string::npos && dash < digits)
+      dash = string::npos;
+    size_t vstart = 0;
+    if (digits < s.size () && s[digits] == ':')
+      {
+        r.epoch = digits ? s.substr (0, digits) : "0";
+        vstart = digits + 1;
+      }
+    else
+      r.epoch = "0";
+    r.has_release = dash != string::npos;
+    r.version = s.substr (vstart, (r.has_release ? dash : s.size ()) - vstart);
+    if (r.has_release)
+      r.release = s.substr (dash + 1);
+    return r;
+  };
+
+  evr x = parse (a), y = parse (b);
+  int rc = rpmvercmp (x.epoch, y.epoch);
+  if (rc == 0)
+    rc = rpmvercmp (x.version, y.version);
+  if (rc == 0 && x.has_release && y.has_release)
+    rc = rpmvercmp (x.release, y.release);
+  return rc;
+}
+
+/**
+ * pacman_db_path - Locate the pacman database directory
+ *
+ * Return: $AUH_DBPATH if set, otherwise /var/lib/pacman
+ */
+static string
+pacman_db_path ()
+{
+  const char *env = getenv ("AUH_DBPATH");
+  return env && *env ? env : "/var/lib/pacman";
+}
+
+/**
+ * hash_bytes - Hash a string one 8-byte word at a time
+ * @s: Bytes to hash
+ * @len: Number of bytes
+ *
+ * Package descriptions dominate the bytes hashed while loading the AUR
+ * index, so this avoids a byte-at-a-time hash.
+ *
+ * Return: 64-bit hash of @s
+ */
+static inline uint64_t
+hash_bytes (const char *s, size_t len)
+{
+  const uint64_t k = 0x9e3779b97f4a7c15ull;
+  uint64_t h = len * k, w;
+  for (; len >= 8; s += 8, len -= 8)
+    {
+      memcpy (&w, s, 8);
+      h = (h ^ w) * k;
+      h ^= h >> 29;
+    }
+  if (len)
+    {
+      w = 0;
+      memcpy (&w, s, len);
+      h = (h ^ w) * k;
+      h ^= h >> 29;
+    }
+  return h;
+}
+
+// Id returned for strings and names that are not present
+static const uint32_t no_id = UINT32_MAX;
+
+/**
+ * struct string_pool - Arena of interned strings addressed by 32-bit ids
+ * @arena: NUL-terminated strings stored back to back
+ * @offsets: Offset in @arena of each string, indexed by id
+ * @slots: Open-addressing hash table holding id + 1, 0 for an empty slot
+ *
+ * Every distinct string is stored once, so the thousands of packages
+ * sharing a maintainer, a repository or a dependency cost one copy and
+ * a 32-bit id each instead of a heap-allocated std::string. Pointers
+ * returned by c_str() are invalidated by the next intern().
+ */
+struct string_pool
+{
+  vector<char> arena;
+  vector<uint32_t> offsets;
+  vector<uint32_t> slots;
+
+  static uint32_t
+  hash (const char *s, size_t len)
+  {
+    uint64_t h = hash_bytes (s, len);
+    return h ^ (h >> 32);
+  }
+
+  // Slot holding @s, or the empty slot where it would be inserted
+  size_t
+  probe (const char *s, size_t len) const
+  {
+    size_t mask = slots.size () - 1;
+    for (size_t i = hash (s, len) & mask;; i = (i + 1) & mask)
+      {
+        uint32_t id = slots[i];
+        if (id == 0
+            || (length (id - 1) == len
+                && memcmp (c_str (id - 1), s, len) == 0))
+          return i;
+      }
+  }
+
+  uint32_t
+  lookup (const char *s, size_t len) const
+  {
+    if (slots.empty ())
+      return no_id;
+    uint32_t id = slots[probe (s, len)];
+    return id ? id - 1 : no_id;
+  }
+
+  uint32_t
+  lookup (const string &s) const
+  {
+    return lookup (s.data (), s.size ());
+  }
+
+  // Size the table and arena for @n strings totalling @bytes
+  void
+  reserve (size_t n, size_t bytes)
+  {
+    size_t want = 64;
+    while (want < 2 * n)
+      want *= 2;
+    if (want > slots.size ())
+      {
+        vector<uint32_t> old;
+        old.swap (slots);
+        slots.assign (want, 0);
+        for (uint32_t id : old)
+          if (id)
+            slots[probe (c_str (id - 1), length (id - 1))] = id;
+      }
+    offsets.reserve (n);
+    arena.reserve (bytes);
+  }
+
+  uint32_t
+  intern (const char *s, size_t len)
+  {
+    // Keep the table at most half full
+    if (2 * (offsets.size () + 1) > slots.size ())
+      reserve (2 * offsets.size () + 1, 0);
+
+    size_t slot = probe (s, len);
+    if (slots[slot])
+      return slots[slot] - 1;
+    uint32_t id = offsets.size ();
+    offsets.push_back (arena.size ());
+    arena.insert (arena.end (), s, s + len);
+    arena.push_back ('\0');
+    slots[slot] = id + 1;
+    return id;
+  }
+
+  uint32_t
+  intern (const string &s)
+  {
+    return intern (s.data (), s.size ());
+  }
+
+  const char *
+  c_str (uint32_t id) const
+  {
+    return arena.data () + offsets[id];
+  }
+
+  size_t
+  length (uint32_t id) const
+  {
+    size_t end = id + 1 < offsets.size () ? offsets[id + 1] : arena.size ();
+    return end - offsets[id] - 1;
+  }
+
+  string
+  str (uint32_t id) const
+  {
+    return string (c_str (id), length (id));
+  }
+
+  size_t
+  count () const
+  {
+    return offsets.size ();
+  }
+
+  size_t
+  bytes () const
+  {
+    return arena.capacity () + (offsets.capacity () + slots.capacity ())
+                                   * sizeof (uint32_t);
+  }
+};
+
+/**
+ * struct package_table - Flat table of package rows keyed by name
+ * @strings: Pool holding every string referenced by the rows
+ * @rows: One row per package, sorted by name once finish() ran
+ * @row_of: Row index of each string id that names a package, else no_id
+ *
+ * Row types store their strings as ids into @strings and must have a
+ * uint32_t @name member. Lookups hash the name once and index @row_of,
+ * so no per-package node or std::string is allocated.
+ */
+template <typename T> struct package_table
+{
+  string_pool strings;
+  vector<T> rows;
+  vector<uint32_t> row_of;
+
+  // Row for @name, created zero-initialised if it does not exist yet
+  T &
+  add (const char *name, size_t len)
+  {
+    uint32_t id = strings.intern (name, len);
+    if (row_of.size () < strings.count ())
+      row_of.resize (strings.count (), no_id);
+    if (row_of[id] == no_id)
+      {
+        row_of[id] = rows.size ();
+        rows.push_back (T ());
+        rows.back ().name = id;
+      }
+    return rows[row_of[id]];
+  }
+
+  T &
+  add (const string &name)
+  {
+    return add (name.data (), name.size ());
+  }
+
+  // Sort rows by name for ordered iteration and rebuild @row_of
+  void
+  finish ()
+  {
+    const string_pool &s = strings;
+    sort (rows.begin (), rows.end (), [&s] (const T &a, const T &b) {
+      return strcmp (s.c_str (a.name), s.c_str (b.name)) < 0;
+    });
+    row_of.assign (strings.count (), no_id);
+    for (uint32_t i = 0; i < rows.size (); ++i)
+      row_of[rows[i].name] = i;
+    rows.shrink_to_fit ();
+    strings.arena.shrink_to_fit ();
+    strings.offsets.shrink_to_fit ();
+  }
+
+  const T *
+  find (const string &name) const
+  {
+    uint32_t id = strings.lookup (name);
+    if (id == no_id || id >= row_of.size () || row_of[id] == no_id)
+      return NULL;
+    return &rows[row_of[id]];
+  }
+
+  bool
+  count (const string &name) const
+  {
+    return find (name) != NULL;
+  }
+
+  const char *
+  str (uint32_t id) const
+  {
+    return strings.c_str (id);
+  }
+
+  size_t
+  size () const
+  {
+    return rows.size ();
+  }
+
+  bool
+  empty () const
+  {
+    return rows.empty ();
+  }
+
+  typename vector<T>::const_iterator
+  begin () const
+  {
+    return rows.begin ();
+  }
+
+  typename vector<T>::const_iterator
+  end () const
+  {
+    return rows.end ();
+  }
+
+  size_t
+  bytes () const
+  {
+    return strings.bytes () + rows.capacity () * sizeof (T)
+           + row_of.capacity () * sizeof (uint32_t);
+  }
+};
+
+// One installed package as parsed from its local database desc file
+struct local_desc
+{
+  string version;
+  bool explicit_install;
+  vector<string> depends; // dependency names without version constraints
+  vector<string> provides; // provided names without versions
+};
+
+// One installed package; strings are ids into the snapshot's pool
+struct installed_pkg
+{
+  uint32_t name;
+  uint32_t version;
+  bool explicit_install;
+  uint32_t depends_begin; // range in installed_snapshot::depends
+  uint32_t depends_end;
+  uint32_t provides_begin; // range in installed_snapshot::provides
+  uint32_t provides_end;
+};
+
+/**
+ * struct installed_snapshot - Installed packages with dependency edges
+ * @depends: Dependency names as string ids; a dependency that is itself
+ *           installed has the same id as that package's name
+ * @provides: Names the packages provide, as string ids
+ */
+struct installed_snapshot : package_table<installed_pkg>
+{
+  vector<uint32_t> depends;
+  vector<uint32_t> provides;
+
+  void
+  add_package (const string &name, const local_desc &d)
+  {
+    installed_pkg &pkg = add (name);
+    pkg.version = strings.intern (d.version);
+    pkg.explicit_install = d.explicit_install;
+    pkg.depends_begin = depends.size ();
+    for (const auto &dep : d.depends)
+      depends.push_back (strings.intern (dep));
+    pkg.depends_end = depends.size ();
+    pkg.provides_begin = provides.size ();
+    for (const auto &name : d.provides)
+      provides.push_back (strings.intern (name));
+    pkg.provides_end = provides.size ();
+  }
+
+  size_t
+  bytes () const
+  {
+    return package_table<installed_pkg>::bytes ()
+           + (depends.capacity () + provides.capacity ()) * sizeof (uint32_t);
+  }
+};
+
+// One package available from a sync database
+struct repo_pkg
+{
+  uint32_t name;
+  uint32_t repo;
+  uint32_t version;
+};
+typedef package_table<repo_pkg> sync_catalog;
+
+// One AUR package from the packages-meta dump
+struct aur_pkg
+{
+  uint32_t name;
+  uint32_t base;
+  uint32_t version;
+  uint32_t votes;
+  float popularity;
+  uint32_t out_of_date; // Unix time it was flagged, 0 if not flagged
+  uint32_t maintainer;
+  uint32_t last_modified;
+  uint32_t description;
+};
+typedef package_table<aur_pkg> aur_index;
+
+/**
+ * read_local_desc - Parse the desc file of one local database entry
+ * @path: Path of the desc file
+ * @name: Set to the %NAME% field
+ * @pkg: Filled with %VERSION%, %REASON%, %DEPENDS% and %PROVIDES%
+ *
+ * Return: true if the file had a name and version, false otherwise
+ */
+static bool
+read_local_desc (const string &path, string &name, local_desc &pkg)
+{
+  unique_ptr<FILE, decltype (&fclose)> f (fopen (path.c_str (), "r"), fclose);
+  if (!f)
+    return false;
+
+  // A missing %REASON% means explicitly installed
+  pkg.version.clear ();
+  pkg.explicit_install = true;
+  pkg.depends.clear ();
+  pkg.provides.clear ();
+  name.clear ();
+
+  char line[4096];
+  string section;
+  while (fgets (line, sizeof (line), f.get ()))
+    {
+      string value = line;
+      while (!value.empty () && isspace ((unsigned char)value.back ()))
+        value.pop_back ();
+      if (value.empty ())
+        {
+          section.clear ();
+          continue;
+        }
+      if (value.front () == '%' && value.back () == '%')
+        {
+          section = value;
+          continue;
+        }
+      if (section == "%NAME%")
+        name = value;
+      else if (section == "%VERSION%")
+        pkg.version = value;
+      else if (section == "%REASON%")
+        pkg.explicit_install = value == "0";
+      else if (section == "%DEPENDS%")
+        pkg.depends.push_back (value.substr (0, value.find_first_of ("<>=:")));
+      else if (section == "%PROVIDES%")
+        pkg.provides.push_back (value.substr (0, value.find ('=')));
+    }
+  return !name.empty () && !pkg.version.empty ();
+}
+
+/**
+ * split_tabs - Split one line of tab-separated values
+ * @line: Line without trailing newline
+ *
+ * Return: The fields of @line
+ */
+static vector<string>
+split_tabs (const string &line)
+{
+  vector<string> fields;
+  size_t start = 0;
+  for (;;)
+    {
+      size_t tab = line.find ('\t', start);
+      fields.push_back (line.substr (start, tab - start));
+      if (tab == string::npos)
+        break;
+      start = tab + 1;
+    }
+  return fields;
+}
+
+/**
+ * index_dir - Locate the system-wide package index
+ *
+ * The installed-state indexes are maintained by root through the pacman
+ * hook and read by everyone.
+ *
+ * Return: $AUH_INDEX_DIR if set, otherwise /var/lib/auh
+ */
+static string
+index_dir ()
+{
+  const char *env = getenv ("AUH_INDEX_DIR");
+  return env && *env ? env : "/var/lib/auh";
+}
+
+// Index records grouped by package name, one text line per record
+typedef map<string, vector<string> > index_records;
+
+/**
+ * load_index - Read an index file and replay its delta journal
+ * @file: Index file name below index_dir(), e.g. "installed.tsv"
+ *
+ * Every line of an index starts with the package name and a tab. The
+ * journal <file>.delta written by append_index_delta() holds "-\t<name>"
+ * lines, which drop all records of a package, followed by its new records.
+ *
+ * Return: Records grouped by package name
+ */
+static index_records
+load_index (const string &file)
+{
+  index_records records;
+  string path = index_dir () + "/" + file;
+  string line;
+
+  ifstream base (path);
+  while (getline (base, line))
+    {
+      size_t tab = line.find ('\t');
+      if (tab != string::npos)
+        records[line.substr (0, tab)].push_back (line);
+    }
+
+  ifstream delta (path + ".delta");
+  while (getline (delta, line))
+    {
+      size_t tab = line.find ('\t');
+      if (tab == string::npos)
+        continue;
+      if (tab == 1 && line[0] == '-')
+        records.erase (line.substr (2));
+      else
+        records[line.substr (0, tab)].push_back (line);
+    }
+  return records;
+}
+
+/**
+ * write_index - Replace an index file and clear its journal
+ * @file: Index file name below index_dir()
+ * @records: Complete contents
+ *
+ * Return: true on success, false otherwise
+ */
+static bool
+write_index (const string &file, const index_records &records)
+{
+  string path = index_dir () + "/" + file;
+  string tmp = temp_path (path);
+  {
+    ofstream out (tmp, ios::trunc);
+    for (const auto &r : records)
+      for (const auto &line : r.second)
+        out << line << '\n';
+    if (!out.flush ())
+      {
+        unlink (tmp.c_str ());
+        return false;
+      }
+  }
+  if (rename (tmp.c_str (), path.c_str ()) != 0)
+    return false;
+  unlink ((path + ".delta").c_str ());
+  return true;
+}
+
+/**
+ * append_index_delta - Journal the new records of changed packages
+ * @file: Index file name below index_dir()
+ * @changed: Packages whose records are replaced (removed ones included)
+ * @records: New records of the packages in @changed that are installed
+ *
+ * Only the changed packages are written, so the cost is independent of
+ * the size of the index. The journal is folded back into the base file by
+ * write_index() once it grows past a quarter of the base.
+ *
+ * Return: true on success, false otherwise
+ */
+static bool
+append_index_delta (const string &file, const vector<string> &changed,
+                    const index_records &records)
+{
+  string path = index_dir () + "/" + file;
+  {
+    ofstream out (path + ".delta", ios::app);
+    for (const auto &name : changed)
+      {
+        out << "-\t" << name << '\n';
+        auto it = records.find (name);
+        if (it != records.end ())
+          for (const auto &line : it->second)
+            out << line << '\n';
+      }
+    if (!out.flush ())
+      return false;
+  }
+
+  struct stat base, delta;
+  if (stat (path.c_str (), &base) == 0
+      && stat ((path + ".delta").c_str (), &delta) == 0
+      && delta.st_size > base.st_size / 4)
+    return write_index (file, load_index (file));
+  return true;
+}
+
+/**
+ * time_after - Compare two file timestamps to the nanosecond
+ * @a: First timestamp
+ * @b: Second timestamp
+ *
+ * Return: true if @a is strictly later than @b
+ */
+static bool
+time_after (const struct timespec &a, const struct timespec &b)
+{
+  return a.tv_sec != b.tv_sec ? a.tv_sec > b.tv_sec : a.tv_nsec > b.tv_nsec;
+}
+
+/**
+ * index_is_fresh - Check that the persisted snapshot matches the local DB
+ *
+ * pacman adds and removes one directory per package version under
+ * <dbpath>/local, so any transaction bumps that directory's mtime.
+ * "pacman -D --asdeps/--asexplicit" rewrites only a desc file and runs no
+ * hook, so the desc files are checked as well (one fstatat each, no
+ * reads). The index is current if it was written (or journaled) strictly
+ * later than all of them; file timestamps are coarse, so a change in the
+ * same tick counts as newer.
+ *
+ * Return: true if installed.tsv can be used instead of scanning the DB
+ */
+static bool
+index_is_fresh ()
+{
+  struct stat db, base, delta;
+  string local = pacman_db_path () + "/local";
+  string path = index_dir () + "/installed.tsv";
+  if (stat (local.c_str (), &db) != 0 || stat (path.c_str (), &base) != 0)
+    return false;
+  struct timespec written = base.st_mtim;
+  if (stat ((path + ".delta").c_str (), &delta) == 0
+      && time_after (delta.st_mtim, written))
+    written = delta.st_mtim;
+  if (!time_after (written, db.st_mtim))
+    return false;
+
+  DIR *dir = opendir (local.c_str ());
+  if (!dir)
+    return false;
+  bool fresh = true;
+  struct dirent *ent;
+  while (fresh && (ent = readdir (dir)) != NULL)
+    {
+      struct stat desc;
+      string file = string (ent->d_name) + "/desc";
+      if (ent->d_name[0] != '.'
+          && fstatat (dirfd (dir), file.c_str (), &desc, 0) == 0)
+        fresh = time_after (written, desc.st_mtim);
+    }
+  closedir (dir);
+  return fresh;
+}
+
+/**
+ * local_db_entries - Map installed package names to their DB directories
+ *
+ * Directory names are "<name>-<pkgver>-<pkgrel>"; since neither pkgver
+ * nor pkgrel may contain a dash, the name is everything before the last
+ * two dashes. Only directory names are read.
+ *
+ * Return: Map from package name to directory name below <dbpath>/local
+ */
+static map<string, string>
+local_db_entries ()
+{
+  map<string, string> entries;
+  DIR *dir = opendir ((pacman_db_path () + "/local").c_str ());
+  if (!dir)
+    return entries;
+  struct dirent *ent;
+  while ((ent = readdir (dir)) != NULL)
+    {
+      string entry = ent->d_name;
+      size_t rel = entry.rfind ('-');
+      if (entry[0] == '.' || rel == string::npos || rel == 0)
+        continue;
+      size_t ver = entry.rfind ('-', rel - 1);
+      if (ver != string::npos && ver > 0)
+        entries[entry.substr (0, ver)] = entry;
+    }
+  closedir (dir);
+  return entries;
+}
+
+/**
+ * read_local_files - Read the file list of one local database entry
+ * @path: Path of the files file
+ *
+ * Return: Paths owned by the package, relative to / as pacman stores them
+ */
+static vector<string>
+read_local_files (const string &path)
+{
+  vector<string> files;
+  ifstream in (path);
+  string line;
+  bool in_files = false;
+  while (getline (in, line))
+    {
+      if (line.empty ())
+        in_files = false;
+      else if (line[0] == '%')
+        in_files = line == "%FILES%";
+      else if (in_files)
+        files.push_back (line);
+    }
+  return files;
+}
+
+/**
+ * index_package - Produce the index records of one installed package
+ * @name: Package name
+ * @entry: Its directory below <dbpath>/local
+ * @installed: Receives the installed.tsv record
+ * @files: Receives the files.tsv records
+ *
+ * installed.tsv lines are "<name>\t<version>\t<explicit>\t<deps>\t<provides>"
+ * with the dependencies and provided names separated by spaces; files.tsv
+ * lines are "<name>\t<path>". Reverse dependencies are derived from the
+ * dependency and provides columns (see index_required_by()).
+ *
+ * Return: true if the entry could be read, false otherwise
+ */
+static bool
+index_package (const string &name, const string &entry,
+               index_records &installed, index_records &files)
+{
+  string dir = pacman_db_path () + "/local/" + entry;
+  string read_name;
+  local_desc pkg;
+  if (!read_local_desc (dir + "/desc", read_name, pkg) || read_name != name)
+    return false;
+
+  string deps, provides;
+  for (const auto &d : pkg.depends)
+    deps += (deps.empty () ? "" : " ") + d;
+  for (const auto &p : pkg.provides)
+    provides += (provides.empty () ? "" : " ") + p;
+  installed[name].push_back (name + "\t" + pkg.version + "\t"
+                             + (pkg.explicit_install ? "1" : "0") + "\t"
+                             + deps + "\t" + provides);
+  for (const auto &f : read_local_files (dir + "/files"))
+    files[name].push_back (name + "\t" + f);
+  return true;
+}
+
+/**
+ * load_installed_snapshot - Read every installed package from the local DB
+ *
+ * Uses the persisted installed.tsv index when the pacman hook has kept it
+ * current (see index_is_fresh()). Otherwise reads the desc files under
+ * <dbpath>/local directly, which costs a few milliseconds instead of a
+ * pacman process per query.
+ *
+ * Return: Table of installed packages, sorted by name
+ */
+static installed_snapshot
+load_installed_snapshot ()
+{
+  installed_snapshot snapshot;
+  if (index_is_fresh ())
+    {
+      local_desc pkg;
+      for (const auto &r : load_index ("installed.tsv"))
+        {
+          // Indexes written before the provides column are rescanned
+          vector<string> f = split_tabs (r.second.front ());
+          if (f.size () < 5)
+            {
+              snapshot = installed_snapshot ();
+              break;
+            }
+          pkg.version = f[1];
+          pkg.explicit_install = f[2] == "1";
+          pkg.depends.clear ();
+          pkg.provides.clear ();
+          istringstream deps (f[3]), provides (f[4]);
+          string word;
+          while (deps >> word)
+            pkg.depends.push_back (word);
+          while (provides >> word)
+            pkg.provides.push_back (word);
+          snapshot.add_package (r.first, pkg);
+        }
+      if (!snapshot.empty ())
+        {
+          snapshot.finish ();
+          return snapshot;
+        }
+    }
+
+  string local = pacman_db_path () + "/local";
+  DIR *dir = opendir (local.c_str ());
+  if (!dir)
+    return snapshot;
+
+  struct dirent *ent;
+  while ((ent = readdir (dir)) != NULL)
+    {
+      if (ent->d_name[0] == '.')
+        continue;
+      string name;
+      local_desc pkg;
+      if (read_local_desc (local + "/" + ent->d_name + "/desc", name, pkg))
+        snapshot.add_package (name, pkg);
+    }
+  closedir (dir);
+  snapshot.finish ();
+  return snapshot;
+}
+
+/**
+ * load_sync_catalog - List every package in the configured sync DBs
+ *
+ * Uses a single "pacman -Sl" run rather than one "pacman -Si" per name.
+ *
+ * Return: Table of repository packages, sorted by name
+ */
+static sync_catalog
+load_sync_catalog ()
+{
+  sync_catalog catalog;
+  // Lines are "<repo> <name> <version>[ [installed]]"
+  auto add = [&catalog] (const char *line, size_t len) {
+    const char *p = line, *end = line + len;
+    size_t rlen, nlen, vlen;
+    const char *repo = next_field (p, end, rlen);
+    const char *name = next_field (p, end, nlen);
+    const char *version = next_field (p, end, vlen);
+    if (!vlen)
+      return;
+    repo_pkg &pkg = catalog.add (name, nlen);
+    pkg.repo = catalog.strings.intern (repo, rlen);
+    pkg.version = catalog.strings.intern (version, vlen);
+  };
+  for_each_output_line ("pacman -Sl 2>/dev/null", add);
+  catalog.finish ();
+  return catalog;
+}
+
+// The AUR metadata dump is refreshed when older than this many seconds
+static const long aur_index_max_age = 24 * 60 * 60;
+
+/**
+ * aur_index_path - Path of the local copy of the AUR metadata
+ *
+ * Return: <cache_dir>/aur-meta.tsv
+ */
+static string
+aur_index_path ()
+{
+  return cache_dir () + "/aur-meta.tsv";
+}
+
+/**
+ * aur_index_mtime - When the local AUR metadata last changed
+ *
+ * Return: Newest modification time of aur-meta.tsv and its delta
+ *         journal, or 0 if there is no metadata
+ */
+static time_t
+aur_index_mtime ()
+{
+  struct stat base, delta;
+  string path = aur_index_path ();
+  if (stat (path.c_str (), &base) != 0)
+    return 0;
+  if (stat ((path + ".delta").c_str (), &delta) == 0)
+    return max (base.st_mtime, delta.st_mtime);
+  return base.st_mtime;
+}
+
+/**
+ * merge_aur_dump - Journal the differences between two metadata dumps
+ * @dump: Freshly downloaded dump in aur-meta.tsv format
+ *
+ * Every current record (base file replayed with its journal) is hashed
+ * by name; only records of the new dump whose hash differs are appended
+ * to aur-meta.tsv.delta, followed by "-\t<name>" lines for packages that
+ * disappeared, so an hourly refresh writes a few hundred lines instead
+ * of the whole dump. Once the journal outgrows a quarter of the base,
+ * @dump simply becomes the new base. @dump is consumed either way.
+ *
+ * Return: true on success, false otherwise
+ */
+static bool
+merge_aur_dump (const string &dump)
+{
+  string path = aur_index_path ();
+  string line;
+  unordered_map<string, uint64_t> current;
+  {
+    ifstream base (path), journal (path + ".delta");
+    for (ifstream *in : { &base, &journal })
+      while (getline (*in, line))
+        {
+          size_t tab = line.find ('\t');
+          if (tab == 1 && line[0] == '-')
+            current.erase (line.substr (2));
+          else if (tab != string::npos)
+            current[line.substr (0, tab)]
+                = hash_bytes (line.data (), line.size ());
+        }
+  }
+
+  {
+    ifstream in (dump);
+    ofstream out (path + ".delta", ios::app);
+    while (getline (in, line))
+      {
+        size_t tab = line.find ('\t');
+        if (tab == string::npos)
+          continue;
+        auto it = current.find (line.substr (0, tab));
+        if (it == current.end ()
+            || it->second != hash_bytes (line.data (), line.size ()))
+          out << line << '\n';
+        if (it != current.end ())
+          current.erase (it);
+      }
+    for (const auto &gone : current)
+      out << "-\t" << gone.first << '\n';
+    if (!out.flush ())
+      {
+        unlink (dump.c_str ());
+        return false;
+      }
+  }
+
+  // Compact: a journal replayed over the new base is harmless, so a crash
+  // between the rename and the unlink loses nothing
+  struct stat base, delta;
+  if (stat (path.c_str (), &base) == 0
+      && stat ((path + ".delta").c_str (), &delta) == 0
+      && delta.st_size > base.st_size / 4)
+    {
+      if (rename (dump.c_str (), path.c_str ()) != 0)
+        return false;
+      unlink ((path + ".delta").c_str ());
+      return true;
+    }
+  unlink (dump.c_str ());
+  return true;
+}
+
+/**
+ * refresh_aur_index - Download the AUR metadata dump if it is stale
+ * @force: Download even if the local copy is recent
+ *
+ * Fetches packages-meta-v1.json.gz, the daily dump of every AUR package,
+ * and flattens it with jq into one tab-separated line per package:
+ * name, base, version, votes, popularity, out-of-date, maintainer,
+ * last-modified, description. The request carries the ETag of the last
+ * download, so an unchanged dump costs one 304 response and nothing is
+ * rewritten; a changed one is merged by merge_aur_dump(). The time of the
+ * last check is kept as the mtime of aur-meta.checked, so that checking
+ * does not make the derived indexes look stale. Offline, nothing is
+ * downloaded and the last metadata is used as is.
+ *
+ * Return: true if a usable index exists afterwards, false otherwise
+ */
+static bool
+refresh_aur_index (bool force)
+{
+  string path = aur_index_path ();
+  string stamp = cache_dir () + "/aur-meta.checked";
+  string etag = cache_dir () + "/aur-meta.etag";
+  struct stat st;
+  bool exists = stat (path.c_str (), &st) == 0;
+  time_t checked = st.st_mtime;
+  if (stat (stamp.c_str (), &st) == 0)
+    checked = max (checked, st.st_mtime);
+  if (offline_mode
+      || (exists && !force && time (NULL) - checked < aur_index_max_age))
+    return exists;
+
+  string gz = temp_path (path + ".gz"), etag_tmp = temp_path (etag);
+  string cmd = "curl -s --etag-save " + etag_tmp + " -o " + gz
+               + " -w '%{http_code}'";
+  if (exists && stat (etag.c_str (), &st) == 0)
+    cmd += " --etag-compare " + etag;
+  cmd += " https://aur.archlinux.org/packages-meta-v1.json.gz 2>/dev/null";
+  string code = run_capture (cmd);
+
+  bool ok = false;
+  if (code == "304")
+    ok = true;
+  else if (code == "200")
+    {
+      string tmp = temp_path (path);
+      cmd = "gzip -dc " + gz + " | jq -r '.[] | [.Name, .PackageBase,"
+            " .Version, .NumVotes, .Popularity, (.OutOfDate // 0),"
+            " (.Maintainer // \"\"), .LastModified,"
+            " (.Description // \"\")] | @tsv' > "
+            + tmp + " 2>/dev/null";
+      if (system (cmd.c_str ()) == 0 && stat (tmp.c_str (), &st) == 0
+          && st.st_size > 0)
+        {
+          if (exists)
+            ok = merge_aur_dump (tmp);
+          else if ((ok = rename (tmp.c_str (), path.c_str ()) == 0))
+            unlink ((path + ".delta").c_str ());
+        }
+      unlink (tmp.c_str ());
+      if (ok)
+        rename (etag_tmp.c_str (), etag.c_str ());
+    }
+  unlink (gz.c_str ());
+  unlink (etag_tmp.c_str ());
+  if (ok)
+    close (open (stamp.c_str (), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+  return ok || exists;
+}
+
+/**
+ * load_aur_index - Load the local AUR metadata into memory
+ *
+ * Reads aur-meta.tsv and replays its journal: a record replaces the
+ * package's earlier one and "-\t<name>" drops the package. Fields are
+ * split in place and interned, so loading allocates only as the pool and
+ * the row vector grow.
+ *
+ * Return: Table of AUR packages, sorted by name; empty if no index was
+ *         downloaded
+ */
+static aur_index
+load_aur_index ()
+{
+  aur_index index;
+  string path = aur_index_path ();
+  struct stat st;
+  if (stat (path.c_str (), &st) == 0)
+    {
+      // Roughly 130 bytes and four distinct strings per line
+      index.rows.reserve (st.st_size / 128);
+      index.strings.reserve (st.st_size / 32, st.st_size);
+    }
+
+  vector<uint8_t> removed; // by row, for packages dropped by the journal
+  string line;
+  const char *f[9];
+  size_t len[9];
+  ifstream base (path), journal (path + ".delta");
+  for (ifstream *in : { &base, &journal })
+    while (getline (*in, line))
+      {
+        if (line.size () > 2 && line[0] == '-' && line[1] == '\t')
+          {
+            uint32_t id = index.strings.lookup (line.data () + 2,
+                                                line.size () - 2);
+            if (id != no_id && id < index.row_of.size ()
+                && index.row_of[id] != no_id)
+              removed[index.row_of[id]] = 1;
+            continue;
+          }
+
+        size_t n = 0, start = 0;
+        while (n < 9)
+          {
+            size_t tab = line.find ('\t', start);
+            f[n] = line.data () + start;
+            len[n++] = (tab == string::npos ? line.size () : tab) - start;
+            if (tab == string::npos)
+              break;
+            start = tab + 1;
+          }
+        if (n < 9)
+          continue;
+
+        aur_pkg &pkg = index.add (f[0], len[0]);
+        pkg.base = index.strings.intern (f[1], len[1]);
+        pkg.version = index.strings.intern (f[2], len[2]);
+        pkg.votes = strtoul (f[3], NULL, 10);
+        pkg.popularity = strtod (f[4], NULL);
+        pkg.out_of_date = strtoul (f[5], NULL, 10);
+        pkg.maintainer = index.strings.intern (f[6], len[6]);
+        pkg.last_modified = strtoul (f[7], NULL, 10);
+        pkg.description = index.strings.intern (f[8], len[8]);
+        removed.resize (index.rows.size ());
+        removed[&pkg - index.rows.data ()] = 0;
+      }
+
+  if (find (removed.begin (), removed.end (), 1) != removed.end ())
+    {
+      size_t kept = 0;
+      for (size_t i = 0; i < index.rows.size (); ++i)
+        if (!removed[i])
+          index.rows[kept++] = index.rows[i];
+      index.rows.resize (kept);
+    }
+  index.finish ();
+  return index;
+}
+
+/**
+ * classify_name - Decide where a package name comes from
+ * @installed: Installed snapshot
+ * @catalog: Sync catalog
+ * @aur: AUR index
+ * @name: Package name
+ *
+ * Return: "installed", "repo", "aur" or "missing"
+ */
+static string
+classify_name (const installed_snapshot &installed,
+               const sync_catalog &catalog, const aur_index &aur,
+               const string &name)
+{
+  if (installed.count (name))
+    return "installed";
+  if (catalog.count (name))
+    return "repo";
+  if (aur.count (name))
+    return "aur";
+  return "missing";
+}
+
+/**
+ * struct outdated_pkg - An installed AUR package with a newer AUR version
+ * @name: Package name
+ * @version: Installed version
+ * @available: Version in the AUR
+ */
+struct outdated_pkg
+{
+  string name;
+  string version;
+  string available;
+};
+
+/**
+ * list_outdated - Find installed AUR packages with a newer AUR version
+ * @installed: Installed snapshot
+ * @catalog: Sync catalog; packages found here are updated by pacman
+ * @aur: AUR index
+ *
+ * Return: The packages, sorted by name
+ */
+static vector<outdated_pkg>
+list_outdated (const installed_snapshot &installed,
+               const sync_catalog &catalog, const aur_index &aur)
+{
+  vector<outdated_pkg> found;
+  for (const auto &p : installed)
+    {
+      string name = installed.str (p.name);
+      if (catalog.count (name))
+        continue;
+      const aur_pkg *a = aur.find (name);
+      if (a && vercmp (aur.str (a->version), installed.str (p.version)) > 0)
+        found.push_back ({ name, installed.str (p.version),
+                           aur.str (a->version) });
+    }
+  return found;
+}
+
+/**
+ * load_sync_descriptions - List repo packages with their descriptions
+ *
+ * Parses the output of "pacman -Ss" without a pattern, which prints every
+ * sync DB package as "repo/name version" followed by an indented
+ * description line.
+ *
+ * Return: Records of repo, name, version and description
+ */
+static vector<array<string, 4> >
+load_sync_descriptions ()
+{
+  vector<array<string, 4> > pkgs;
+  auto add = [&pkgs] (const char *line, size_t len) {
+    if (len == 0)
+      return;
+    const char *end = line + len;
+    if (isspace ((unsigned char)line[0]))
+      {
+        while (line < end && isspace ((unsigned char)*line))
+          ++line;
+        if (!pkgs.empty ())
+          pkgs.back ()[3].assign (line, end);
+        return;
+      }
+    const char *slash = (const char *)memchr (line, '/', len);
+    if (!slash)
+      return;
+    const char *p = slash + 1;
+    size_t nlen, vlen;
+    const char *name = next_field (p, end, nlen);
+    const char *version = next_field (p, end, vlen);
+    if (!vlen)
+      return;
+    pkgs.push_back ({ { string (line, slash), string (name, nlen),
+                        string (version, vlen), "" } });
+  };
+  for_each_output_line ("pacman -Ss 2>/dev/null", add);
+  return pkgs;
+}
+
+/*
+ * Search index file layout (search.idx in the cache directory), written
+ * by build_search_index() and mapped read-only by search_packages():
+ *
+ *   search_header
+ *   search_doc[ndocs]           one per repo or AUR package
+ *   search_trigram[ntrigrams]   sorted by key
+ *   uint32_t postings[]         ascending doc ids per trigram
+ *   char strings[]              NUL-terminated strings referenced by offset
+ */
+struct search_header
+{
+  char magic[8];
+  uint32_t ndocs;
+  uint32_t ntrigrams;
+  uint64_t docs_off;
+  uint64_t trigrams_off;
+  uint64_t postings_off;
+  uint64_t strings_off;
+};
+
+struct search_doc
+{
+  uint32_t source; // repository name, "aur" for AUR packages
+  uint32_t name;
+  uint32_t version;
+  uint32_t desc;
+  uint32_t lname; // lowercase name, for matching
+  uint32_t lname_len;
+  uint32_t ldesc; // lowercase description, for matching
+  uint32_t ldesc_len;
+  uint32_t votes;
+  float popularity;
+};
+
+struct search_trigram
+{
+  uint32_t key;
+  uint32_t first; // index into postings
+  uint32_t count;
+};
+
+static const char search_magic[8] = { 'A', 'U', 'H', 'S', 'R', 'C', 'H', '1' };
+
+/**
+ * lowercase - ASCII-lowercase a string
+ * @s: Input string
+ *
+ * Return: Lowercased copy of @s
+ */
+static string
+lowercase (string s)
+{
+  for (auto &c : s)
+    c = tolower ((unsigned char)c);
+  return s;
+}
+
+/**
+ * trigram_key - Pack three bytes into a trigram key
+ * @p: Pointer to at least three bytes
+ *
+ * Return: 24-bit trigram key
+ */
+static inline uint32_t
+trigram_key (const char *p)
+{
+  return ((uint32_t)(unsigned char)p[0] << 16)
+         | ((uint32_t)(unsigned char)p[1] << 8) | (unsigned char)p[2];
+}
+
+/**
+ * search_index_path - Path of the search index
+ *
+ * Return: <cache_dir>/search.idx
+ */
+static string
+search_index_path ()
+{
+  return cache_dir () + "/search.idx";
+}
+
+/**
+ * sync_dbs_newer - Check whether a sync database changed since a time
+ * @since: Modification time of a file derived from the sync databases
+ *
+ * Return: true if any file under <dbpath>/sync is newer than @since
+ */
+static bool
+sync_dbs_newer (time_t since)
+{
+  string sync = pacman_db_path () + "/sync";
+  DIR *dir = opendir (sync.c_str ());
+  if (!dir)
+    return false;
+  bool newer = false;
+  struct stat st;
+  struct dirent *ent;
+  while (!newer && (ent = readdir (dir)) != NULL)
+    if (fstatat (dirfd (dir), ent->d_name, &st, 0) == 0 && S_ISREG (st.st_mode)
+        && st.st_mtime > since)
+      newer = true;
+  closedir (dir);
+  return newer;
+}
+
+/**
+ * search_index_stale - Check whether the search index needs a rebuild
+ *
+ * Return: true if search.idx is missing or older than the AUR metadata or
+ *         any sync database
+ */
+static bool
+search_index_stale ()
+{
+  struct stat idx;
+  if (stat (search_index_path ().c_str (), &idx) != 0)
+    return true;
+  return aur_index_mtime () > idx.st_mtime || sync_dbs_newer (idx.st_mtime);
+}
+
+/**
+ * edit_distance - Optimal string alignment distance between two names
+ * @a: First string, not necessarily NUL-terminated
+ * @alen: Length of @a
+ * @b: Second string, not necessarily NUL-terminated
+ * @blen: Length of @b
+ *
+ * Levenshtein distance that also counts swapping two adjacent characters
+ * as a single edit, the most common typo in package names.
+ *
+ * Return: Number of edits turning @a into @b
+ */
+static unsigned
+edit_distance (const char *a, size_t alen, const char *b, size_t blen)
+{
+  vector<unsigned> prev2 (blen + 1), prev (blen + 1), cur (blen + 1);
+  for (size_t j = 0; j <= blen; ++j)
+    prev[j] = j;
+  for (size_t i = 1; i <= alen; ++i)
+    {
+      cur[0] = i;
+      for (size_t j = 1; j <= blen; ++j)
+        {
+          unsigned cost = a[i - 1] == b[j - 1] ? 0 : 1;
+          cur[j] = min (min (prev[j] + 1, cur[j - 1] + 1), prev[j - 1] + cost);
+          if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1])
+            cur[j] = min (cur[j], prev2[j - 2] + 1);
+        }
+      prev2.swap (prev);
+      prev.swap (cur);
+    }
+  return prev[blen];
+}
+
+/*
+ * BK-tree over every package name in the search index (names.bk in the
+ * cache directory). Each node refers to a search_doc; its children hang
+ * off a sibling list and are keyed by their edit distance to the parent,
+ * so a lookup with tolerance t only descends into children whose key is
+ * within t of the distance measured at the parent.
+ */
+struct name_tree_header
+{
+  char magic[8];
+  uint32_t ndocs; // search_header.ndocs this tree was built from
+  uint32_t nnodes;
+};
+
+struct name_tree_node
+{
+  uint32_t doc;
+  uint32_t first_child; // 0 means none; node 0 is the root
+  uint32_t next_sibling;
+  uint32_t dist; // edit distance to the parent
+};
+
+static const char name_tree_magic[8]
+    = { 'A', 'U', 'H', 'B', 'K', 'T', 'R', '1' };
+
+/**
+ * name_tree_path - Path of the BK-tree of package names
+ *
+ * Return: <cache_dir>/names.bk
+ */
+static string
+name_tree_path ()
+{
+  return cache_dir () + "/names.bk";
+}
+
+/**
+ * build_name_tree - Write the BK-tree for did-you-mean suggestions
+ * @docs: Documents of the search index
+ * @strings: String table of the search index
+ *
+ * Names present in several sources (distance 0 to an existing node) are
+ * inserted only once.
+ *
+ * Return: true on success, false otherwise
+ */
+static bool
+build_name_tree (const vector<search_doc> &docs, const string &strings)
+{
+  vector<name_tree_node> nodes;
+  for (uint32_t id = 0; id < docs.size (); ++id)
+    {
+      const char *name = strings.data () + docs[id].lname;
+      size_t len = docs[id].lname_len;
+      if (nodes.empty ())
+        {
+          nodes.push_back ({ id, 0, 0, 0 });
+          continue;
+        }
+
+      uint32_t at = 0;
+      for (;;)
+        {
+          const search_doc &d = docs[nodes[at].doc];
+          unsigned dist = edit_distance (name, len, strings.data () + d.lname,
+                                         d.lname_len);
+          if (dist == 0)
+            break;
+          uint32_t child = nodes[at].first_child;
+          while (child && nodes[child].dist != dist)
+            child = nodes[child].next_sibling;
+          if (child)
+            {
+              at = child;
+              continue;
+            }
+          nodes.push_back ({ id, 0, nodes[at].first_child, dist });
+          nodes[at].first_child = nodes.size () - 1;
+          break;
+        }
+    }
+
+  name_tree_header h;
+  memcpy (h.magic, name_tree_magic, sizeof (h.magic));
+  h.ndocs = docs.size ();
+  h.nnodes = nodes.size ();
+
+  string path = name_tree_path ();
+  string tmp = temp_path (path);
+  {
+    ofstream out (tmp, ios::binary | ios::trunc);
+    out.write ((const char *)&h, sizeof (h));
+    out.write ((const char *)nodes.data (),
+               nodes.size () * sizeof (name_tree_node));
+    if (!out.flush ())
+      {
+        unlink (tmp.c_str ());
+        return false;
+      }
+  }
+  return rename (tmp.c_str (), path.c_str ()) == 0;
+}
+
+/**
+ * completion_names_path - Path of the sorted package name list
+ *
+ * Return: <cache_dir>/names.list
+ */
+static string
+completion_names_path ()
+{
+  return cache_dir () + "/names.list";
+}
+
+/**
+ * write_completion_names - Write the name list used by shell completion
+ * @docs: Documents of the search index
+ * @strings: String table of the search index
+ *
+ * One name per line, sorted bytewise and without duplicates, so that
+ * complete() can binary-search the mapping directly.
+ *
+ * Return: true on success, false otherwise
+ */
+static bool
+write_completion_names (const vector<search_doc> &docs, const string &strings)
+{
+  vector<const char *> names;
+  names.reserve (docs.size ());
+  for (const auto &d : docs)
+    names.push_back (strings.data () + d.name);
+  sort (names.begin (), names.end (),
+        [] (const char *a, const char *b) { return strcmp (a, b) < 0; });
+
+  string path = completion_names_path ();
+  string tmp = temp_path (path);
+  {
+    ofstream out (tmp, ios::trunc);
+    for (size_t i = 0; i < names.size (); ++i)
+      if (i == 0 || strcmp (names[i], names[i - 1]) != 0)
+        out << names[i] << '\n';
+    if (!out.flush ())
+      {
+        unlink (tmp.c_str ());
+        return false;
+      }
+  }
+  return rename (tmp.c_str (), path.c_str ()) == 0;
+}
+
+/**
+ * build_search_index - Write the trigram index over repo and AUR packages
+ *
+ * Every package contributes the trigrams of its lowercase
+ * "<name> <description>"; each trigram maps to the ascending list of
+ * packages containing it. The file is written to a temporary name and
+ * renamed into place, then the BK-tree of names used for suggestions and
+ * the name list used by shell completion are rebuilt from the same
+ * documents.
+ *
+ * Return: true on success, false otherwise
+ */
+static bool
+build_search_index ()
+{
+  vector<search_doc> docs;
+  string strings (1, '\0');
+  auto intern = [&strings] (const string &s) {
+    uint32_t off = strings.size ();
+    strings.append (s);
+    strings.push_back ('\0');
+    return off;
+  };
+  unordered_map<uint32_t, vector<uint32_t> > postings;
+
+  auto add = [&] (const string &source, const string &name,
+                  const string &version, const string &desc, uint32_t votes,
+                  float popularity) {
+    search_doc d;
+    string lname = lowercase (name), ldesc = lowercase (desc);
+    d.source = intern (source);
+    d.name = intern (name);
+    d.version = intern (version);
+    d.desc = intern (desc);
+    d.lname = intern (lname);
+    d.lname_len = lname.size ();
+    d.ldesc = intern (ldesc);
+    d.ldesc_len = ldesc.size ();
+    d.votes = votes;
+    d.popularity = popularity;
+
+    uint32_t id = docs.size ();
+    docs.push_back (d);
+    string text = lname + " " + ldesc;
+    for (size_t i = 0; i + 3 <= text.size (); ++i)
+      {
+        vector<uint32_t> &list = postings[trigram_key (&text[i])];
+        if (list.empty () || list.back () != id)
+          list.push_back (id);
+      }
+  };
+
+  for (const auto &p : load_sync_descriptions ())
+    add (p[0], p[1], p[2], p[3], 0, 0);
+  aur_index aur = load_aur_index ();
+  for (const auto &p : aur)
+    add ("aur", aur.str (p.name), aur.str (p.version), aur.str (p.description),
+         p.votes, p.popularity);
+  if (docs.empty ())
+    return false;
+
+  vector<uint32_t> keys;
+  keys.reserve (postings.size ());
+  for (const auto &p : postings)
+    keys.push_back (p.first);
+  sort (keys.begin (), keys.end ());
+
+  vector<search_trigram> table;
+  vector<uint32_t> lists;
+  for (uint32_t key : keys)
+    {
+      const vector<uint32_t> &list = postings[key];
+      table.push_back ({ key, (uint32_t)lists.size (), (uint32_t)list.size () });
+      lists.insert (lists.end (), list.begin (), list.end ());
+    }
+
+  search_header h;
+  memcpy (h.magic, search_magic, sizeof (h.magic));
+  h.ndocs = docs.size ();
+  h.ntrigrams = table.size ();
+  h.docs_off = sizeof (h);
+  h.trigrams_off = h.docs_off + docs.size () * sizeof (search_doc);
+  h.postings_off = h.trigrams_off + table.size () * sizeof (search_trigram);
+  h.strings_off = h.postings_off + lists.size () * sizeof (uint32_t);
+
+  string path = search_index_path ();
+  string tmp = temp_path (path);
+  {
+    ofstream out (tmp, ios::binary | ios::trunc);
+    out.write ((const char *)&h, sizeof (h));
+    out.write ((const char *)docs.data (), docs.size () * sizeof (search_doc));
+    out.write ((const char *)table.data (),
+               table.size () * sizeof (search_trigram));
+    out.write ((const char *)lists.data (), lists.size () * sizeof (uint32_t));
+    out.write (strings.data (), strings.size ());
+    if (!out.flush ())
+      {
+        unlink (tmp.c_str ());
+        return false;
+      }
+  }
+  return rename (tmp.c_str (), path.c_str ()) == 0
+         && build_name_tree (docs, strings)
+         && write_completion_names (docs, strings);
+}
+
+/**
+ * struct mapped_file - A read-only memory mapping of a whole file
+ * @data: Start of the mapping, or NULL
+ * @size: Length of the mapping
+ */
+struct mapped_file
+{
+  const char *data = NULL;
+  size_t size = 0;
+
+  ~mapped_file ()
+  {
+    if (data)
+      munmap ((void *)data, size);
+  }
+};
+
+/**
+ * map_file - Map a file read-only
+ * @path: File to map
+ * @m: Receives the mapping
+ *
+ * Return: true on success, false otherwise
+ */
+static bool
+map_file (const string &path, mapped_file &m)
+{
+  int fd = open (path.c_str (), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void *p = MAP_FAILED;
+  if (fstat (fd, &st) == 0 && st.st_size > 0)
+    p = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (p == MAP_FAILED)
+    return false;
+  m.data = (const char *)p;
+  m.size = st.st_size;
+  return true;
+}
+
+/**
+ * struct search_hit - One result of search_packages()
+ * @source: Repository name or "aur"
+ * @name: Package name
+ * @version: Version
+ * @description: Description
+ * @votes: AUR votes, 0 for repo packages
+ * @popularity: AUR popularity, 0 for repo packages
+ */
+struct search_hit
+{
+  string source;
+  string name;
+  string version;
+  string description;
+  uint32_t votes;
+  float popularity;
+};
+
+/**
+ * search_packages - Query the trigram index
+ * @terms: Search terms; every term must occur in the name or description
+ * @limit: Maximum number of results
+ *
+ * Candidates are the intersection of the posting lists of all trigrams
+ * of all terms (shortest list first); each candidate is then verified
+ * with memmem, which glibc implements with SIMD, on the lowercase name
+ * and description. Terms shorter than three characters have no trigrams,
+ * so a query made only of such terms scans every name instead. Results
+ * are ranked by match quality (exact name, name prefix, name substring,
+ * description) plus a popularity bonus, and the best @limit are kept in a
+ * min-heap rather than sorting every match.
+ *
+ * Return: The results, best first
+ */
+static vector<search_hit>
+search_packages (const vector<string> &terms, size_t limit)
+{
+  vector<search_hit> hits;
+  if (search_index_stale ())
+    build_search_index ();
+
+  mapped_file m;
+  if (!map_file (search_index_path (), m) || m.size < sizeof (search_header))
+    return hits;
+  const search_header *h = (const search_header *)m.data;
+  if (memcmp (h->magic, search_magic, sizeof (h->magic)) != 0
+      || h->strings_off > m.size)
+    return hits;
+  const search_doc *docs = (const search_doc *)(m.data + h->docs_off);
+  const search_trigram *table
+      = (const search_trigram *)(m.data + h->trigrams_off);
+  const uint32_t *postings = (const uint32_t *)(m.data + h->postings_off);
+  const char *strings = m.data + h->strings_off;
+
+  vector<string> lterms;
+  for (const auto &t : terms)
+    if (!t.empty ())
+      lterms.push_back (lowercase (t));
+  if (lterms.empty ())
+    return hits;
+
+  // Gather the posting lists of every trigram of every term
+  vector<pair<const uint32_t *, uint32_t> > lists;
+  for (const auto &t : lterms)
+    for (size_t i = 0; i + 3 <= t.size (); ++i)
+      {
+        uint32_t key = trigram_key (&t[i]);
+        const search_trigram *end = table + h->ntrigrams;
+        const search_trigram *it = lower_bound (
+            table, end, key,
+            [] (const search_trigram &e, uint32_t k) { return e.key < k; });
+        if (it == end || it->key != key)
+          return hits; // a trigram nobody has: no results
+        lists.push_back ({ postings + it->first, it->count });
+      }
+
+  // Intersect shortest first; without trigrams, every doc is a candidate
+  vector<uint32_t> candidates;
+  if (lists.empty ())
+    {
+      candidates.resize (h->ndocs);
+      for (uint32_t i = 0; i < h->ndocs; ++i)
+        candidates[i] = i;
+    }
+  else
+    {
+      sort (lists.begin (), lists.end (),
+            [] (const pair<const uint32_t *, uint32_t> &a,
+                const pair<const uint32_t *, uint32_t> &b) {
+              return a.second < b.second;
+            });
+      candidates.assign (lists[0].first, lists[0].first + lists[0].second);
+      for (size_t l = 1; l < lists.size () && !candidates.empty (); ++l)
+        {
+          vector<uint32_t> next;
+          set_intersection (candidates.begin (), candidates.end (),
+                            lists[l].first, lists[l].first + lists[l].second,
+                            back_inserter (next));
+          candidates.swap (next);
+        }
+    }
+
+  // Score verified matches, keeping the best @limit in a min-heap
+  typedef pair<double, uint32_t> scored;
+  priority_queue<scored, vector<scored>, greater<scored> > heap;
+  for (uint32_t id : candidates)
+    {
+      const search_doc &d = docs[id];
+      const char *lname = strings + d.lname;
+      const char *ldesc = strings + d.ldesc;
+      double score = 0;
+      bool all = true;
+      for (const auto &t : lterms)
+        {
+          const void *hit = memmem (lname, d.lname_len, t.data (), t.size ());
+          if (hit == lname && t.size () == d.lname_len)
+            score += 1000;
+          else if (hit == lname)
+            score += 400;
+          else if (hit)
+            score += 200;
+          else if (memmem (ldesc, d.ldesc_len, t.data (), t.size ()))
+            score += 50;
+          else
+            {
+              all = false;
+              break;
+            }
+        }
+      if (!all)
+        continue;
+
+      // Repo packages carry no popularity; treat them as well maintained
+      bool aur = strcmp (strings + d.source, "aur") == 0;
+      score += aur ? 15 * log1p (d.popularity) + log1p (d.votes) : 25;
+      if (heap.size () < limit)
+        heap.push ({ score, id });
+      else if (!heap.empty () && score > heap.top ().first)
+        {
+          heap.pop ();
+          heap.push ({ score, id });
+        }
+    }
+
+  vector<uint32_t> best;
+  while (!heap.empty ())
+    {
+      best.push_back (heap.top ().second);
+      heap.pop ();
+    }
+  for (auto it = best.rbegin (); it != best.rend (); ++it)
+    {
+      const search_doc &d = docs[*it];
+      bool aur = strcmp (strings + d.source, "aur") == 0;
+      hits.push_back ({ strings + d.source, strings + d.name,
+                        strings + d.version, strings + d.desc,
+                        aur ? d.votes : 0, aur ? d.popularity : 0 });
+    }
+  return hits;
+}
+
+/**
+ * search_hit_to_tsv - Serialize a search result for the auhd protocol
+ * @h: Result
+ *
+ * Return: Tab-separated source, name, version, votes, popularity and
+ *         description; tabs in the description become spaces
+ */
+static string
+search_hit_to_tsv (const search_hit &h)
+{
+  string desc = h.description;
+  replace (desc.begin (), desc.end (), '\t', ' ');
+  char num[64];
+  snprintf (num, sizeof (num), "%u\t%.9g", h.votes, h.popularity);
+  return h.source + "\t" + h.name + "\t" + h.version + "\t" + num + "\t"
+         + desc;
+}
+
+/**
+ * search_hit_from_tsv - Parse a line written by search_hit_to_tsv()
+ * @line: Line
+ * @h: Receives the result
+ *
+ * Return: true if the line had every field, false otherwise
+ */
+static bool
+search_hit_from_tsv (const string &line, search_hit &h)
+{
+  vector<string> f = split_tabs (line);
+  if (f.size () != 6)
+    return false;
+  h = { f[0], f[1], f[2], f[5], (uint32_t)strtoul (f[3].c_str (), NULL, 10),
+        strtof (f[4].c_str (), NULL) };
+  return true;
+}
+
+/*
+ * Repository name table (repo-names.phf in the cache directory): a
+ * minimal perfect hash over every sync database package name, built by
+ * build_repo_names() whenever a sync database is newer and mapped by
+ * repo_lookup(). Keys hash to a bucket whose displacement selects a
+ * distinct slot among exactly nkeys slots (hash and displace), so a
+ * lookup is one hash, one displacement read and one slot compare:
+ *
+ *   repo_names_header
+ *   uint32_t disp[nbuckets]     displacement seed per bucket
+ *   repo_names_slot[nkeys]      slot contents
+ *   char strings[]              NUL-terminated names and repositories
+ */
+struct repo_names_header
+{
+  char magic[8];
+  uint32_t nkeys;
+  uint32_t nbuckets;
+  uint64_t disp_off;
+  uint64_t slots_off;
+  uint64_t strings_off;
+};
+
+struct repo_names_slot
+{
+  uint32_t hash; // low bits of the key hash, checked before the name
+  uint32_t name;
+  uint32_t repo;
+};
+
+static const char repo_names_magic[8]
+    = { 'A', 'U', 'H', 'P', 'H', 'F', 'N', '1' };
+
+// Average number of keys per hash-and-displace bucket
+static const uint32_t repo_names_bucket_size = 4;
+
+/**
+ * repo_names_slot_of - Slot of a key for a given displacement
+ * @h: Key hash from hash_bytes()
+ * @disp: Displacement of the key's bucket
+ * @nkeys: Number of slots
+ *
+ * Return: Slot index in [0, @nkeys)
+ */
+static inline uint32_t
+repo_names_slot_of (uint64_t h, uint32_t disp, uint32_t nkeys)
+{
+  uint64_t x = (h ^ (disp * 0xc2b2ae3d27d4eb4full)) * 0x9e3779b97f4a7c15ull;
+  return (uint32_t)((x >> 32) * nkeys >> 32);
+}
+
+/**
+ * repo_names_path - Path of the repository name table
+ *
+ * Return: <cache_dir>/repo-names.phf
+ */
+static string
+repo_names_path ()
+{
+  return cache_dir () + "/repo-names.phf";
+}
+
+/**
+ * build_repo_names - Write the perfect hash over sync database names
+ *
+ * Buckets are placed largest first; for each one the smallest
+ * displacement that sends all of its keys to free slots is recorded.
+ *
+ * Return: true on success, false otherwise
+ */
+static bool
+build_repo_names ()
+{
+  sync_catalog catalog = load_sync_catalog ();
+  uint32_t n = catalog.size ();
+  if (n == 0)
+    return false;
+  uint32_t nbuckets = (n + repo_names_bucket_size - 1) / repo_names_bucket_size;
+
+  vector<uint64_t> hashes (n);
+  vector<vector<uint32_t> > buckets (nbuckets);
+  for (uint32_t i = 0; i < n; ++i)
+    {
+      const repo_pkg &p = catalog.rows[i];
+      hashes[i] = hash_bytes (catalog.str (p.name),
+                              catalog.strings.length (p.name));
+      buckets[hashes[i] % nbuckets].push_back (i);
+    }
+  vector<uint32_t> order (nbuckets);
+  for (uint32_t b = 0; b < nbuckets; ++b)
+    order[b] = b;
+  stable_sort (order.begin (), order.end (), [&buckets] (uint32_t a, uint32_t b) {
+    return buckets[a].size () > buckets[b].size ();
+  });
+
+  vector<uint32_t> disp (nbuckets, 0);
+  vector<uint32_t> slot_key (n, no_id);
+  vector<uint32_t> taken;
+  for (uint32_t b : order)
+    {
+      if (buckets[b].empty ())
+        break;
+      for (uint32_t d = 0;; ++d)
+        {
+          // Only colliding 64-bit hashes can exhaust the displacements
+          if (d == UINT32_MAX)
+            return false;
+          taken.clear ();
+          bool ok = true;
+          for (uint32_t k : buckets[b])
+            {
+              uint32_t s = repo_names_slot_of (hashes[k], d, n);
+              if (slot_key[s] != no_id
+                  || find (taken.begin (), taken.end (), s) != taken.end ())
+                {
+                  ok = false;
+                  break;
+                }
+              taken.push_back (s);
+            }
+          if (!ok)
+            continue;
+          for (size_t i = 0; i < taken.size (); ++i)
+            slot_key[taken[i]] = buckets[b][i];
+          disp[b] = d;
+          break;
+        }
+    }
+
+  string strings (1, '\0');
+  unordered_map<uint32_t, uint32_t> repo_off;
+  vector<repo_names_slot> slots (n);
+  for (uint32_t s = 0; s < n; ++s)
+    {
+      const repo_pkg &p = catalog.rows[slot_key[s]];
+      slots[s].hash = (uint32_t)hashes[slot_key[s]];
+      slots[s].name = strings.size ();
+      strings.append (catalog.str (p.name)).push_back ('\0');
+      auto it = repo_off.find (p.repo);
+      if (it == repo_off.end ())
+        {
+          it = repo_off.insert ({ p.repo, (uint32_t)strings.size () }).first;
+          strings.append (catalog.str (p.repo)).push_back ('\0');
+        }
+      slots[s].repo = it->second;
+    }
+
+  repo_names_header h;
+  memcpy (h.magic, repo_names_magic, sizeof (h.magic));
+  h.nkeys = n;
+  h.nbuckets = nbuckets;
+  h.disp_off = sizeof (h);
+  h.slots_off = h.disp_off + nbuckets * sizeof (uint32_t);
+  h.strings_off = h.slots_off + n * sizeof (repo_names_slot);
+
+  string path = repo_names_path ();
+  string tmp = temp_path (path);
+  {
+    ofstream out (tmp, ios::binary | ios::trunc);
+    out.write ((const char *)&h, sizeof (h));
+    out.write ((const char *)disp.data (), nbuckets * sizeof (uint32_t));
+    out.write ((const char *)slots.data (), n * sizeof (repo_names_slot));
+    out.write (strings.data (), strings.size ());
+    if (!out.flush ())
+      {
+        unlink (tmp.c_str ());
+        return false;
+      }
+  }
+  return rename (tmp.c_str (), path.c_str ()) == 0;
+}
+
+/**
+ * struct repo_names - Mapped repository name table
+ * @file: The mapping of repo-names.phf
+ * @h: Header, or NULL if no valid table is mapped
+ */
+struct repo_names
+{
+  mapped_file file;
+  const repo_names_header *h = NULL;
+
+  /**
+   * open - Map the table, rebuilding it first if a sync DB is newer
+   *
+   * Return: true if a valid table is mapped
+   */
+  bool
+  open ()
+  {
+    struct stat st;
+    if (stat (repo_names_path ().c_str (), &st) != 0
+        || sync_dbs_newer (st.st_mtime))
+      build_repo_names ();
+    if (!map_file (repo_names_path (), file)
+        || file.size < sizeof (repo_names_header))
+      return false;
+    // Every section must lie inside the mapping, and the string section
+    // must end with a terminator, so that lookup() cannot read past it
+    const repo_names_header *hdr = (const repo_names_header *)file.data;
+    if (memcmp (hdr->magic, repo_names_magic, sizeof (hdr->magic)) != 0
+        || hdr->nkeys == 0 || hdr->nbuckets == 0
+        || hdr->disp_off > file.size
+        || (file.size - hdr->disp_off) / sizeof (uint32_t) < hdr->nbuckets
+        || hdr->slots_off > file.size
+        || (file.size - hdr->slots_off) / sizeof (repo_names_slot)
+               < hdr->nkeys
+        || hdr->strings_off >= file.size || file.data[file.size - 1] != '\0')
+      return false;
+    h = hdr;
+    return true;
+  }
+
+  /**
+   * lookup - Find the repository providing a package name
+   * @name: Package name
+   *
+   * Return: Repository name, or NULL if no sync database has @name
+   */
+  const char *
+  lookup (const string &name) const
+  {
+    uint64_t hv = hash_bytes (name.data (), name.size ());
+    const uint32_t *disp = (const uint32_t *)(file.data + h->disp_off);
+    const repo_names_slot *slots
+        = (const repo_names_slot *)(file.data + h->slots_off);
+    const char *strings = file.data + h->strings_off;
+    const repo_names_slot &s
+        = slots[repo_names_slot_of (hv, disp[hv % h->nbuckets], h->nkeys)];
+    uint64_t nstrings = file.size - h->strings_off;
+    if (s.hash != (uint32_t)hv || s.name >= nstrings || s.repo >= nstrings
+        || name != strings + s.name)
+      return NULL;
+    return strings + s.repo;
+  }
+};
+
+/*
+ * Columnar AUR metadata (aur-columns.bin in the cache directory), written
+ * by build_aur_columns() from the metadata dump and mapped read-only by
+ * query_aur(). Rows are sorted by package name; every column is a plain
+ * array indexed by row so predicates compile to tight, vectorizable loops:
+ *
+ *   aur_columns_header
+ *   uint32_t name[rows]         offset of the name in strings
+ *   uint32_t votes[rows]
+ *   float    popularity[rows]
+ *   uint32_t modified[rows]     last modification, Unix time
+ *   uint32_t flagged_at[rows]   out-of-date flag time, 0 if not flagged
+ *   uint32_t maintainer[rows]   index into the maintainer dictionary
+ *   uint8_t  flags[rows]        AUR_FLAG_* bits
+ *   uint32_t maintainers[n]     offset of each interned maintainer name
+ *   char     strings[]          NUL-terminated names
+ */
+struct aur_columns_header
+{
+  char magic[8];
+  uint32_t rows;
+  uint32_t maintainers;
+  uint64_t name_off;
+  uint64_t votes_off;
+  uint64_t popularity_off;
+  uint64_t modified_off;
+  uint64_t flagged_off;
+  uint64_t maintainer_off;
+  uint64_t flags_off;
+  uint64_t maintainers_off;
+  uint64_t strings_off;
+};
+
+static const char aur_columns_magic[8]
+    = { 'A', 'U', 'H', 'C', 'O', 'L', 'S', '1' };
+
+// Bits of the flags column
+enum
+{
+  AUR_FLAG_OUT_OF_DATE = 1,
+  AUR_FLAG_ORPHAN = 2
+};
+
+/**
+ * aur_columns_path - Path of the columnar AUR metadata
+ *
+ * Return: <cache_dir>/aur-columns.bin
+ */
+static string
+aur_columns_path ()
+{
+  return cache_dir () + "/aur-columns.bin";
+}
+
+/**
+ * build_aur_columns - Convert the AUR metadata dump to columns
+ *
+ * Maintainer names are interned into a dictionary (id 0 is the empty
+ * name, i.e. orphaned packages) so that the maintainer column is a
+ * 32-bit id per row.
+ *
+ * Return: true on success, false otherwise
+ */
+static bool
+build_aur_columns ()
+{
+  aur_index index = load_aur_index ();
+  if (index.empty ())
+    return false;
+
+  size_t rows = index.size ();
+  vector<uint32_t> name, votes, modified, flagged, maintainer, dict;
+  vector<float> popularity;
+  vector<uint8_t> flags;
+  string strings (1, '\0');
+
+  // Maintainers are already interned; map pool ids to dictionary slots
+  // (the pool holds "" only if some field was empty)
+  vector<uint32_t> ids (index.strings.count (), no_id);
+  uint32_t empty = index.strings.lookup ("");
+  if (empty != no_id)
+    ids[empty] = 0;
+  dict.push_back (0);
+  name.reserve (rows);
+
+  for (const auto &a : index)
+    {
+      name.push_back (strings.size ());
+      strings.append (index.str (a.name)).push_back ('\0');
+      votes.push_back (a.votes);
+      popularity.push_back (a.popularity);
+      modified.push_back (a.last_modified);
+      flagged.push_back (a.out_of_date);
+
+      if (ids[a.maintainer] == no_id)
+        {
+          ids[a.maintainer] = dict.size ();
+          dict.push_back (strings.size ());
+          strings.append (index.str (a.maintainer)).push_back ('\0');
+        }
+      maintainer.push_back (ids[a.maintainer]);
+      bool orphan = index.strings.length (a.maintainer) == 0;
+      flags.push_back ((a.out_of_date ? AUR_FLAG_OUT_OF_DATE : 0)
+                       | (orphan ? AUR_FLAG_ORPHAN : 0));
+    }
+
+  aur_columns_header h;
+  memcpy (h.magic, aur_columns_magic, sizeof (h.magic));
+  h.rows = rows;
+  h.maintainers = dict.size ();
+  h.name_off = sizeof (h);
+  h.votes_off = h.name_off + rows * 4;
+  h.popularity_off = h.votes_off + rows * 4;
+  h.modified_off = h.popularity_off + rows * 4;
+  h.flagged_off = h.modified_off + rows * 4;
+  h.maintainer_off = h.flagged_off + rows * 4;
+  h.flags_off = h.maintainer_off + rows * 4;
+  // Keep the 32-bit arrays after the byte column aligned
+  h.maintainers_off = (h.flags_off + rows + 3) & ~(uint64_t)3;
+  h.strings_off = h.maintainers_off + dict.size () * 4;
+
+  string path = aur_columns_path ();
+  string tmp = temp_path (path);
+  {
+    ofstream out (tmp, ios::binary | ios::trunc);
+    out.write ((const char *)&h, sizeof (h));
+    out.write ((const char *)name.data (), rows * 4);
+    out.write ((const char *)votes.data (), rows * 4);
+    out.write ((const char *)popularity.data (), rows * 4);
+    out.write ((const char *)modified.data (), rows * 4);
+    out.write ((const char *)flagged.data (), rows * 4);
+    out.write ((const char *)maintainer.data (), rows * 4);
+    out.write ((const char *)flags.data (), rows);
+    out.write ("\0\0\0", h.maintainers_off - (h.flags_off + rows));
+    out.write ((const char *)dict.data (), dict.size () * 4);
+    out.write (strings.data (), strings.size ());
+    if (!out.flush ())
+      {
+        unlink (tmp.c_str ());
+        return false;
+      }
+  }
+  return rename (tmp.c_str (), path.c_str ()) == 0;
+}
+
+/**
+ * struct aur_match - One package selected by query_aur()
+ * @name: Package name
+ * @votes: Votes
+ * @popularity: Popularity
+ * @last_modified: Unix time of the last update
+ * @maintainer: Maintainer, empty if orphaned
+ * @out_of_date: Unix time it was flagged, 0 if not flagged
+ */
+struct aur_match
+{
+  string name;
+  uint32_t votes;
+  float popularity;
+  time_t last_modified;
+  string maintainer;
+  time_t out_of_date;
+};
+
+/**
+ * query_aur - Filter the AUR metadata with column scans
+ * @q: Predicates; all must hold
+ *
+ * Each predicate is one pass over one column ANDing into a byte-per-row
+ * selection vector, which the compiler vectorizes. The installed set is
+ * joined by binary-searching each installed name in the sorted name
+ * column.
+ *
+ * Return: The matches, sorted by name, or an empty vector if no index
+ *         exists
+ */
+static vector<aur_match>
+query_aur (const aur_query &q)
+{
+  vector<aur_match> matches;
+  struct stat cols;
+  time_t meta = aur_index_mtime ();
+  if (meta
+      && (stat (aur_columns_path ().c_str (), &cols) != 0
+          || cols.st_mtime < meta))
+    build_aur_columns ();
+
+  mapped_file m;
+  if (!map_file (aur_columns_path (), m)
+      || m.size < sizeof (aur_columns_header))
+    return matches;
+  const aur_columns_header *h = (const aur_columns_header *)m.data;
+  if (memcmp (h->magic, aur_columns_magic, sizeof (h->magic)) != 0
+      || h->strings_off > m.size)
+    return matches;
+
+  const uint32_t rows = h->rows;
+  const uint32_t *name = (const uint32_t *)(m.data + h->name_off);
+  const uint32_t *votes = (const uint32_t *)(m.data + h->votes_off);
+  const float *popularity = (const float *)(m.data + h->popularity_off);
+  const uint32_t *modified = (const uint32_t *)(m.data + h->modified_off);
+  const uint32_t *flagged_at = (const uint32_t *)(m.data + h->flagged_off);
+  const uint32_t *maintainer
+      = (const uint32_t *)(m.data + h->maintainer_off);
+  const uint8_t *flags = (const uint8_t *)(m.data + h->flags_off);
+  const uint32_t *dict = (const uint32_t *)(m.data + h->maintainers_off);
+  const char *strings = m.data + h->strings_off;
+
+  vector<uint8_t> sel (rows, 1);
+  uint8_t *s = sel.data ();
+
+  if (q.votes_below >= 0)
+    {
+      uint32_t v = min<long long> (q.votes_below, UINT32_MAX);
+      for (uint32_t i = 0; i < rows; ++i)
+        s[i] &= votes[i] < v;
+    }
+  if (q.votes_above >= 0)
+    {
+      uint32_t v = min<long long> (q.votes_above, UINT32_MAX);
+      for (uint32_t i = 0; i < rows; ++i)
+        s[i] &= votes[i] > v;
+    }
+  if (q.popularity_below >= 0)
+    {
+      float p = q.popularity_below;
+      for (uint32_t i = 0; i < rows; ++i)
+        s[i] &= popularity[i] < p;
+    }
+  // Cutoffs are signed 64-bit; spans reaching before the epoch clamp to 0
+  int64_t now = time (NULL);
+  auto cutoff_of = [now] (long days) -> int64_t {
+    return days > now / 86400 ? 0 : now - (int64_t)days * 86400;
+  };
+  if (q.updated_before_days >= 0)
+    {
+      int64_t cutoff = cutoff_of (q.updated_before_days);
+      for (uint32_t i = 0; i < rows; ++i)
+        s[i] &= modified[i] < cutoff;
+    }
+  if (q.updated_within_days >= 0)
+    {
+      int64_t cutoff = cutoff_of (q.updated_within_days);
+      for (uint32_t i = 0; i < rows; ++i)
+        s[i] &= modified[i] >= cutoff;
+    }
+  uint8_t mask = (q.flagged ? AUR_FLAG_OUT_OF_DATE : 0)
+                 | (q.orphaned ? AUR_FLAG_ORPHAN : 0);
+  if (mask)
+    for (uint32_t i = 0; i < rows; ++i)
+      s[i] &= (flags[i] & mask) == mask;
+  if (!q.maintainer.empty ())
+    {
+      // Resolve the name to its interned id once, then compare ids
+      uint32_t id = UINT32_MAX;
+      for (uint32_t d = 0; d < h->maintainers; ++d)
+        if (q.maintainer == strings + dict[d])
+          id = d;
+      for (uint32_t i = 0; i < rows; ++i)
+        s[i] &= maintainer[i] == id;
+    }
+  if (q.installed)
+    {
+      vector<uint8_t> present (rows, 0);
+      installed_snapshot installed = load_installed_snapshot ();
+      for (const auto &p : installed)
+        {
+          const char *n = installed.str (p.name);
+          const uint32_t *it = lower_bound (
+              name, name + rows, n, [strings] (uint32_t off, const char *n) {
+                return strcmp (strings + off, n) < 0;
+              });
+          if (it != name + rows && strcmp (n, strings + *it) == 0)
+            present[it - name] = 1;
+        }
+      for (uint32_t i = 0; i < rows; ++i)
+        s[i] &= present[i];
+    }
+
+  for (uint32_t i = 0; i < rows; ++i)
+    {
+      if (!s[i])
+        continue;
+      matches.push_back ({ strings + name[i], votes[i], popularity[i],
+                           (time_t)modified[i], strings + dict[maintainer[i]],
+                           (time_t)flagged_at[i] });
+    }
+  return matches;
+}
+
+/**
+ * json_escape - Quote a string for JSON output
+ * @s: Raw string
+ *
+ * Return: @s as a JSON string literal, including the quotes
+ */
+static string
+json_escape (const string &s)
+{
+  string out = "\"";
+  for (unsigned char c : s)
+    {
+      switch (c)
+        {
+        case '"':
+          out += "\\\"";
+          break;
+        case '\\':
+          out += "\\\\";
+          break;
+        case '\n':
+          out += "\\n";
+          break;
+        case '\t':
+          out += "\\t";
+          break;
+        default:
+          if (c < 0x20)
+            {
+              char buf[8];
+              snprintf (buf, sizeof (buf), "\\u%04x", c);
+              out += buf;
+            }
+          else
+            out += c;
+        }
+    }
+  return out + "\"";
+}
+
+// Set by --json: result records are written to this descriptor (the
+// original stdout) as JSON Lines, and all other output goes to stderr
+static int json_fd = -1;
+
+/**
+ * struct json_record - One JSON Lines record of --json mode
+ *
+ * Fields with empty values are left out. emit() writes the record with a
+ * single write(), so records from forked builds never interleave.
+ */
+struct json_record
+{
+  string obj = "{";
+
+  json_record &
+  field (const char *key, const string &value)
+  {
+    if (!value.empty ())
+      obj += (obj.size () > 1 ? "," : "") + json_escape (key) + ":"
+             + json_escape (value);
+    return *this;
+  }
+
+  // Add a field whose value is already valid JSON, such as a number
+  json_record &
+  raw (const char *key, const string &value)
+  {
+    if (!value.empty ())
+      obj += (obj.size () > 1 ? "," : "") + json_escape (key) + ":" + value;
+    return *this;
+  }
+
+  // Add the time since @start and the status, which every record carries
+  json_record &
+  outcome (chrono::steady_clock::time_point start,
+           const string &status = "ok")
+  {
+    long ms = chrono::duration_cast<chrono::milliseconds> (
+                  chrono::steady_clock::now () - start)
+                  .count ();
+    return raw ("duration_ms", to_string (ms)).field ("status", status);
+  }
+
+  void
+  emit ()
+  {
+    if (json_fd < 0)
+      return;
+    string line = obj + "}\n";
+    for (size_t off = 0; off < line.size ();)
+      {
+        ssize_t n = write (json_fd, line.data () + off, line.size () - off);
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n <= 0)
+          break;
+        off += n;
+      }
+  }
+};
+
+/**
+ * enable_json_output - Switch the process to --json mode
+ *
+ * Keeps a close-on-exec copy of stdout for records and points descriptor
+ * 1 at stderr, so that human-oriented messages and the output of pacman,
+ * makepkg and git no longer mix with the records.
+ *
+ * Return: true on success, false if the descriptors could not be set up
+ */
+static bool
+enable_json_output ()
+{
+  if (json_fd >= 0)
+    return true;
+  cout.flush ();
+  fflush (stdout);
+  int fd = fcntl (STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+  if (fd < 0 || dup2 (STDERR_FILENO, STDOUT_FILENO) < 0)
+    {
+      if (fd >= 0)
+        close (fd);
+      return false;
+    }
+  json_fd = fd;
+  return true;
+}
+
+/**
+ * struct json_event - Outcome record of one package action
+ * @action: What was done: install, update, remove, ...
+ * @package: Package concerned, or empty for whole-system actions
+ * @source: Where the package came from: repo, aur, github or cache
+ * @version: Version involved; looked up in the local database for
+ *           successful installs and updates when left empty
+ * @status: "ok", "skipped" or "failed" (the default)
+ * @detail: Error message or other remark
+ *
+ * Emitted with the elapsed time when destroyed, so every return path of
+ * a command reports its outcome without further bookkeeping.
+ */
+struct json_event
+{
+  string action;
+  string package;
+  string source;
+  string version;
+  string status = "failed";
+  string detail;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now ();
+
+  json_event (const string &a, const string &p) : action (a), package (p) {}
+  json_event (const json_event &) = delete;
+  json_event &operator= (const json_event &) = delete;
+
+  ~json_event ()
+  {
+    if (json_fd < 0)
+      return;
+    if (version.empty () && status == "ok" && !package.empty ()
+        && (action == "install" || action == "update"))
+      {
+        map<string, string> entries = local_db_entries ();
+        auto it = entries.find (package);
+        if (it != entries.end ())
+          version = it->second.substr (package.size () + 1);
+      }
+    json_record ()
+        .field ("package", package)
+        .field ("action", action)
+        .field ("source", source)
+        .field ("version", version)
+        .outcome (start, status)
+        .field ("detail", detail)
+        .emit ();
+  }
+};
+
+/**
+ * struct json_batch - Events of a transaction covering several packages
+ * @events: One json_event per package
+ *
+ * A pacman transaction succeeds or fails as a whole; settle() gives every
+ * package that outcome.
+ */
+struct json_batch
+{
+  vector<unique_ptr<json_event> > events;
+
+  json_batch (const string &action, const vector<string> &packages,
+              const string &source = string ())
+  {
+    for (const auto &p : packages)
+      {
+        events.emplace_back (new json_event (action, p));
+        events.back ()->source = source;
+      }
+  }
+
+  void
+  settle (bool ok, const string &detail = string ())
+  {
+    for (auto &ev : events)
+      {
+        ev->status = ok ? "ok" : "failed";
+        ev->detail = detail;
+      }
+  }
+};
+
+// AUR details fetched through the RPC are reused for this many seconds
+static const long info_cache_ttl = 60 * 60;
+
+// Package names per RPC request, keeping URLs well below server limits
+static const size_t rpc_batch_size = 150;
+
+/**
+ * aur_info_urls - RPC "info" URLs covering many packages
+ * @names: Package names (already validated)
+ *
+ * Return: One URL per batch of rpc_batch_size names
+ */
+static vector<string>
+aur_info_urls (const vector<string> &names)
+{
+  vector<string> urls;
+  for (size_t i = 0; i < names.size (); i += rpc_batch_size)
+    {
+      string url = "https://aur.archlinux.org/rpc/v5/info?";
+      for (size_t j = i; j < min (names.size (), i + rpc_batch_size); ++j)
+        url += (j == i ? "arg[]=" : "&arg[]=") + names[j];
+      urls.push_back (url);
+    }
+  return urls;
+}
+
+/**
+ * aur_rpc - Run RPC requests through a single curl process
+ * @urls: Request URLs
+ * @filter: jq expression applied to every element of .results
+ * @on_line: Called as on_line (size_t response, const string &line) for
+ *           every line @filter produces; @response counts the responses
+ *           received so far, from 0
+ *
+ * All requests share one connection. Every response also yields a
+ * "# <type>" line ahead of its results, which is how complete answers
+ * are told from failed requests; @on_line does not see these lines.
+ * @response matches the index into @urls only if every request was
+ * answered.
+ *
+ * Return: Number of requests answered without an error
+ */
+template <typename F>
+static size_t
+aur_rpc (const vector<string> &urls, const string &filter, F on_line)
+{
+  if (urls.empty ())
+    return 0;
+  string cmd = "curl -sfg";
+  for (const auto &url : urls)
+    cmd += " \"" + url + "\"";
+  cmd += " | jq -r '\"# \" + .type, (.results[]? | " + filter
+         + ")' 2>/dev/null";
+
+  size_t responses = 0, answered = 0;
+  for_each_output_line (cmd, [&] (const char *data, size_t len) {
+    string line (data, len);
+    if (line.compare (0, 2, "# ") == 0)
+      {
+        responses++;
+        if (line != "# error")
+          answered++;
+      }
+    else if (responses)
+      on_line (responses - 1, line);
+  });
+  return answered;
+}
+
+/**
+ * parse_aur_info_line - Turn one cached or fetched AUR record into details
+ * @line: Tab-separated name, version, description, depends, makedepends,
+ *        maintainer, votes, popularity, last modified, out of date, URL
+ * @info: Receives the details
+ *
+ * Return: true if the line had every field, false otherwise
+ */
+static bool
+parse_aur_info_line (const string &line, pkg_info &info)
+{
+  vector<string> f = split_tabs (line);
+  if (f.size () < 11)
+    return false;
+  info.name = f[0];
+  info.source = "aur";
+  info.version = f[1];
+  info.description = f[2];
+  info.depends = f[3];
+  info.makedepends = f[4];
+  info.maintainer = f[5];
+  info.votes = f[6];
+  info.popularity = f[7];
+  info.last_modified = f[8];
+  info.out_of_date = f[9] == "0" ? "" : f[9];
+  info.url = f[10];
+  return true;
+}
+
+/**
+ * fetch_aur_info - Get AUR details for many packages at once
+ * @names: Package names (already validated)
+ * @found: Receives details by name
+ * @fresh: Ignore the cache and ask the AUR (unless offline)
+ *
+ * Fresh entries of the per-package cache in <cache_dir>/info are used
+ * directly. All remaining names are requested through the RPC "info"
+ * endpoint in batches of rpc_batch_size, and every batch URL goes to a
+ * single curl process, so the whole lookup costs one connection and, in
+ * the common case, one round trip. Results are written back to the cache.
+ * Offline, cached entries are used whatever their age and the rest come
+ * from the local metadata dump.
+ */
+static void
+fetch_aur_info (const vector<string> &names, map<string, pkg_info> &found,
+                bool fresh = false)
+{
+  string dir = cache_dir () + "/info";
+  make_dirs (dir);
+
+  vector<string> missing;
+  for (const auto &name : names)
+    {
+      struct stat st;
+      string path = dir + "/" + name;
+      pkg_info info;
+      string line;
+      if ((offline_mode || !fresh) && stat (path.c_str (), &st) == 0
+          && (offline_mode || time (NULL) - st.st_mtime < info_cache_ttl))
+        {
+          ifstream in (path);
+          if (getline (in, line) && parse_aur_info_line (line, info))
+            {
+              found[name] = info;
+              continue;
+            }
+        }
+      missing.push_back (name);
+    }
+  if (missing.empty ())
+    return;
+
+  // Offline, fall back to the metadata dump, which lacks dependencies
+  // and the upstream URL
+  if (offline_mode)
+    {
+      aur_index aur = load_aur_index ();
+      for (const auto &name : missing)
+        {
+          const aur_pkg *a = aur.find (name);
+          if (!a)
+            continue;
+          pkg_info &info = found[name];
+          info.name = name;
+          info.source = "aur";
+          info.version = aur.str (a->version);
+          info.description = aur.str (a->description);
+          info.maintainer = aur.str (a->maintainer);
+          info.votes = to_string (a->votes);
+          ostringstream pop;
+          pop << a->popularity;
+          info.popularity = pop.str ();
+          info.last_modified = to_string (a->last_modified);
+          info.out_of_date = a->out_of_date ? to_string (a->out_of_date) : "";
+        }
+      return;
+    }
+
+  string urls;
+  for (const auto &url : aur_info_urls (missing))
+    urls += " \"" + url + "\"";
+  string cmd = "curl -sfg" + urls
+               + " | jq -r '.results[] | [.Name, .Version,"
+                 " (.Description // \"\"), ((.Depends // []) | join(\" \")),"
+                 " ((.MakeDepends // []) | join(\" \")), (.Maintainer // \"\"),"
+                 " .NumVotes, .Popularity, .LastModified, (.OutOfDate // 0),"
+                 " (.URL // \"\")] | @tsv' 2>/dev/null";
+
+  for_each_output_line (cmd, [&] (const char *data, size_t len) {
+    string line (data, len);
+    pkg_info info;
+    if (!parse_aur_info_line (line, info))
+      return;
+    found[info.name] = info;
+    ofstream (dir + "/" + info.name, ios::trunc) << line << '\n';
+  });
+}
+
+/**
+ * fetch_repo_info - Get sync DB details for many packages with one pacman run
+ * @names: Package names (already validated)
+ * @found: Receives details of the names pacman knows
+ */
+static void
+fetch_repo_info (const vector<string> &names, map<string, pkg_info> &found)
+{
+  string cmd = "LC_ALL=C pacman -Si";
+  for (const auto &name : names)
+    cmd += " " + name;
+
+  pkg_info info;
+  string line, key;
+  auto flush = [&] () {
+    if (!info.name.empty ())
+      found[info.name] = info;
+    info = pkg_info ();
+  };
+  cmd += " 2>/dev/null";
+  for_each_output_line (cmd, [&] (const char *data, size_t len) {
+    line.assign (data, len);
+    if (line.empty ())
+      {
+        flush ();
+        return;
+      }
+    size_t colon = line.find (" : ");
+    string value;
+    if (colon != string::npos && !isspace ((unsigned char)line[0]))
+      {
+        key = line.substr (0, line.find_last_not_of (' ', colon) + 1);
+        value = line.substr (colon + 3);
+      }
+    else
+      value = " " + line.substr (line.find_first_not_of (' '));
+    if (value == "None")
+      value.clear ();
+
+    if (key == "Repository")
+      info.source += value;
+    else if (key == "Name")
+      info.name += value;
+    else if (key == "Version")
+      info.version += value;
+    else if (key == "Description")
+      info.description += value;
+    else if (key == "URL")
+      info.url += value;
+    else if (key == "Depends On")
+      {
+        // pacman separates dependencies with two spaces
+        istringstream deps (value);
+        string dep;
+        while (deps >> dep)
+          info.depends += (info.depends.empty () ? "" : " ") + dep;
+      }
+    else if (key == "Packager")
+      info.maintainer += value;
+    else if (key == "Build Date")
+      info.last_modified += value;
+  });
+  flush ();
+}
+
+/**
+ * suggest_names - Find known package names close to a misspelled one
+ * @name: Name that was not found
+ * @limit: Maximum number of suggestions
+ *
+ * Walks the BK-tree with a tolerance of one edit for short names and two
+ * for longer ones. Suggestions are ordered by edit distance, then by
+ * popularity (repo packages first, as they have none recorded). The
+ * index is used as search() last built it, even if stale, so that an
+ * error path never waits for a rebuild.
+ *
+ * Return: Suggested names, best first; empty if there is no index
+ */
+static vector<string>
+suggest_names (const string &name, size_t limit)
+{
+  vector<string> out;
+  mapped_file idx, tree;
+  if (!map_file (search_index_path (), idx) || !map_file (name_tree_path (), tree)
+      || idx.size < sizeof (search_header)
+      || tree.size < sizeof (name_tree_header))
+    return out;
+  const search_header *sh = (const search_header *)idx.data;
+  const name_tree_header *th = (const name_tree_header *)tree.data;
+  if (memcmp (sh->magic, search_magic, sizeof (sh->magic)) != 0
+      || memcmp (th->magic, name_tree_magic, sizeof (th->magic)) != 0
+      || th->ndocs != sh->ndocs || th->nnodes == 0
+      || sizeof (*th) + th->nnodes * sizeof (name_tree_node) > tree.size)
+    return out;
+  const search_doc *docs = (const search_doc *)(idx.data + sh->docs_off);
+  const char *strings = idx.data + sh->strings_off;
+  const name_tree_node *nodes
+      = (const name_tree_node *)(tree.data + sizeof (*th));
+
+  string lname = lowercase (name);
+  unsigned tolerance = lname.size () <= 4 ? 1 : 2;
+
+  // (distance, -popularity, doc) so that sorting puts the best first
+  vector<tuple<unsigned, float, uint32_t> > hits;
+  vector<uint32_t> stack (1, 0);
+  while (!stack.empty ())
+    {
+      const name_tree_node &n = nodes[stack.back ()];
+      stack.pop_back ();
+      const search_doc &d = docs[n.doc];
+      unsigned dist = edit_distance (lname.data (), lname.size (),
+                                     strings + d.lname, d.lname_len);
+      if (dist <= tolerance && dist > 0)
+        {
+          bool aur = strcmp (strings + d.source, "aur") == 0;
+          hits.push_back (make_tuple (dist, aur ? -d.popularity : -1e9f,
+                                      n.doc));
+        }
+      for (uint32_t c = n.first_child; c; c = nodes[c].next_sibling)
+        if (nodes[c].dist + tolerance >= dist
+            && nodes[c].dist <= dist + tolerance)
+          stack.push_back (c);
+    }
+
+  sort (hits.begin (), hits.end ());
+  for (const auto &h : hits)
+    {
+      if (out.size () >= limit)
+        break;
+      out.push_back (strings + docs[get<2> (h)].name);
+    }
+  return out;
+}
+
+/**
+ * name_listed - Look a package name up in names.list
+ * @name: Package name
+ *
+ * names.list holds every repo and AUR name as of the last search index
+ * build; it is mapped and binary-searched in place.
+ *
+ * Return: 1 if the list holds @name, 0 if it does not, -1 if there is
+ *         no list
+ */
+static int
+name_listed (const string &name)
+{
+  mapped_file m;
+  if (!map_file (completion_names_path (), m))
+    return -1;
+  const char *data = m.data;
+  size_t lo = 0, hi = m.size;
+  while (lo < hi)
+    {
+      size_t p = lo + (hi - lo) / 2;
+      while (p > lo && data[p - 1] != '\n')
+        --p;
+      const char *nl = (const char *)memchr (data + p, '\n', m.size - p);
+      size_t end = nl ? nl - data : m.size;
+      size_t len = end - p;
+      int c = memcmp (data + p, name.data (), min (len, name.size ()));
+      if (c == 0 && len != name.size ())
+        c = len < name.size () ? -1 : 1;
+      if (c == 0)
+        return 1;
+      if (c < 0)
+        lo = end + 1;
+      else
+        hi = p;
+    }
+  return 0;
+}
+
+/**
+ * print_suggestions - Print a "did you mean" hint for an unknown package
+ * @name: Name that was not found
+ */
+static void
+print_suggestions (const string &name)
+{
+  vector<string> names = suggest_names (name, 5);
+  if (names.empty ())
+    return;
+  cerr << "Did you mean:";
+  for (size_t i = 0; i < names.size (); ++i)
+    cerr << (i ? ", " : " ") << names[i];
+  cerr << "?\n";
+}
+
+/**
+ * daemon_socket_path - Locate the auhd Unix socket
+ * @create: Create the fallback directory (for the daemon itself)
+ *
+ * The socket lives in $XDG_RUNTIME_DIR or, without one (cron, sudo), in
+ * /tmp/auhd-<uid>. Either directory must pass private_dir(), so another
+ * user cannot bind the path first and answer in the daemon's place.
+ *
+ * Return: Socket path, or empty string if there is no trustworthy
+ *         directory for it
+ */
+static string
+daemon_socket_path (bool create = false)
+{
+  const char *runtime = getenv ("XDG_RUNTIME_DIR");
+  if (runtime && *runtime)
+    return private_dir (runtime, false) ? string (runtime) + "/auhd.sock"
+                                        : string ();
+  string dir = "/tmp/auhd-" + to_string (getuid ());
+  return private_dir (dir, create) ? dir + "/auhd.sock" : string ();
+}
+
+/**
+ * daemon_request - Send one query to a running auhd
+ * @request: Request line without the newline, e.g. "classify yay"
+ * @reply: Filled with the reply lines
+ *
+ * Connects to the daemon socket, sends @request and reads the reply until
+ * the daemon closes the connection. A daemon run by another user
+ * (checked with SO_PEERCRED) is ignored. A missing or unresponsive
+ * daemon is not an error; callers fall back to doing the work themselves.
+ *
+ * Return: true if the daemon answered, false otherwise
+ */
+static bool
+daemon_request (const string &request, vector<string> &reply)
+{
+  string path = daemon_socket_path ();
+  struct sockaddr_un addr;
+  if (path.empty () || path.size () >= sizeof (addr.sun_path))
+    return false;
+
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return false;
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path.c_str ());
+
+  // Never let a wedged daemon stall the CLI for long
+  struct timeval tv = { 2, 0 };
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+
+  string line = request + "\n";
+  struct ucred peer;
+  socklen_t peer_len = sizeof (peer);
+  if (connect (fd, (struct sockaddr *)&addr, sizeof (addr)) != 0
+      || getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) != 0
+      || peer.uid != getuid ()
+      || send (fd, line.data (), line.size (), MSG_NOSIGNAL)
+             != (ssize_t)line.size ())
+    {
+      close (fd);
+      return false;
+    }
+
+  string data;
+  array<char, 65536> buf;
+  ssize_t n;
+  while ((n = recv (fd, buf.data (), buf.size (), 0)) > 0)
+    data.append (buf.data (), n);
+  close (fd);
+  if (n < 0 || data.compare (0, 3, "ok\n") != 0)
+    return false;
+
+  reply.clear ();
+  istringstream stream (data.substr (3));
+  while (getline (stream, line))
+    reply.push_back (line);
+  return true;
+}
+
+/**
+ * daemon_classify - Ask auhd where a package comes from
+ * @package: Package name
+ *
+ * Return: "installed", "repo", "aur" or "missing", or empty string if no
+ *         daemon is running
+ */
+static string
+daemon_classify (const string &package)
+{
+  vector<string> reply;
+  if (!daemon_request ("classify " + package, reply) || reply.size () != 1)
+    return {};
+  size_t space = reply[0].find (' ');
+  return space == string::npos ? string () : reply[0].substr (space + 1);
+}
+
+/**
+ * is_installed - Check if a package is installed
+ * @package: Package name to check
+ *
+ * Uses pacman to query if a package is installed on the system.
+ * Redirects output to /dev/null to suppress messages.
+ *
+ * Return: true if package is installed, false otherwise
+ */
+static bool
+is_installed (const string &package)
+{
+  string cmd = "pacman -Q " + package + " > /dev/null 2>&1";
+  return system (cmd.c_str ()) == 0;
+}
+
+/**
+ * is_in_main_repos - Check if a package is available in main repositories
+ * @package: Package name to check
+ *
+ * Looks the name up in the perfect hash over the sync databases (see
+ * build_repo_names()), rebuilt when a database has been refreshed. Falls
+ * back to asking pacman when no table can be built.
+ *
+ * Return: true if package is in main repos, false otherwise
+ */
+static bool
+is_in_main_repos (const string &package)
+{
+  // Validate package name to prevent command injection
+  if (!is_valid_package_name (package))
+    return false;
+  
+  // Answer from the perfect hash over the sync DBs when it is available
+  repo_names names;
+  if (names.open ())
+    return names.lookup (package) != NULL;
+
+  // Use pacman -Si for exact package lookup
+  string cmd = "pacman -Si " + package + " > /dev/null 2>&1";
+  return system (cmd.c_str ()) == 0;
+}
+
+/**
+ * struct locked_pkg - One pinned AUR package from a lockfile
+ * @version: Version the AUR reported when the lockfile was written
+ * @commit: Commit of the package's AUR repository
+ */
+struct locked_pkg
+{
+  string version;
+  string commit;
+};
+
+// Pins loaded by "install --locked"; empty when installing unpinned
+static map<string, locked_pkg> locked_packages;
+static bool locked_mode = false;
+
+/**
+ * load_lockfile - Read a lockfile written by lock_packages()
+ * @path: Lockfile path
+ * @pins: Receives the pinned packages by name
+ *
+ * Return: true if the file could be read and every line was valid
+ */
+static bool
+load_lockfile (const string &path, map<string, locked_pkg> &pins)
+{
+  ifstream in (path);
+  if (!in)
+    return false;
+  string line;
+  while (getline (in, line))
+    {
+      if (line.empty () || line[0] == '#')
+        continue;
+      vector<string> f = split_tabs (line);
+      if (f.size () < 3 || !is_valid_package_name (f[0])
+          || !is_commit_id (f[2]))
+        return false;
+      pins[f[0]] = { f[1], f[2] };
+    }
+  return true;
+}
+
+/**
+ * pinned_ref - Find the ref an AUR package is built from
+ * @package: Package name
+ * @ref: Set to the pinned commit in locked mode, "HEAD" otherwise
+ * @version: Set to the pinned version in locked mode, empty otherwise
+ *
+ * Return: false if locked mode is on and @package has no pin
+ */
+static bool
+pinned_ref (const string &package, string &ref, string &version)
+{
+  ref = "HEAD";
+  version.clear ();
+  if (!locked_mode)
+    return true;
+  auto pin = locked_packages.find (package);
+  if (pin == locked_packages.end ())
+    return false;
+  ref = pin->second.commit;
+  version = pin->second.version;
+  return true;
+}
+
+/**
+ * repo_targets_cached - Check that pacman can install packages offline
+ * @targets: Package names passed to pacman -S
+ *
+ * "pacman -Sp" resolves the targets and their missing dependencies
+ * against the sync databases without downloading anything; every file it
+ * would fetch must already be in one of pacman's cache directories.
+ *
+ * Return: true if every package file is cached, false otherwise
+ */
+static bool
+repo_targets_cached (const string &targets)
+{
+  vector<string> dirs;
+  auto add_dir = [&dirs] (const char *line, size_t len) {
+    if (len)
+      dirs.emplace_back (line, len);
+  };
+  for_each_output_line ("pacman-conf CacheDir 2>/dev/null", add_dir);
+  if (dirs.empty ())
+    dirs.push_back ("/var/cache/pacman/pkg");
+
+  bool any = false, all = true;
+  string cmd = "pacman -Sp --print-format %f " + targets + " 2>/dev/null";
+  for_each_output_line (cmd, [&] (const char *line, size_t len) {
+    if (!len || !all)
+      return;
+    any = true;
+    string file (line, len);
+    bool cached = false;
+    for (const auto &dir : dirs)
+      cached = cached || access ((dir + "/" + file).c_str (), R_OK) == 0;
+    all = cached;
+  });
+  return any && all;
+}
+
+/**
+ * find_cached_package - Find the newest package built earlier by makepkg
+ * @package: Package name
+ * @version: Only accept this version, or empty for any
+ *
+ * Built packages are kept in $PKGDEST, or <cache_dir>/packages (see
+ * makepkg_dest()), as <name>-<pkgver>-<pkgrel>-<arch>.pkg.tar.*.
+ *
+ * Return: Path of the cached package with the highest version, or empty
+ *         string if none is cached
+ */
+static string
+find_cached_package (const string &package, const string &version = "")
+{
+  string dir = makepkg_dest ("PKGDEST");
+  DIR *d = opendir (dir.c_str ());
+  if (!d)
+    return {};
+
+  string best, best_version;
+  struct dirent *ent;
+  while ((ent = readdir (d)) != NULL)
+    {
+      string file = ent->d_name;
+      size_t ext = file.find (".pkg.tar");
+      if (ext == string::npos || file.compare (file.size () - 4, 4, ".sig") == 0)
+        continue;
+      size_t arch = file.rfind ('-', ext);
+      size_t rel = arch && arch != string::npos ? file.rfind ('-', arch - 1)
+                                                : string::npos;
+      size_t ver = rel && rel != string::npos ? file.rfind ('-', rel - 1)
+                                              : string::npos;
+      if (ver == string::npos || file.compare (0, ver, package) != 0
+          || ver != package.size ())
+        continue;
+      string found = file.substr (ver + 1, arch - ver - 1);
+      if (!version.empty () && found != version)
+        continue;
+      if (best.empty () || vercmp (found, best_version) > 0)
+        {
+          best = dir + "/" + file;
+          best_version = found;
+        }
+    }
+  closedir (d);
+  return best;
+}
+
+/**
+ * install_pkg - Install a package from AUR or main repos
+ * @package: Package name to install
+ * @url: Git URL of the package repository (for AUR)
+ *
+ * Installs a package by:
+ * 1. Validating package name format
+ * 2. Checking if already installed (skip if yes)
+ * 3. Checking if package exists in main repos
+ * 4. If in main repos, install via pacman -S
+ * 5. If not in main repos, install from AUR:
+ *    - Query AUR API to verify package exists
+ *    - Clone the git repository
+ *    - Build with makepkg
+ *    - Install the built package
+ *
+ * In offline mode repo packages must be in pacman's package cache, and
+ * AUR packages are installed from <cache_dir>/packages or rebuilt from
+ * the clone cache; nothing is downloaded. In locked mode AUR packages
+ * are built from the commit pinned in the lockfile.
+ *
+ * Return: 0 on success, 1 on failure
+ */
+static int
+install_pkg (const string &package, const string &url)
+{
+  json_event ev ("install", package);
+
+  // Validate package name to prevent command injection
+  if (!is_valid_package_name (package))
+    {
+      cerr << "Invalid package name: " << package << '\n';
+      ev.detail = "invalid package name";
+      return 1;
+    }
+
+  // Only one auh process of this user works on a package at a time; a
+  // second one waits here and then finds the package installed
+  unique_ptr<host_lock> lock
+      = acquire_host_lock ("pkg-" + package, "installing " + package);
+  if (lock->timed_out)
+    {
+      ev.detail = "timed out waiting for another auh process";
+      return 1;
+    }
+
+  // A running auhd answers from its resident caches without forking
+  // pacman; after waiting for another process, ask pacman directly
+  string where = lock->waited ? string () : daemon_classify (package);
+
+  // Skip if already installed
+  if (where.empty () ? is_installed (package) : where == "installed")
+    {
+      cout << package << " is already installed"
+           << (lock->waited ? " by another auh process" : "")
+           << "; skipping.\n";
+      lock->outcome = "ok";
+      ev.status = "skipped";
+      ev.detail = "already installed";
+      return 0;
+    }
+
+  // Check if package is in main repos first
+  if (where.empty () ? is_in_main_repos (package) : where == "repo")
+    {
+      ev.source = "repo";
+      if (offline_mode && !repo_targets_cached (package))
+        {
+          cerr << package << " or a dependency is not in the pacman package "
+               << "cache; cannot install it offline\n";
+          ev.detail = "not in the package cache";
+          return 1;
+        }
+      cout << "Found " << package << " in main repos, installing via pacman...\n";
+      int rc = run_pacman ("-S --noconfirm " + package);
+      if (rc == 0)
+        {
+          cout << "Successfully installed " << package << " from main repos\n";
+          lock->outcome = "ok";
+          ev.status = "ok";
+          return 0;
+        }
+      else
+        {
+          cerr << "Failed to install " << package << " from main repos\n";
+          return 1;
+        }
+    }
+
+  // Package not in main repos, try AUR
+  cout << "Package not found in main repos, checking AUR...\n";
+  ev.source = "aur";
+
+  // Catch misspelled names from local data before any network call:
+  // auhd's "missing" verdict or names.list say whether any repo or AUR
+  // package has this name. Online the RPC below still has the last word,
+  // since the list may predate a new package.
+  bool unlisted = where == "missing"
+                  || (where.empty () && name_listed (package) == 0);
+  if (unlisted)
+    {
+      cerr << package << " is not in the local package lists\n";
+      print_suggestions (package);
+    }
+
+  // With --locked, build exactly the pinned commit
+  string ref, pinned_version;
+  if (!pinned_ref (package, ref, pinned_version))
+    {
+      cerr << package << " is not pinned in the lockfile\n";
+      ev.detail = "not pinned in the lockfile";
+      return 1;
+    }
+
+  // Offline, reinstall a package built earlier if one is cached; otherwise
+  // rebuild it from the clone and source caches below
+  if (offline_mode)
+    {
+      string cached = find_cached_package (package, pinned_version);
+      if (cached.empty () && unlisted
+          && access ((cache_dir () + "/clones/" + package).c_str (), F_OK)
+                 != 0)
+        {
+          cerr << "Package not found in main repos or AUR: " << package
+               << '\n';
+          ev.source.clear ();
+          ev.detail = "not found";
+          return 1;
+        }
+      if (!cached.empty ())
+        {
+          cout << "Installing " << package << " from the package cache...\n";
+          ev.detail = cached;
+          if (run_pacman ("-U --noconfirm " + cached) != 0)
+            {
+              cerr << "Failed to install " << cached << '\n';
+              return 1;
+            }
+          lock->outcome = "ok";
+          ev.status = "ok";
+          return 0;
+        }
+    }
+
+  // Query AUR API to check if package exists, unless the daemon's AUR
+  // index already knows it (a "missing" verdict may just be a stale index)
+  if (where != "aur" && !offline_mode && !locked_mode)
+    {
+      string pcmd
+          = "curl -s \"https://aur.archlinux.org/rpc/?v=5&type=info&arg="
+            + package + "\" | jq -c .results";
+      string out = run_capture (pcmd);
+      // Trim trailing whitespace
+      while (!out.empty () && isspace ((unsigned char)out.back ()))
+        out.pop_back ();
+
+      // Empty results array means package not found
+      if (out == "[]")
+        {
+          cerr << "Package not found in main repos or AUR: " << package
+               << '\n';
+          if (!unlisted)
+            print_suggestions (package);
+          ev.source.clear ();
+          ev.detail = "not found";
+          return 1;
+        }
+    }
+
+  // Fetch the package repository through the clone cache into a private
+  // build directory, never into one the user may own in the cwd
+  string workdir = cache_dir () + "/builds/" + package;
+  make_dirs (cache_dir () + "/builds");
+  cout << "Cloning " << package << " from AUR...\n";
+  if (!prepare_workspace (package, package, url, ref, false, workdir))
+    {
+      cerr << "git clone failed for " << package << '\n';
+      ev.detail = "git clone failed";
+      return 1;
+    }
+
+  // Build and install the package
+  cout << "Building " << package << "...\n";
+  string mcmd = "cd " + workdir + " && " + makepkg_command ("-si --noconfirm");
+  if (system (mcmd.c_str ()) != 0)
+    {
+      cerr << "makepkg failed for " << package << '\n';
+      ev.detail = "makepkg failed";
+      remove_tree_async (workdir);
+      return 1;
+    }
+
+  record_footprint (package, workdir);
+  record_vcs_commits (package, workdir);
+  remove_tree_async (workdir);
+  lock->outcome = "ok";
+  ev.status = "ok";
+  return 0;
+}
+
+/**
+ * remove_pkg - Remove an installed package
+ * @package: Package name to remove
+ * @autoremove: If true, also remove dependencies not required by other packages
+ * @purge: If true, also remove configuration files
+ *
+ * Removes a package using pacman:
+ * -R: Remove package
+ * -s: Remove dependencies not required by other packages (if autoremove is true)
+ * -n: Remove configuration files (if purge is true)
+ *
+ * Flag combinations:
+ * - autoremove=false, purge=false: -R (remove package only)
+ * - autoremove=true, purge=false: -Rs (remove package + unneeded deps)
+ * - autoremove=false, purge=true: -Rn (remove package + configs)
+ * - autoremove=true, purge=true: -Rns (remove package + unneeded deps + configs)
+ *
+ * Return: 0 on success, 1 on failure
+ */
+int
+remove_pkg (const string &package, bool autoremove, bool purge)
+{
+  json_event ev ("remove", package);
+
+  // Validate package name to prevent command injection
+  if (!is_valid_package_name (package))
+    {
+      cerr << "Invalid package name: " << package << '\n';
+      ev.detail = "invalid package name";
+      return 1;
+    }
+
+  // Check if package is installed before attempting removal
+  if (!is_installed (package))
+    {
+      cout << package << " is not installed; skipping removal.\n";
+      ev.status = "skipped";
+      ev.detail = "not installed";
+      return 0;
+    }
+  
+  // Build pacman flags based on options
+  string flags = "-R";
+  if (autoremove)
+    flags += "s";
+  if (purge)
+    flags += "n";
+  
+  cout << "Removing " << package << "...\n";
+  int rc = run_pacman (flags + " --noconfirm " + package);
+  if (rc != 0)
+    {
+      cerr << "Removal failed for " << package << " (code " << rc << ")\n";
+      ev.detail = "pacman failed";
+      return 1;
+    }
+  ev.status = "ok";
+  return 0;
+}
+
+/**
+ * update_pkg - Update a package or perform system upgrade
+ * @package: Package name to update, or empty string for full system upgrade
+ *
+ * If package is empty: performs full system upgrade using pacman -Syu
+ * If package is specified: attempts to update via pacman first, then falls
+ * back to rebuilding from AUR if needed.
+ *
+ * For AUR packages, the function:
+ * 1. Creates a temporary directory in /tmp
+ * 2. Clones the latest version from AUR
+ * 3. Rebuilds and installs the package
+ * 4. Removes the temporary directory on a background thread
+ *
+ * Return: 0 on success, 1 on failure
+ */
+int
+update_pkg (const string &package)
+{
+  json_event ev (package.empty () ? "upgrade" : "update", package);
+  if (package.empty ())
+    {
+      ev.source = "repo";
+      if (offline_mode)
+        {
+          cerr << "A full system upgrade needs the network\n";
+          ev.detail = "needs the network";
+          return 1;
+        }
+
+      // Full system upgrade
+      cout << "Performing full system upgrade...\n";
+      int rc = run_pacman ("-Syu --noconfirm");
+      if (rc != 0)
+        {
+          cerr << "System update failed (code " << rc << ")\n";
+          ev.detail = "pacman failed";
+          return 1;
+        }
+      ev.status = "ok";
+      return 0;
+    }
+  else
+    {
+      // Serialize with other auh processes updating the same package; if
+      // one of them just finished the rebuild, there is nothing left to do
+      unique_ptr<host_lock> lock
+          = acquire_host_lock ("pkg-" + package, "updating " + package);
+      if (lock->timed_out)
+        {
+          ev.detail = "timed out waiting for another auh process";
+          return 1;
+        }
+      if (lock->reusable ())
+        {
+          cout << package << " was just updated by another auh process; "
+               << "skipping.\n";
+          lock->outcome = "ok";
+          ev.status = "skipped";
+          ev.detail = "updated by another auh process";
+          return 0;
+        }
+
+      // Update single package via pacman if available in repos;
+      // for AUR packages, rebuild using makepkg
+      if (is_installed (package)
+          && (!offline_mode || repo_targets_cached (package)))
+        {
+          cout << "Updating repo package " << package << "...\n";
+          int rc = run_pacman ("-S --noconfirm " + package);
+          if (rc == 0)
+            {
+              lock->outcome = "ok";
+              ev.source = "repo";
+              ev.status = "ok";
+              return 0;
+            }
+          // Fall back to AUR rebuild if pacman update fails
+        }
+      
+      // Rebuild from AUR
+      cout << "Rebuilding AUR package " << package << "...\n";
+      ev.source = "aur";
+      string url = "https://aur.archlinux.org/" + package + ".git";
+
+      // Build in /tmp unless it cannot hold the expected footprint (it is
+      // often a small tmpfs) next to what other builds reserved there;
+      // reroute to the cache directory in that case
+      bool known;
+      unsigned long long need
+          = estimate_footprint (package, load_footprints (), known);
+      string tmpdir = "/tmp/auh_" + package;
+      if (space_available ("/tmp") < need)
+        {
+          string alt = cache_dir () + "/build";
+          make_dirs (alt);
+          if (space_available (alt) < need)
+            {
+              cerr << "Not enough disk space to rebuild " << package
+                   << ": needs about " << format_bytes (need) << '\n';
+              ev.detail = "not enough disk space";
+              return 1;
+            }
+          tmpdir = alt + "/auh_" + package;
+          cout << "Building " << package << " in " << tmpdir
+               << " (not enough space in /tmp)\n";
+        }
+      unique_ptr<space_reservation> claim
+          = reserve_space (package, tmpdir, need);
+      
+      // Refresh the cached clone and set up a clean build directory
+      if (!prepare_workspace (package, package, url, "HEAD", false, tmpdir))
+        {
+          cerr << "Failed to clone AUR for " << package << '\n';
+          ev.detail = "git clone failed";
+          return 1;
+        }
+      
+      int rc = system (("cd " + tmpdir + " && "
+                        + makepkg_command ("-si --noconfirm"))
+                           .c_str ());
+      if (rc != 0)
+        {
+          cerr << "Rebuild/install failed for " << package << '\n';
+          ev.detail = "makepkg failed";
+          return 1;
+        }
+      
+      // Clean up temporary directory in the background
+      record_footprint (package, tmpdir);
+      record_vcs_commits (package, tmpdir);
+      remove_tree_async (tmpdir);
+      lock->outcome = "ok";
+      ev.status = "ok";
+      return 0;
+    }
+}
+
+/**
+ * autoremove - Remove orphaned packages
+ *
+ * Removes packages that were installed as dependencies but are no longer
+ * required by any installed package. This is the pacman equivalent of
+ * apt's autoremove command.
+ *
+ * Uses 'pacman -Qdtq' to list orphaned packages and validates each before removal.
+ *
+ * Return: 0 on success, 1 on failure or if no orphans found
+ */
+int
+autoremove ()
+{
+  // List orphaned packages and validate each name as it arrives
+  vector<string> orphan_pkgs;
+  size_t listed = 0;
+  for_each_output_line ("pacman -Qdtq", [&] (const char *line, size_t len) {
+    // Trim trailing whitespace from package name
+    while (len && isspace ((unsigned char)line[len - 1]))
+      len--;
+    if (len == 0)
+      return;
+    listed++;
+
+    // Validate package name to prevent command injection
+    string pkg (line, len);
+    if (!is_valid_package_name (pkg))
+      {
+        cerr << "Skipping invalid package name: " << pkg << '\n';
+        return;
+      }
+    orphan_pkgs.push_back (pkg);
+  });
+
+  if (listed == 0)
+    {
+      cout << "No orphaned packages found.\n";
+      return 0;
+    }
+
+  if (orphan_pkgs.empty ())
+    {
+      cout << "No valid orphaned packages to remove.\n";
+      return 0;
+    }
+  
+  // Build safe command with validated package names
+  string args = "-Rs --noconfirm";
+  for (const auto &p : orphan_pkgs)
+    args += " " + p;
+  
+  // Remove orphaned packages
+  cout << "Removing orphaned packages...\n";
+  json_batch events ("remove", orphan_pkgs);
+  int rc = run_pacman (args);
+  events.settle (rc == 0, "orphan");
+  if (rc == 0)
+    {
+      cout << "Successfully removed orphaned packages\n";
+      return 0;
+    }
+  else
+    {
+      cerr << "Failed to remove orphaned packages\n";
+      return 1;
+    }
+}
+
+/**
+ * clean_cache - Clean the pacman package cache
+ *
+ * Runs 'pacman -Scc' to clean both the package cache and unused sync databases.
+ * This frees up disk space by removing downloaded package files.
+ *
+ * The sources and built packages auh keeps in <cache_dir> (see
+ * makepkg_dest()) are removed as well; $SRCDEST or $PKGDEST directories
+ * the user configured are left alone.
+ *
+ * Return: 0 on success, 1 on failure
+ */
+int
+clean_cache ()
+{
+  json_event ev ("clean", string ());
+  int rc = run_pacman ("-Scc --noconfirm");
+  for (const char *sub : { "/sources", "/packages" })
+    if (!remove_tree (cache_dir () + sub))
+      {
+        cerr << "Failed to remove " << cache_dir () << sub << '\n';
+        rc = 1;
+      }
+  if (rc == 0)
+    {
+      ev.status = "ok";
+      cout << "Successfully cleaned\n";
+      return 0;
+    }
+  else
+    {
+      cout << "System cleaning failed\n";
+      return 1;
+    }
+}
+
+/**
+ * build_from_github - Build and install package from GitHub mirror
+ * @package: Package name to install
+ * @mirror_url_base: Base URL of the GitHub mirror (default: archlinux/aur)
+ *
+ * Installs a package from GitHub mirror instead of AUR. Useful when:
+ * - AUR is experiencing downtime or DDOS
+ * - Mirror is preferred for reliability
+ * - Testing mirror functionality
+ *
+ * The function:
+ * 1. Creates a temporary working directory
+ * 2. Clones the package from GitHub mirror (shallow clone, single branch)
+ * 3. Builds the package using makepkg with --skippgpcheck
+ * 4. Installs the built package
+ * 5. Removes the temporary directory on a background thread
+ *
+ * Return: 0 on success, 1 on clone failure, 4 on build failure
+ */
+static int
+build_from_github (const std::string &package,
+                   const std::string &mirror_url_base
+                   = "https://github.com/archlinux/aur")
+{
+  json_event ev ("install", package);
+  ev.source = "github";
+
+  // Create temporary working directory
+  const std::string tmpdir = "./auh_mirror_" + package;
+
+  // Share the per-package lock with install_pkg and update_pkg so that
+  // concurrent auh processes do not build the same package twice
+  std::unique_ptr<host_lock> lock
+      = acquire_host_lock ("pkg-" + package, "installing " + package);
+  if (lock->timed_out)
+    {
+      ev.detail = "timed out waiting for another auh process";
+      return 1;
+    }
+  if (lock->reusable ())
+    {
+      std::cout << package << " was just installed by another auh process; "
+                << "skipping.\n";
+      lock->outcome = "ok";
+      ev.status = "skipped";
+      ev.detail = "installed by another auh process";
+      return 0;
+    }
+
+  // Clone mirror with shallow clone for speed (single branch, depth=1, no
+  // tags), kept in the clone cache and materialized into a clean directory
+  if (!prepare_workspace (package, "mirror/" + package,
+                          mirror_url_base + ".git", package, true, tmpdir))
+    {
+      std::cerr << "Failed to clone mirror for " << package << '\n';
+      ev.detail = "git clone failed";
+      return 1;
+    }
+
+  // Build and install package (skip PGP checks for mirror packages)
+  std::string mkcmd = "cd " + tmpdir + " && "
+                      + makepkg_command ("-si --noconfirm --skippgpcheck");
+  int mkrc = system (mkcmd.c_str ());
+  if (mkrc == 0)
+    {
+      record_footprint (package, tmpdir);
+      record_vcs_commits (package, tmpdir);
+    }
+
+  // Clean up temporary directory in the background
+  remove_tree_async (tmpdir);
+
+  if (mkrc != 0)
+    {
+      std::cerr << "makepkg failed for " << package << " (code " << mkrc
+                << ")\n";
+      ev.detail = "makepkg failed";
+      return 4;
+    }
+
+  lock->outcome = "ok";
+  ev.status = "ok";
+  std::cout << "Built and installed " << package << " from mirror branch.\n";
+  return 0;
+}
+
+/**
+ * is_aur_up - Check if AUR is accessible
+ *
+ * Tests AUR availability by sending an HTTP request and checking the status code.
+ * Uses curl to get the HTTP response code from the AUR website.
+ *
+ * Return: true if AUR is up (HTTP 200-399), false otherwise
+ */
+bool
+is_aur_up ()
+{
+  const std::string url = "https://aur.archlinux.org";
+
+  // Get HTTP status code using curl
+  std::string curl_cmd = "curl -s -o /dev/null -w \"%{http_code}\" " + url;
+  std::string http_code_str = run_capture (curl_cmd);
+
+  int http_code = 0;
+  try
+    {
+      http_code = std::stoi (http_code_str);
+    }
+  catch (...)
+    {
+      std::cerr << "Failed to get AUR HTTP status code\n";
+      return 1;
+    }
+
+  // HTTP codes 200-399 indicate success/redirection (AUR is up)
+  std::string status_text;
+  if (http_code >= 200 && http_code < 400)
+    {
+      return true;
+    }
+  else
+    {
+      return false;
+    }
+}
+
+/**
+ * install_packages_parallel - Install multiple packages in parallel
+ * @packages: Vector of package names to install
+ * @use_aur: If true, install from AUR; if false, use GitHub mirror
+ *
+ * Installs multiple packages in parallel using fork() to improve performance.
+ * The function limits concurrent installations to prevent system overload.
+ *
+ * Process flow:
+ * 1. Validates each package name before processing
+ * 2. Estimates each AUR build's disk footprint and checks it against the
+ *    free space of the build filesystem, minus what running builds of any
+ *    auh process reserved (see reserve_space()); repository packages
+ *    reserve nothing
+ * 3. Forks child processes (up to max_concurrent limit), deferring jobs
+ *    that do not fit until a running build finishes
+ * 4. Each child installs one package
+ * 5. Parent waits for children to complete
+ * 6. Tracks failures and reports summary
+ *
+ * The parallel installation can significantly reduce total installation time
+ * when installing multiple packages, especially for packages with no
+ * interdependencies.
+ *
+ * Return: 0 if all packages installed successfully, 1 if any failed
+ */
+int
+install_packages_parallel (const vector<string> &packages, bool use_aur)
+{
+  // Limit concurrent installations to prevent overwhelming the system
+  const size_t max_concurrent = 4;
+  struct running_job
+  {
+    pid_t pid;
+    unsigned long long reserved;
+    unique_ptr<space_reservation> claim;
+  };
+  vector<running_job> children;
+  vector<string> queue;
+  vector<string> deferred;
+  int failed_count = 0;
+  map<string, unsigned long long> footprints = load_footprints ();
+  // install_pkg() builds in the cache, build_from_github() in the cwd
+  const string build_root = use_aur ? cache_dir () + "/builds" : ".";
+
+  // Validate package names before processing to prevent injection attacks
+  for (const auto &pkg : packages)
+    {
+      if (!is_valid_package_name (pkg))
+        {
+          cerr << "Invalid package name: " << pkg << '\n';
+          json_event ("install", pkg).detail = "invalid package name";
+          failed_count++;
+          continue;
+        }
+      queue.push_back (pkg);
+    }
+
+  // Bring the repository name table up to date once, before forking, so
+  // that the children only map it instead of all rebuilding it at once.
+  // Repository packages are installed by pacman, not built, so only AUR
+  // builds reserve space.
+  set<string> from_repo;
+  if (use_aur)
+    for (const auto &pkg : queue)
+      if (is_in_main_repos (pkg))
+        from_repo.insert (pkg);
+
+  // Process packages: start new installations and wait for completions
+  while (!queue.empty () || !children.empty ())
+    {
+      // Space left for new builds once running ones reach their footprint;
+      // reserved_space() already counts the children holding a claim
+      unsigned long long avail = space_available (build_root);
+      for (const auto &c : children)
+        if (!c.claim)
+          avail = avail > c.reserved ? avail - c.reserved : 0;
+
+      // Start new processes up to the concurrency limit
+      size_t i = 0;
+      while (i < queue.size () && children.size () < max_concurrent)
+        {
+          const string pkg = queue[i];
+          bool known = true;
+          unsigned long long need
+              = from_repo.count (pkg)
+                    ? 0
+                    : estimate_footprint (pkg, footprints, known);
+
+          if (need > avail)
+            {
+              // Defer while other builds may still release their space
+              if (!children.empty ())
+                {
+                  if (find (deferred.begin (), deferred.end (), pkg)
+                      == deferred.end ())
+                    {
+                      cout << "Deferring " << pkg << ": needs about "
+                           << format_bytes (need) << ", "
+                           << format_bytes (avail) << " available\n";
+                      deferred.push_back (pkg);
+                    }
+                  i++;
+                  continue;
+                }
+
+              // Nothing else is running, so waiting will not help; only
+              // refuse when history says the build really is this large
+              if (known)
+                {
+                  cerr << "Not enough disk space to build " << pkg
+                       << ": needs about " << format_bytes (need) << ", "
+                       << format_bytes (avail) << " available\n";
+                  json_event ("install", pkg).detail = "not enough disk space";
+                  failed_count++;
+                  queue.erase (queue.begin () + i);
+                  continue;
+                }
+            }
+
+          // The child inherits the claim's flock; the parent releases it
+          unique_ptr<space_reservation> claim = reserve_space (
+              pkg, build_root + (use_aur ? "/" : "/auh_mirror_") + pkg,
+              need);
+          pid_t pid = fork ();
+
+          if (pid == 0)
+            {
+              // Child process: install the package and exit with result code
+              string url = "https://aur.archlinux.org/" + pkg + ".git";
+              int result;
+              if (use_aur)
+                result = install_pkg (pkg, url);
+              else
+                result = build_from_github (pkg);
+              exit (result);
+            }
+          else if (pid > 0)
+            {
+              // Parent process: store child PID and its reservation
+              children.push_back ({ pid, need, move (claim) });
+              avail = avail > need ? avail - need : 0;
+            }
+          else
+            {
+              // Fork failed
+              cerr << "Failed to fork for package: " << pkg << '\n';
+              json_event ("install", pkg).detail = "fork failed";
+              failed_count++;
+            }
+          queue.erase (queue.begin () + i);
+        }
+
+      // Wait for at least one child to complete before starting more
+      if (!children.empty ())
+        {
+          int status;
+          pid_t finished = wait (&status);
+          if (finished > 0)
+            {
+              // Remove finished process from children vector
+              children.erase (
+                  remove_if (children.begin (), children.end (),
+                             [finished] (const running_job &c) {
+                               return c.pid == finished;
+                             }),
+                  children.end ());
+
+              // Check exit status and track failures
+              if (WIFEXITED (status) && WEXITSTATUS (status) != 0)
+                {
+                  failed_count++;
+                }
+            }
+        }
+    }
+
+  // Report summary if there were failures
+  if (failed_count > 0)
+    {
+      cerr << failed_count << " package(s) failed to install.\n";
+      return 1;
+    }
+
+  return 0;
+}
+
+/**
+ * foreign_packages - Installed packages that no sync DB provides
+ * @installed: Installed snapshot
+ * @explicit_only: Leave out packages installed as dependencies
+ *
+ * Names are looked up in the repo-names table, or in the output of
+ * "pacman -Sl" if the table cannot be built.
+ *
+ * Return: Names of the foreign packages, sorted
+ */
+static vector<string>
+foreign_packages (const installed_snapshot &installed, bool explicit_only)
+{
+  repo_names names;
+  bool have_names = names.open ();
+  sync_catalog catalog;
+  if (!have_names)
+    catalog = load_sync_catalog ();
+
+  vector<string> foreign;
+  for (const auto &p : installed)
+    {
+      if (explicit_only && !p.explicit_install)
+        continue;
+      string name = installed.str (p.name);
+      if (have_names ? names.lookup (name) == NULL : !catalog.count (name))
+        foreign.push_back (name);
+    }
+  return foreign;
+}
+
+// AUR verdicts of "auh sync" are reused for this many seconds
+static const long sync_verdict_ttl = 7 * 24 * 60 * 60;
+
+/**
+ * struct sync_verdict - Whether an explicit package was found in the AUR
+ * @aur: true if the AUR has the package
+ * @checked: When this was last checked
+ */
+struct sync_verdict
+{
+  bool aur;
+  time_t checked;
+};
+
+/**
+ * sync_verdicts_path - Path of the verdicts kept between "auh sync" runs
+ *
+ * Return: <cache_dir>/sync-verdicts.tsv
+ */
+static string
+sync_verdicts_path ()
+{
+  return cache_dir () + "/sync-verdicts.tsv";
+}
+
+/**
+ * load_sync_verdicts - Read the verdicts of the previous "auh sync" run
+ *
+ * Lines are "<name>\t<0|1>\t<checked>"; malformed lines are ignored.
+ *
+ * Return: Verdicts by package name; empty if there was no previous run
+ */
+static map<string, sync_verdict>
+load_sync_verdicts ()
+{
+  map<string, sync_verdict> verdicts;
+  ifstream in (sync_verdicts_path ());
+  string line;
+  while (getline (in, line))
+    {
+      vector<string> f = split_tabs (line);
+      if (f.size () == 3 && is_valid_package_name (f[0]))
+        verdicts[f[0]]
+            = { f[1] == "1", (time_t)strtoll (f[2].c_str (), NULL, 10) };
+    }
+  return verdicts;
+}
+
+/**
+ * save_sync_verdicts - Replace the verdicts kept for the next run
+ * @verdicts: Verdicts of the current explicit set
+ */
+static void
+save_sync_verdicts (const map<string, sync_verdict> &verdicts)
+{
+  string path = sync_verdicts_path ();
+  string tmp = temp_path (path);
+  {
+    ofstream out (tmp, ios::trunc);
+    for (const auto &v : verdicts)
+      out << v.first << '\t' << (v.second.aur ? 1 : 0) << '\t'
+          << (long long)v.second.checked << '\n';
+    if (!out.flush ())
+      {
+        unlink (tmp.c_str ());
+        return;
+      }
+  }
+  rename (tmp.c_str (), path.c_str ());
+}
+
+/**
+ * sync_explicit - List explicitly installed AUR packages
+ *
+ * Takes the explicitly installed packages from the local DB and keeps
+ * only the foreign ones, those no sync DB provides; everything else
+ * comes from a repository and is never sent to the AUR. The remaining
+ * candidates are checked in one batched RPC request. Their verdicts are
+ * kept in sync_verdicts_path(), so a run only checks candidates that
+ * became foreign or explicit since the last one or whose verdict is
+ * older than sync_verdict_ttl; packages no longer candidates are dropped.
+ * Offline, the local AUR metadata answers instead, and its verdicts are
+ * kept only until the next online run.
+ *
+ * This is useful for:
+ * - Auditing which packages came from AUR
+ * - Managing your AUR package list
+ * - Identifying packages for backup/migration
+ *
+ * Return: 0 on success
+ */
+int
+sync_explicit ()
+{
+  auto start = chrono::steady_clock::now ();
+  auto found = [start] (const string &name) {
+    cout << "Found AUR package: " << name << "\n";
+    json_record ()
+        .field ("package", name)
+        .field ("action", "sync")
+        .field ("source", "aur")
+        .outcome (start)
+        .emit ();
+  };
+
+  // A running auhd answers from its resident snapshot and AUR index
+  vector<string> reply;
+  if (daemon_request ("sync", reply))
+    {
+      for (const auto &name : reply)
+        found (name);
+      cout << "Total AUR packages found in explicitly installed: "
+           << reply.size () << "\n";
+      return 0;
+    }
+
+  // Explicit packages that no sync DB provides are the only candidates
+  installed_snapshot installed = load_installed_snapshot ();
+  size_t explicit_count = 0;
+  for (const auto &p : installed)
+    explicit_count += p.explicit_install;
+  vector<string> explicit_pkgs = foreign_packages (installed, true);
+
+  if (explicit_count == 0)
+    {
+      cout << "No explicitly installed packages found.\n";
+      return 0;
+    }
+
+  // Only candidates added since the last run or with an expired verdict
+  // are checked again
+  map<string, sync_verdict> verdicts = load_sync_verdicts ();
+  time_t now = time (NULL);
+  vector<string> stale;
+  for (const auto &pkg : explicit_pkgs)
+    {
+      auto it = verdicts.find (pkg);
+      if (it == verdicts.end ()
+          || now - it->second.checked >= sync_verdict_ttl)
+        stale.push_back (pkg);
+    }
+  if (!stale.empty ())
+    cout << "Checking " << stale.size () << " of " << explicit_pkgs.size ()
+         << " foreign packages (" << explicit_count
+         << " explicitly installed) against AUR...\n";
+
+  // Offline, the local metadata dump stands in for the AUR API. It may
+  // be old, so its verdicts are saved as already expired and the next
+  // online run checks these packages again
+  if (offline_mode && !stale.empty ())
+    {
+      if (refresh_aur_index (false))
+        {
+          aur_index aur = load_aur_index ();
+          for (const auto &pkg : stale)
+            verdicts[pkg] = { aur.count (pkg) != 0, 0 };
+        }
+      else
+        cerr << "AUR metadata is not available; using previous results\n";
+    }
+  else
+    {
+      // A failed request keeps the previous verdicts
+      set<string> present;
+      vector<string> urls = aur_info_urls (stale);
+      auto add = [&present] (size_t, const string &name) {
+        present.insert (name);
+      };
+      if (aur_rpc (urls, ".Name", add) == urls.size ())
+        for (const auto &pkg : stale)
+          verdicts[pkg] = { present.count (pkg) != 0, now };
+      else
+        cerr << "Could not reach the AUR; using previous results\n";
+    }
+
+  // Report the merged result and forget packages no longer explicit
+  map<string, sync_verdict> current;
+  int synced_count = 0;
+  for (const auto &pkg : explicit_pkgs)
+    {
+      auto it = verdicts.find (pkg);
+      if (it == verdicts.end ())
+        continue;
+      current.insert (*it);
+      if (it->second.aur)
+        {
+          found (pkg);
+          synced_count++;
+        }
+    }
+  save_sync_verdicts (current);
+
+  cout << "Total AUR packages found in explicitly installed: " << synced_count
+       << "\n";
+  return 0;
+}
+
+/**
+ * rebuild_index - Rebuild the installed-state indexes from the local DB
+ *
+ * Writes installed.tsv (installed snapshot and dependencies, from which
+ * the reverse-dependency index is derived) and files.tsv (file ownership)
+ * below index_dir() and discards their journals.
+ *
+ * Return: 0 on success, 1 on failure
+ */
+int
+rebuild_index ()
+{
+  json_event ev ("index", string ());
+  make_dirs (index_dir ());
+  index_records installed, files;
+  for (const auto &e : local_db_entries ())
+    index_package (e.first, e.second, installed, files);
+
+  if (!write_index ("installed.tsv", installed)
+      || !write_index ("files.tsv", files))
+    {
+      cerr << "Failed to write package index in " << index_dir () << '\n';
+      return 1;
+    }
+  cout << "Indexed " << installed.size () << " installed packages\n";
+  ev.status = "ok";
+  ev.detail = to_string (installed.size ()) + " packages";
+  return 0;
+}
+
+/**
+ * apply_index_delta - Patch the indexes after a pacman transaction
+ * @targets: Packages installed, upgraded or removed by the transaction
+ *
+ * Called by the pacman hook with the transaction targets. Only the DB
+ * entries of @targets are read; their new records (or their removal) are
+ * appended to the index journals. Falls back to a full rebuild when no
+ * index exists yet.
+ *
+ * Return: 0 on success, 1 on failure
+ */
+int
+apply_index_delta (const vector<string> &targets)
+{
+  if (access ((index_dir () + "/installed.tsv").c_str (), F_OK) != 0)
+    return rebuild_index ();
+
+  map<string, string> entries = local_db_entries ();
+  index_records installed, files;
+  vector<string> changed;
+  for (const auto &name : targets)
+    {
+      if (!is_valid_package_name (name))
+        continue;
+      changed.push_back (name);
+      auto it = entries.find (name);
+      if (it != entries.end ())
+        index_package (name, it->second, installed, files);
+    }
+
+  if (!append_index_delta ("installed.tsv", changed, installed)
+      || !append_index_delta ("files.tsv", changed, files))
+    {
+      cerr << "Failed to update package index in " << index_dir () << '\n';
+      return 1;
+    }
+  return 0;
+}
+
+/**
+ * index_owner - Print the package that owns a file
+ * @path: Absolute or root-relative file path
+ *
+ * Uses files.tsv when the index is current and reads the local DB file
+ * lists otherwise.
+ *
+ * Return: 0 if an owner was found, 1 otherwise
+ */
+int
+index_owner (const string &path)
+{
+  auto start = chrono::steady_clock::now ();
+  size_t skip = path.find_first_not_of ('/');
+  string wanted = skip == string::npos ? string () : path.substr (skip);
+  index_records files;
+  if (index_is_fresh ())
+    files = load_index ("files.tsv");
+  else
+    {
+      index_records installed;
+      for (const auto &e : local_db_entries ())
+        index_package (e.first, e.second, installed, files);
+    }
+
+  for (const auto &r : files)
+    for (const auto &line : r.second)
+      if (line.compare (r.first.size () + 1, string::npos, wanted) == 0)
+        {
+          cout << "/" << wanted << " is owned by " << r.first << "\n";
+          json_record ()
+              .field ("package", r.first)
+              .field ("action", "owns")
+              .field ("file", "/" + wanted)
+              .outcome (start)
+              .emit ();
+          return 0;
+        }
+  cerr << "No package owns /" << wanted << '\n';
+  return 1;
+}
+
+/**
+ * index_required_by - Print the installed packages depending on a package
+ * @package: Dependency name
+ *
+ * A dependency counts if it names @package or, when @package is
+ * installed, one of the names it provides, as in pacman's "Required By".
+ * The dependents are found with one pass over the snapshot's dependency
+ * ids rather than a separately journaled reverse index.
+ *
+ * Return: 0 on success
+ */
+int
+index_required_by (const string &package)
+{
+  auto start = chrono::steady_clock::now ();
+  int count = 0;
+  installed_snapshot installed = load_installed_snapshot ();
+  vector<uint32_t> wanted;
+  uint32_t id = installed.strings.lookup (package);
+  if (id != no_id)
+    wanted.push_back (id);
+  if (const installed_pkg *self = installed.find (package))
+    wanted.insert (wanted.end (),
+                   installed.provides.begin () + self->provides_begin,
+                   installed.provides.begin () + self->provides_end);
+
+  const uint32_t *deps = installed.depends.data ();
+  for (const auto &p : installed)
+    if (find_first_of (deps + p.depends_begin, deps + p.depends_end,
+                       wanted.begin (), wanted.end ())
+        != deps + p.depends_end)
+      {
+        cout << installed.str (p.name) << "\n";
+        json_record ()
+            .field ("package", installed.str (p.name))
+            .field ("action", "required-by")
+            .field ("dependency", package)
+            .field ("version", installed.str (p.version))
+            .outcome (start)
+            .emit ();
+        count++;
+      }
+  if (count == 0)
+    cout << "No installed package requires " << package << "\n";
+  return 0;
+}
+
+/**
+ * search - Search repo and AUR packages by name and description
+ * @terms: Search terms, all of which must match
+ * @limit: Maximum number of results
+ *
+ * Works offline from the local trigram index, which is rebuilt from the
+ * sync databases and the AUR metadata whenever either is newer. Asks
+ * auhd first when it is running.
+ *
+ * Return: 0 if something matched, 1 otherwise
+ */
+int
+search (const vector<string> &terms, size_t limit)
+{
+  auto start = chrono::steady_clock::now ();
+  vector<search_hit> hits;
+  vector<string> lines;
+  string request = "search " + to_string (limit);
+  for (const auto &t : terms)
+    request += " " + t;
+  if (daemon_request (request, lines))
+    {
+      search_hit h;
+      for (const auto &line : lines)
+        if (search_hit_from_tsv (line, h))
+          hits.push_back (h);
+    }
+  else
+    {
+      refresh_aur_index (false);
+      hits = search_packages (terms, limit);
+    }
+
+  if (hits.empty ())
+    {
+      cerr << "No packages match.\n";
+      return 1;
+    }
+
+  // Formatted like "pacman -Ss", with votes and popularity for the AUR
+  for (const auto &h : hits)
+    {
+      bool aur = h.source == "aur";
+      char votes[16], popularity[32];
+      snprintf (votes, sizeof (votes), "%u", h.votes);
+      snprintf (popularity, sizeof (popularity), "%.2f", h.popularity);
+      cout << h.source << "/" << h.name << " " << h.version;
+      if (aur)
+        cout << " (+" << votes << " " << popularity << ")";
+      cout << "\n    " << h.description << "\n";
+      json_record ()
+          .field ("package", h.name)
+          .field ("action", "search")
+          .field ("source", h.source)
+          .field ("version", h.version)
+          .raw ("votes", aur ? votes : "")
+          .raw ("popularity", aur ? popularity : "")
+          .field ("description", h.description)
+          .outcome (start)
+          .emit ();
+    }
+  return 0;
+}
+
+/**
+ * query - Filter AUR packages by metadata
+ * @q: Predicates to apply
+ * @count_only: Print only the number of matches
+ *
+ * Runs column scans over the local AUR metadata (see query_aur()),
+ * optionally joined against the installed packages.
+ *
+ * Return: 0 on success, 1 if no AUR metadata is available
+ */
+int
+query (const aur_query &q, bool count_only)
+{
+  auto start = chrono::steady_clock::now ();
+  if (!refresh_aur_index (false))
+    {
+      cerr << "AUR metadata is not available\n";
+      return 1;
+    }
+  vector<aur_match> matches = query_aur (q);
+  if (count_only)
+    {
+      cout << matches.size () << "\n";
+      json_record ()
+          .field ("action", "query")
+          .raw ("count", to_string (matches.size ()))
+          .outcome (start)
+          .emit ();
+      return 0;
+    }
+  for (const auto &m : matches)
+    {
+      char date[16], popularity[32], line[512];
+      strftime (date, sizeof (date), "%Y-%m-%d", gmtime (&m.last_modified));
+      snprintf (popularity, sizeof (popularity), "%.2f", m.popularity);
+      snprintf (line, sizeof (line), "%-40s %6u %8s  %s  %s%s",
+                m.name.c_str (), m.votes, popularity, date,
+                m.maintainer.empty () ? "(orphan)" : m.maintainer.c_str (),
+                m.out_of_date ? "  flagged" : "");
+      cout << line << "\n";
+      json_record ()
+          .field ("package", m.name)
+          .field ("action", "query")
+          .field ("source", "aur")
+          .raw ("votes", to_string (m.votes))
+          .raw ("popularity", popularity)
+          .field ("last_modified", date)
+          .field ("maintainer", m.maintainer)
+          .raw ("flagged", m.out_of_date ? "true" : "false")
+          .outcome (start)
+          .emit ();
+    }
+  return 0;
+}
+
+/**
+ * info - Show details for several packages
+ * @packages: Package names
+ *
+ * Repository packages are described by a single "pacman -Si" run; all
+ * remaining names are looked up in the AUR with batched RPC requests
+ * (see fetch_aur_info()), so any number of packages costs at most one
+ * pacman process and one curl process.
+ *
+ * Return: 0 if every package was found, 1 otherwise
+ */
+int
+info (const vector<string> &packages)
+{
+  auto start = chrono::steady_clock::now ();
+  vector<string> names;
+  int failed = 0;
+  for (const auto &p : packages)
+    {
+      if (is_valid_package_name (p))
+        names.push_back (p);
+      else
+        {
+          cerr << "Invalid package name: " << p << '\n';
+          failed++;
+        }
+    }
+
+  map<string, pkg_info> found;
+  fetch_repo_info (names, found);
+  vector<string> aur_names;
+  for (const auto &n : names)
+    if (!found.count (n))
+      aur_names.push_back (n);
+  if (!aur_names.empty ())
+    fetch_aur_info (aur_names, found);
+
+  for (const auto &n : names)
+    {
+      auto it = found.find (n);
+      if (it == found.end ())
+        {
+          cerr << "Package not found in main repos or AUR: " << n << '\n';
+          print_suggestions (n);
+          json_record ()
+              .field ("package", n)
+              .field ("action", "info")
+              .outcome (start, "failed")
+              .field ("detail", "not found")
+              .emit ();
+          failed++;
+          continue;
+        }
+      pkg_info i = it->second;
+
+      // AUR timestamps are Unix times; show them as dates
+      for (string *t : { &i.last_modified, &i.out_of_date })
+        if (i.source == "aur" && !t->empty ())
+          {
+            time_t secs = strtol (t->c_str (), NULL, 10);
+            char date[32];
+            strftime (date, sizeof (date), "%Y-%m-%d %H:%M UTC",
+                      gmtime (&secs));
+            *t = date;
+          }
+
+      // Label for text output, key for JSON output, value
+      struct field
+      {
+        const char *label;
+        const char *key;
+        const string *value;
+      };
+      const field fields[] = {
+        { "Repository", "source", &i.source },
+        { "Name", "package", &i.name },
+        { "Version", "version", &i.version },
+        { "Description", "description", &i.description },
+        { "URL", "url", &i.url },
+        { "Depends On", "depends", &i.depends },
+        { "Make Deps", "makedepends", &i.makedepends },
+        { "Maintainer", "maintainer", &i.maintainer },
+        { "Votes", "votes", &i.votes },
+        { "Popularity", "popularity", &i.popularity },
+        { "Last Modified", "last_modified", &i.last_modified },
+        { "Out Of Date", "out_of_date", &i.out_of_date },
+      };
+      json_record rec;
+      rec.field ("package", i.name).field ("action", "info");
+      for (const auto &f : fields)
+        {
+          if (f.value == &i.votes || f.value == &i.popularity)
+            rec.raw (f.key, *f.value);
+          else if (f.value != &i.name)
+            rec.field (f.key, *f.value);
+          if (!f.value->empty ())
+            {
+              char label[32];
+              snprintf (label, sizeof (label), "%-15s : ", f.label);
+              cout << label << *f.value << "\n";
+            }
+        }
+      cout << "\n";
+      rec.outcome (start).emit ();
+    }
+  return failed ? 1 : 0;
+}
+
+// Upstream heads of VCS packages are asked for this many at a time, and
+// each request gives up after vcs_check_timeout seconds
+static const unsigned vcs_check_jobs = 16;
+static const unsigned vcs_check_timeout = 20;
+
+/**
+ * struct vcs_moved - A VCS package whose upstream moved since its build
+ * @package: Package name
+ * @url: Upstream repository that moved
+ * @built: Commit or revision the installed package was built from
+ * @upstream: Current commit or revision upstream
+ */
+struct vcs_moved
+{
+  string package;
+  string url;
+  string built;
+  string upstream;
+};
+
+/**
+ * list_vcs_moved - Find installed VCS packages whose upstream moved
+ * @untracked: Receives foreign -git and -svn packages with no recorded
+ *             build, which cannot be compared
+ *
+ * Compares the commits record_vcs_commits() kept for each installed
+ * foreign package with the upstream heads. Every repository and ref is
+ * asked once, however many packages build from it, with "git ls-remote"
+ * or "svn info" runs in a pool of vcs_check_jobs threads, each bounded by
+ * timeout(1). Repositories that do not answer are reported on stderr and
+ * count as unchanged.
+ *
+ * Return: One entry per package whose upstream moved, sorted by name
+ */
+static vector<vcs_moved>
+list_vcs_moved (vector<string> &untracked)
+{
+  installed_snapshot installed = load_installed_snapshot ();
+  string dir = cache_dir () + "/vcs";
+  vector<pair<string, vcs_source> > tracked;
+  map<string, string> heads; // "<kind>\t<url>\t<ref>" to upstream head
+  for (const auto &name : foreign_packages (installed, false))
+    {
+      ifstream in (dir + "/" + name);
+      string line;
+      bool any = false;
+      while (getline (in, line))
+        {
+          vector<string> f = split_tabs (line);
+          if (f.size () != 4)
+            continue;
+          tracked.push_back ({ name, { f[0], f[1], f[2], string (), f[3] } });
+          heads[f[0] + "\t" + f[1] + "\t" + f[2]];
+          any = true;
+        }
+      size_t n = name.size ();
+      if (!any && n > 4
+          && (name.compare (n - 4, 4, "-git") == 0
+              || name.compare (n - 4, 4, "-svn") == 0))
+        untracked.push_back (name);
+    }
+
+  vector<map<string, string>::iterator> queries;
+  for (auto it = heads.begin (); it != heads.end (); ++it)
+    queries.push_back (it);
+  string timeout = "timeout " + to_string (vcs_check_timeout) + " ";
+  atomic<size_t> next (0);
+  vector<thread> pool;
+  for (unsigned t = 0; t < min<size_t> (vcs_check_jobs, queries.size ()); ++t)
+    pool.emplace_back ([&] () {
+      for (size_t i; (i = next++) < queries.size ();)
+        {
+          vector<string> key = split_tabs (queries[i]->first);
+          string cmd = key[0] == "git"
+                           ? "GIT_TERMINAL_PROMPT=0 " + timeout
+                                 + "git ls-remote " + shell_quote (key[1])
+                                 + " " + shell_quote (key[2])
+                           : timeout + "svn info --non-interactive "
+                                 "--show-item last-changed-revision "
+                                 + shell_quote (key[1]);
+          string out = run_capture (cmd + " 2>/dev/null");
+          queries[i]->second = out.substr (0, out.find_first_of (" \t\n"));
+        }
+    });
+  for (auto &t : pool)
+    t.join ();
+
+  vector<vcs_moved> moved;
+  for (const auto &t : tracked)
+    {
+      const vcs_source &s = t.second;
+      const string &head = heads[s.kind + "\t" + s.url + "\t" + s.ref];
+      if (head.empty ())
+        cerr << "Cannot reach " << s.url << " (" << t.first << ")\n";
+      else if (head != s.commit
+               && (moved.empty () || moved.back ().package != t.first))
+        moved.push_back ({ t.first, s.url, s.commit, head });
+    }
+  return moved;
+}
+
+/**
+ * outdated_vcs - List installed VCS packages whose upstream moved
+ * @moved: Receives the packages, may be NULL
+ *
+ * Return: 0 on success, 1 when offline
+ */
+static int
+outdated_vcs (vector<vcs_moved> *moved)
+{
+  auto start = chrono::steady_clock::now ();
+  if (offline_mode)
+    {
+      cerr << "Checking VCS upstreams needs the network\n";
+      return 1;
+    }
+  vector<string> untracked;
+  vector<vcs_moved> found = list_vcs_moved (untracked);
+  if (!untracked.empty ())
+    {
+      cerr << "No build commits recorded for";
+      for (const auto &name : untracked)
+        cerr << " " << name;
+      cerr << "; rebuild them once to track their upstream\n";
+    }
+
+  if (found.empty ())
+    cout << "No VCS package has upstream changes.\n";
+  for (const auto &m : found)
+    {
+      cout << m.package << " " << m.url << " " << m.built.substr (0, 12)
+           << " -> " << m.upstream.substr (0, 12) << "\n";
+      json_record ()
+          .field ("package", m.package)
+          .field ("action", "outdated")
+          .field ("source", "aur")
+          .field ("commit", m.built)
+          .field ("available", m.upstream)
+          .field ("detail", m.url)
+          .outcome (start)
+          .emit ();
+    }
+  if (moved)
+    moved->swap (found);
+  return 0;
+}
+
+/**
+ * outdated - List installed AUR packages with a newer version in the AUR
+ * @vcs: List VCS packages whose upstream moved instead, see
+ *       list_vcs_moved()
+ *
+ * Compares the installed snapshot against the AUR metadata index, asking
+ * auhd when it is running and loading both locally otherwise. Packages
+ * that also exist in a sync database are left to pacman. The version of
+ * a VCS package in the AUR does not change when its upstream does, which
+ * is what @vcs is for.
+ *
+ * Return: 0 on success, 1 if no AUR index is available
+ */
+int
+outdated (bool vcs)
+{
+  if (vcs)
+    return outdated_vcs (NULL);
+
+  auto start = chrono::steady_clock::now ();
+  vector<outdated_pkg> found;
+  vector<string> lines;
+  if (daemon_request ("outdated", lines))
+    {
+      // auhd answers with "<name>\t<version>\t<available>" lines
+      for (const auto &line : lines)
+        {
+          vector<string> f = split_tabs (line);
+          if (f.size () == 3)
+            found.push_back ({ f[0], f[1], f[2] });
+        }
+    }
+  else
+    {
+      if (!refresh_aur_index (false))
+        {
+          cerr << "AUR metadata is not available\n";
+          return 1;
+        }
+      found = list_outdated (load_installed_snapshot (), load_sync_catalog (),
+                             load_aur_index ());
+    }
+
+  if (found.empty ())
+    cout << "All AUR packages are up to date.\n";
+  for (const auto &o : found)
+    {
+      cout << o.name << " " << o.version << " -> " << o.available << "\n";
+      json_record ()
+          .field ("package", o.name)
+          .field ("action", "outdated")
+          .field ("source", "aur")
+          .field ("version", o.version)
+          .field ("available", o.available)
+          .outcome (start)
+          .emit ();
+    }
+  return 0;
+}
+
+// The security tracker feed is downloaded again when older than this
+static const long advisories_max_age = 60 * 60;
+
+/**
+ * struct advisory - One package of an issue group of the security tracker
+ * @group: Group id, such as AVG-2843
+ * @severity: Severity of the group
+ * @fixed: First version with the fix, empty if there is none yet
+ * @issues: CVE ids, separated by spaces
+ */
+struct advisory
+{
+  string group;
+  string severity;
+  string fixed;
+  string issues;
+};
+
+/**
+ * refresh_advisories - Download the security tracker feed if it is stale
+ *
+ * Keeps issues/all.json of security.archlinux.org as
+ * <cache_dir>/advisories.json. Offline, the last download is used.
+ *
+ * Return: Path of the feed, or empty if none was ever downloaded
+ */
+static string
+refresh_advisories ()
+{
+  string path = cache_dir () + "/advisories.json";
+  struct stat st;
+  bool exists = stat (path.c_str (), &st) == 0;
+  if (offline_mode
+      || (exists && time (NULL) - st.st_mtime < advisories_max_age))
+    return exists ? path : string ();
+
+  make_dirs (cache_dir ());
+  string tmp = temp_path (path);
+  string cmd = "curl -sf -o " + shell_quote (tmp)
+               + " https://security.archlinux.org/issues/all.json"
+                 " 2>/dev/null";
+  if (system (cmd.c_str ()) == 0 && rename (tmp.c_str (), path.c_str ()) == 0)
+    return path;
+  unlink (tmp.c_str ());
+  return exists ? path : string ();
+}
+
+/**
+ * audit_security - Match the installed packages against security advisories
+ * @feed: Advisory JSON in the format of the tracker's issues/all.json
+ *
+ * jq flattens the feed into one line per affected package, which is
+ * streamed into a hash table keyed by package name; groups marked
+ * "Not affected" are dropped. The installed snapshot is then streamed
+ * through the table and each match is decided with vercmp(): a package is
+ * vulnerable while its version is older than the group's fixed version,
+ * or always if there is no fix yet.
+ *
+ * Return: 0 on success, 1 if the feed could not be read
+ */
+static int
+audit_security (const string &feed)
+{
+  auto start = chrono::steady_clock::now ();
+  // A leading "#" line shows that jq could parse the feed at all
+  unordered_map<string, vector<advisory> > affected;
+  bool parsed = false;
+  auto add = [&] (const char *line, size_t len) {
+    if (len == 1 && *line == '#')
+      {
+        parsed = true;
+        return;
+      }
+    vector<string> f = split_tabs (string (line, len));
+    if (f.size () == 5)
+      affected[f[0]].push_back ({ f[1], f[2], f[3], f[4] });
+  };
+  string cmd = "jq -r '\"#\", (.[] | select(.status != \"Not affected\")"
+               " | . as $g | .packages[] | [., $g.name, ($g.severity // \"\"),"
+               " ($g.fixed // \"\"), (($g.issues // []) | join(\" \"))]"
+               " | @tsv)' "
+               + shell_quote (feed) + " 2>/dev/null";
+  if (!for_each_output_line (cmd, add) || !parsed)
+    {
+      cerr << "Could not read security advisories from " << feed << '\n';
+      return 1;
+    }
+
+  installed_snapshot installed = load_installed_snapshot ();
+  size_t vulnerable = 0;
+  for (const auto &p : installed)
+    {
+      auto it = affected.find (installed.str (p.name));
+      if (it == affected.end ())
+        continue;
+      string name = installed.str (p.name);
+      string version = installed.str (p.version);
+      bool hit = false;
+      for (const auto &a : it->second)
+        {
+          if (!a.fixed.empty () && vercmp (version, a.fixed) >= 0)
+            continue;
+          hit = true;
+          cout << name << " " << version << " is affected by " << a.group;
+          if (!a.severity.empty ())
+            cout << " (" << a.severity << ")";
+          if (!a.issues.empty ())
+            cout << ": " << a.issues;
+          cout << (a.fixed.empty () ? "; no fix yet" : "; fixed in " + a.fixed)
+               << "\n";
+          json_record ()
+              .field ("package", name)
+              .field ("action", "audit")
+              .field ("version", version)
+              .field ("issue", "vulnerable")
+              .field ("advisory", a.group)
+              .field ("severity", a.severity)
+              .field ("fixed", a.fixed)
+              .field ("detail", a.issues)
+              .outcome (start)
+              .emit ();
+        }
+      vulnerable += hit;
+    }
+
+  cout << vulnerable << " vulnerable package(s) among " << installed.size ()
+       << " installed\n";
+  return 0;
+}
+
+/**
+ * update_vcs - Rebuild the VCS packages whose upstream moved
+ *
+ * Packages whose upstream is unchanged are not rebuilt.
+ *
+ * Return: 0 on success, 1 if the check or a rebuild failed
+ */
+int
+update_vcs ()
+{
+  vector<vcs_moved> moved;
+  if (outdated_vcs (&moved) != 0)
+    return 1;
+  int failed = 0;
+  for (const auto &m : moved)
+    failed += update_pkg (m.package) != 0;
+  return failed ? 1 : 0;
+}
+
+/**
+ * struct aur_health - What audit() needs to know about an AUR package
+ * @maintainer: Maintainer, empty if orphaned
+ * @out_of_date: Unix time it was flagged, 0 if not flagged
+ */
+struct aur_health
+{
+  string maintainer;
+  long out_of_date;
+};
+
+/**
+ * audit - Report problems with the installed foreign packages
+ * @security: Check every installed package against security advisories
+ *            instead, see audit_security()
+ * @advisories: Advisory JSON to use with @security; empty to use the
+ *              security tracker's feed, downloaded at most hourly
+ *
+ * Looks up every installed package that no sync DB provides with batched
+ * RPC "info" requests, falling back to the local AUR metadata when
+ * offline or when a request fails, and reports packages flagged out of
+ * date, orphaned ones and ones the AUR no longer has. For the latter, one
+ * more batch of RPC "search by replaces" requests tells renamed packages
+ * from deleted ones; offline they are all reported as deleted.
+ *
+ * Return: 0 on success, 1 if no AUR metadata or advisories are available
+ */
+int
+audit (bool security, const string &advisories)
+{
+  auto start = chrono::steady_clock::now ();
+  if (security)
+    {
+      string feed = advisories.empty () ? refresh_advisories () : advisories;
+      if (feed.empty ())
+        {
+          cerr << "Security advisories are not available\n";
+          return 1;
+        }
+      return audit_security (feed);
+    }
+
+  installed_snapshot installed = load_installed_snapshot ();
+  vector<string> foreign = foreign_packages (installed, false);
+  if (foreign.empty ())
+    {
+      cout << "No foreign packages installed.\n";
+      return 0;
+    }
+
+  map<string, aur_health> meta; // absent names are not in the AUR
+  bool have_meta = false;
+  if (!offline_mode)
+    {
+      vector<string> urls = aur_info_urls (foreign);
+      auto add = [&meta] (size_t, const string &line) {
+        vector<string> f = split_tabs (line);
+        if (f.size () == 3)
+          meta[f[0]] = { f[1], atol (f[2].c_str ()) };
+      };
+      have_meta = aur_rpc (urls,
+                           "[.Name, (.Maintainer // \"\"), (.OutOfDate // 0)]"
+                           " | @tsv",
+                           add)
+                  == urls.size ();
+      if (!have_meta)
+        {
+          meta.clear ();
+          cerr << "AUR request failed; using the local AUR metadata\n";
+        }
+    }
+  if (!have_meta)
+    {
+      if (!refresh_aur_index (false))
+        {
+          cerr << "AUR metadata is not available\n";
+          return 1;
+        }
+      aur_index aur = load_aur_index ();
+      for (const auto &name : foreign)
+        {
+          const aur_pkg *a = aur.find (name);
+          if (a)
+            meta[name] = { aur.str (a->maintainer), (long)a->out_of_date };
+        }
+    }
+
+  // Packages gone from the AUR may live on under a new name that lists
+  // the old one in its replaces array
+  vector<string> gone;
+  for (const auto &name : foreign)
+    if (!meta.count (name))
+      gone.push_back (name);
+  map<string, string> renamed;
+  if (have_meta && !gone.empty ())
+    {
+      vector<string> urls;
+      for (const auto &name : gone)
+        urls.push_back ("https://aur.archlinux.org/rpc/v5/search/" + name
+                        + "?by=replaces");
+      map<string, string> found;
+      auto add = [&] (size_t response, const string &name) {
+        string &to = found[gone[response]];
+        to += to.empty () ? name : " " + name;
+      };
+      if (aur_rpc (urls, ".Name", add) == urls.size ())
+        renamed.swap (found);
+    }
+
+  size_t issues = 0;
+  auto report = [&issues, start] (const string &name, const char *issue,
+                                   const string &detail, const string &text) {
+    cout << name << ": " << text << "\n";
+    json_record ()
+        .field ("package", name)
+        .field ("action", "audit")
+        .field ("source", "aur")
+        .field ("issue", issue)
+        .field ("detail", detail)
+        .outcome (start)
+        .emit ();
+    issues++;
+  };
+  for (const auto &name : foreign)
+    {
+      auto it = meta.find (name);
+      if (it == meta.end ())
+        {
+          auto r = renamed.find (name);
+          if (r != renamed.end ())
+            report (name, "renamed", r->second, "renamed to " + r->second);
+          else
+            report (name, "deleted", "", "not in the AUR");
+          continue;
+        }
+      if (it->second.out_of_date)
+        {
+          char date[16];
+          time_t t = it->second.out_of_date;
+          strftime (date, sizeof (date), "%Y-%m-%d", gmtime (&t));
+          report (name, "out-of-date", date,
+                  string ("flagged out of date on ") + date);
+        }
+      if (it->second.maintainer.empty ())
+        report (name, "orphaned", "", "orphaned");
+    }
+
+  cout << issues << " issue(s) in " << foreign.size ()
+       << " foreign packages\n";
+  return 0;
+}
+
+// Times lock_packages() looks up a package whose AUR HEAD moved meanwhile,
+// and seconds each of its ls-remote runs may take
+static const unsigned lock_resolve_rounds = 3;
+static const unsigned lock_resolve_timeout = 20;
+
+/**
+ * lock_packages - Pin AUR packages to their current commits
+ * @packages: Packages to pin; empty to pin every installed AUR package
+ * @path: Lockfile to write
+ *
+ * Resolves the HEAD commit of each package's AUR repository with
+ * parallel "git ls-remote" runs, each bounded by timeout(1), then its
+ * version with one batched RPC lookup, and resolves the commits again: a
+ * push between the two would pair the new version with the old commit,
+ * so packages whose HEAD moved are looked up once more, up to
+ * lock_resolve_rounds times, and fail if HEAD keeps moving. Versions
+ * bypass the info cache. The result is written as
+ * "<name>\t<version>\t<commit>" lines. Without @packages, the installed
+ * AUR packages are taken from the AUR metadata, refreshed first. Hosts
+ * that install with --locked build exactly these commits, so their
+ * clone, source and package caches hold identical artifacts.
+ *
+ * Return: 0 on success, 1 if a package could not be resolved or no AUR
+ *         metadata is available
+ */
+int
+lock_packages (vector<string> packages, const string &path)
+{
+  auto start = chrono::steady_clock::now ();
+  if (offline_mode)
+    {
+      cerr << "Resolving AUR commits needs the network\n";
+      return 1;
+    }
+  if (packages.empty ())
+    {
+      if (!refresh_aur_index (false))
+        {
+          cerr << "AUR metadata is not available; name the packages to "
+                  "lock\n";
+          return 1;
+        }
+      installed_snapshot installed = load_installed_snapshot ();
+      aur_index aur = load_aur_index ();
+      repo_names names;
+      bool have_names = names.open ();
+      for (const auto &p : installed)
+        {
+          const char *name = installed.str (p.name);
+          if (aur.count (name) && !(have_names && names.lookup (name)))
+            packages.push_back (name);
+        }
+    }
+  for (const auto &p : packages)
+    if (!is_valid_package_name (p))
+      {
+        cerr << "Invalid package name: " << p << '\n';
+        return 1;
+      }
+
+  // Resolve the HEAD of the packages at @todo into @heads; a stalled
+  // server must not hold up the lockfile forever
+  string timeout = "timeout " + to_string (lock_resolve_timeout) + " ";
+  auto resolve = [&] (const vector<size_t> &todo, vector<string> &heads) {
+    atomic<size_t> next (0);
+    vector<thread> pool;
+    for (unsigned t = 0; t < min<size_t> (8, todo.size ()); ++t)
+      pool.emplace_back ([&] () {
+        for (size_t j; (j = next++) < todo.size ();)
+          {
+            const string &pkg = packages[todo[j]];
+            string url = "https://aur.archlinux.org/" + pkg + ".git";
+            string out = run_capture ("GIT_TERMINAL_PROMPT=0 " + timeout
+                                      + "git ls-remote " + url
+                                      + " HEAD 2>/dev/null");
+            heads[todo[j]] = out.substr (0, out.find_first_of (" \t\n"));
+          }
+      });
+    for (auto &t : pool)
+      t.join ();
+  };
+
+  // Commit first, version second, then check that the commit still is
+  // HEAD, so the version describes the pinned commit
+  vector<string> commits (packages.size ()), again (packages.size ());
+  vector<size_t> todo (packages.size ());
+  for (size_t i = 0; i < todo.size (); ++i)
+    todo[i] = i;
+  resolve (todo, commits);
+  map<string, pkg_info> found;
+  for (unsigned round = 0; !todo.empty (); ++round)
+    {
+      vector<string> names;
+      for (size_t i : todo)
+        {
+          names.push_back (packages[i]);
+          found.erase (packages[i]);
+        }
+      fetch_aur_info (names, found, true);
+      resolve (todo, again);
+      vector<size_t> moved;
+      for (size_t i : todo)
+        if (again[i] != commits[i])
+          {
+            commits[i] = again[i];
+            moved.push_back (i);
+          }
+      if (round + 1 == lock_resolve_rounds)
+        {
+          // Still moving: leave it unresolved rather than mismatched
+          for (size_t i : moved)
+            commits[i].clear ();
+          break;
+        }
+      todo.swap (moved);
+    }
+
+  map<string, locked_pkg> pins;
+  load_lockfile (path, pins);
+  int failed = 0;
+  for (size_t i = 0; i < packages.size (); ++i)
+    {
+      auto it = found.find (packages[i]);
+      if (it == found.end () || !is_commit_id (commits[i]))
+        {
+          cerr << "Cannot resolve AUR package " << packages[i] << '\n';
+          json_record ()
+              .field ("package", packages[i])
+              .field ("action", "lock")
+              .outcome (start, "failed")
+              .emit ();
+          failed++;
+          continue;
+        }
+      pins[packages[i]] = { it->second.version, commits[i] };
+      cout << packages[i] << " " << it->second.version << " "
+           << commits[i].substr (0, 12) << "\n";
+      json_record ()
+          .field ("package", packages[i])
+          .field ("action", "lock")
+          .field ("source", "aur")
+          .field ("version", it->second.version)
+          .field ("commit", commits[i])
+          .outcome (start)
+          .emit ();
+    }
+
+  string tmp = temp_path (path);
+  {
+    ofstream out (tmp, ios::trunc);
+    out << "# auh lockfile: <name> <version> <AUR commit>\n";
+    for (const auto &p : pins)
+      out << p.first << '\t' << p.second.version << '\t' << p.second.commit
+          << '\n';
+    if (!out.flush ())
+      {
+        cerr << "Cannot write " << path << '\n';
+        unlink (tmp.c_str ());
+        return 1;
+      }
+  }
+  if (rename (tmp.c_str (), path.c_str ()) != 0)
+    {
+      cerr << "Cannot write " << path << '\n';
+      return 1;
+    }
+  return failed ? 1 : 0;
+}
+
+/**
+ * apply_manifest - Converge the installed packages on a manifest
+ * @path: Manifest file: one package per line, "!name" for packages that
+ *        must be absent, "#" starts a comment
+ * @prune: Also remove explicitly installed packages the manifest omits
+ *
+ * The manifest is diffed against the installed snapshot in memory and
+ * only the delta is executed: one pacman transaction for repo packages,
+ * parallel AUR builds, one transaction marking listed dependencies as
+ * explicitly installed, and one removal transaction. A host that already
+ * matches the manifest is left alone without any network request.
+ *
+ * Return: 0 on success, 1 on failure
+ */
+int
+apply_manifest (const string &path, bool prune)
+{
+  ifstream in (path);
+  if (!in)
+    {
+      cerr << "Cannot read manifest " << path << '\n';
+      return 1;
+    }
+
+  vector<string> wanted, unwanted;
+  string line;
+  int lineno = 0;
+  while (getline (in, line))
+    {
+      lineno++;
+      line = line.substr (0, line.find ('#'));
+      istringstream words (line);
+      string word;
+      while (words >> word)
+        {
+          bool absent = word[0] == '!';
+          string name = absent ? word.substr (1) : word;
+          if (!is_valid_package_name (name))
+            {
+              cerr << path << ":" << lineno << ": invalid package name: "
+                   << name << '\n';
+              return 1;
+            }
+          (absent ? unwanted : wanted).push_back (name);
+        }
+    }
+
+  installed_snapshot installed = load_installed_snapshot ();
+  set<string> listed (wanted.begin (), wanted.end ());
+  vector<string> repo, aur, mark, remove;
+  repo_names names;
+  bool have_names = false, names_opened = false;
+  for (const auto &name : listed)
+    {
+      const installed_pkg *p = installed.find (name);
+      if (p)
+        {
+          if (!p->explicit_install)
+            mark.push_back (name);
+          continue;
+        }
+      if (!names_opened)
+        {
+          have_names = names.open ();
+          names_opened = true;
+        }
+      bool in_repo = have_names ? names.lookup (name) != NULL
+                                : is_in_main_repos (name);
+      (in_repo ? repo : aur).push_back (name);
+    }
+  for (const auto &name : unwanted)
+    if (installed.count (name) && !listed.count (name))
+      remove.push_back (name);
+  if (prune)
+    for (const auto &p : installed)
+      {
+        string name = installed.str (p.name);
+        if (p.explicit_install && !listed.count (name)
+            && find (remove.begin (), remove.end (), name) == remove.end ())
+          remove.push_back (name);
+      }
+
+  if (repo.empty () && aur.empty () && mark.empty () && remove.empty ())
+    {
+      cout << "Nothing to do; " << listed.size ()
+           << " package(s) already match " << path << ".\n";
+      return 0;
+    }
+
+  auto join = [] (const vector<string> &v) {
+    string out;
+    for (const auto &s : v)
+      out += " " + s;
+    return out;
+  };
+  int failed = 0;
+
+  if (!repo.empty ())
+    {
+      cout << "Installing " << repo.size () << " repo package(s):"
+           << join (repo) << "\n";
+      json_batch events ("install", repo, "repo");
+      if (offline_mode && !repo_targets_cached (join (repo)))
+        {
+          cerr << "Some repo packages are not in the pacman package cache; "
+               << "cannot install them offline\n";
+          events.settle (false, "not in the package cache");
+          failed++;
+        }
+      else if (run_pacman ("-S --needed --noconfirm" + join (repo)) != 0)
+        {
+          cerr << "Repo transaction failed\n";
+          events.settle (false, "pacman failed");
+          failed++;
+        }
+      else
+        events.settle (true);
+    }
+
+  if (!aur.empty ())
+    {
+      cout << "Building " << aur.size () << " AUR package(s):" << join (aur)
+           << "\n";
+      if (install_packages_parallel (aur, offline_mode || is_aur_up ()) != 0)
+        failed++;
+    }
+
+  if (!mark.empty ())
+    {
+      cout << "Marking as explicitly installed:" << join (mark) << "\n";
+      json_batch events ("mark-explicit", mark);
+      bool ok = run_pacman ("-D --asexplicit" + join (mark)) == 0;
+      events.settle (ok);
+      if (!ok)
+        failed++;
+    }
+
+  if (!remove.empty ())
+    {
+      cout << "Removing " << remove.size () << " package(s):" << join (remove)
+           << "\n";
+      json_batch events ("remove", remove);
+      bool ok = run_pacman ("-R --noconfirm" + join (remove)) == 0;
+      events.settle (ok, ok ? string () : "pacman failed");
+      if (!ok)
+        {
+          cerr << "Removal transaction failed\n";
+          failed++;
+        }
+    }
+  return failed ? 1 : 0;
+}
+
+// Packages fetched or built at the same time by the batch API
+static unsigned batch_jobs = 4;
+
+/**
+ * configure - Apply library options to all later calls
+ * @opts: Options
+ * @error: Receives a message on failure
+ *
+ * Sets offline_mode, locked_mode, locked_packages, batch_jobs and json_fd
+ * without any locking; the worker threads of fetch() and build() read
+ * them unguarded. Not thread-safe (see include/auh.h).
+ *
+ * Return: true on success, false if the lockfile could not be read or
+ *         the output descriptors could not be set up
+ */
+bool
+configure (const options &opts, string &error)
+{
+  if (opts.json && !enable_json_output ())
+    {
+      error = "Cannot set up JSON output";
+      return false;
+    }
+  offline_mode = opts.offline;
+  batch_jobs = max (opts.jobs, 1u);
+  locked_packages.clear ();
+  locked_mode = !opts.lockfile.empty ();
+  if (locked_mode && !load_lockfile (opts.lockfile, locked_packages))
+    {
+      error = "Cannot read lockfile " + opts.lockfile;
+      locked_packages.clear ();
+      locked_mode = false;
+      return false;
+    }
+  return true;
+}
+
+/**
+ * run_parallel - Run a job for every index on a bounded thread pool
+ * @count: Number of jobs
+ * @work: Called once for each index below @count
+ */
+static void
+run_parallel (size_t count, const function<void (size_t)> &work)
+{
+  atomic<size_t> next (0);
+  vector<thread> pool;
+  for (unsigned t = 0; t < min<size_t> (batch_jobs, count); ++t)
+    pool.emplace_back ([&] () {
+      for (size_t i; (i = next++) < count;)
+        work (i);
+    });
+  for (auto &t : pool)
+    t.join ();
+}
+
+/**
+ * struct batch_progress - Serialized progress reports of one batch stage
+ * @report: Caller's callback, may be empty
+ * @step: Stage being reported
+ * @total: Packages in the stage
+ * @done: Packages finished so far
+ */
+struct batch_progress
+{
+  const progress_callback &report;
+  stage step;
+  size_t total;
+  size_t done = 0;
+  mutex lock;
+
+  batch_progress (const progress_callback &r, stage s, size_t n)
+      : report (r), step (s), total (n)
+  {
+  }
+
+  // Report @message about @package; @finished counts it as done
+  void
+  note (const string &package, const string &message, bool finished)
+  {
+    lock_guard<mutex> guard (lock);
+    if (finished)
+      done++;
+    if (report)
+      report ({ step, package, message, done, total });
+  }
+};
+
+/**
+ * classify - Find where each package name comes from
+ * @names: Package names
+ *
+ * Loads the installed snapshot, the sync catalog and the AUR index once
+ * for the whole batch, refreshing the AUR metadata if it is stale.
+ *
+ * Return: One classification per name, in the order of @names
+ */
+vector<classification>
+classify (const vector<string> &names)
+{
+  refresh_aur_index (false);
+  installed_snapshot installed = load_installed_snapshot ();
+  sync_catalog catalog = load_sync_catalog ();
+  aur_index aur = load_aur_index ();
+
+  vector<classification> out;
+  out.reserve (names.size ());
+  for (const auto &n : names)
+    {
+      const installed_pkg *i = NULL;
+      const repo_pkg *r = NULL;
+      const aur_pkg *a = NULL;
+      if (!is_valid_package_name (n))
+        out.push_back ({ n, origin::missing, string () });
+      else if ((i = installed.find (n)))
+        out.push_back ({ n, origin::installed, installed.str (i->version) });
+      else if ((r = catalog.find (n)))
+        out.push_back ({ n, origin::repo, catalog.str (r->version) });
+      else if ((a = aur.find (n)))
+        out.push_back ({ n, origin::aur, aur.str (a->version) });
+      else
+        out.push_back ({ n, origin::missing, string () });
+    }
+  return out;
+}
+
+/**
+ * resolve - Look up details of repo and AUR packages
+ * @names: Package names
+ *
+ * Return: Details of every name found, in the order of @names
+ */
+vector<pkg_info>
+resolve (const vector<string> &names)
+{
+  vector<string> valid;
+  for (const auto &n : names)
+    if (is_valid_package_name (n))
+      valid.push_back (n);
+
+  map<string, pkg_info> found;
+  fetch_repo_info (valid, found);
+  vector<string> aur_names;
+  for (const auto &n : valid)
+    if (!found.count (n))
+      aur_names.push_back (n);
+  if (!aur_names.empty ())
+    fetch_aur_info (aur_names, found);
+
+  vector<pkg_info> out;
+  for (const auto &n : valid)
+    {
+      auto it = found.find (n);
+      if (it != found.end ())
+        out.push_back (it->second);
+    }
+  return out;
+}
+
+/**
+ * plan - Split package names by what installing them takes
+ * @names: Package names
+ *
+ * Names the AUR metadata lacks are looked up with one batched RPC request
+ * before they are declared missing, since the metadata may predate a new
+ * package; offline, a package counts as an AUR package if its clone or a
+ * package built from it is cached.
+ *
+ * Return: The plan; invalid names are listed as missing
+ */
+install_plan
+plan (const vector<string> &names)
+{
+  vector<classification> found = classify (names);
+  vector<string> unknown;
+  for (const auto &c : found)
+    if (c.where == origin::missing && is_valid_package_name (c.name))
+      unknown.push_back (c.name);
+  if (!unknown.empty ())
+    {
+      map<string, pkg_info> aur;
+      if (!offline_mode)
+        fetch_aur_info (unknown, aur);
+      for (auto &c : found)
+        if (c.where == origin::missing
+            && (offline_mode
+                    ? access ((cache_dir () + "/clones/" + c.name).c_str (),
+                              F_OK) == 0
+                          || !find_cached_package (c.name).empty ()
+                    : aur.count (c.name) != 0))
+          c.where = origin::aur;
+    }
+
+  install_plan p;
+  for (const auto &c : found)
+    switch (c.where)
+      {
+      case origin::installed:
+        p.installed.push_back (c.name);
+        break;
+      case origin::repo:
+        p.repo.push_back (c.name);
+        break;
+      case origin::aur:
+        p.aur.push_back (c.name);
+        break;
+      case origin::missing:
+        p.missing.push_back (c.name);
+        break;
+      }
+  return p;
+}
+
+/**
+ * fetch - Bring the cached clones of AUR packages up to date
+ * @packages: AUR package names
+ * @report: Progress callback, may be empty
+ *
+ * Return: One result per package, in the order of @packages
+ */
+vector<result>
+fetch (const vector<string> &packages, const progress_callback &report)
+{
+  vector<result> results (packages.size ());
+  batch_progress progress (report, stage::fetch, packages.size ());
+  run_parallel (packages.size (), [&] (size_t i) {
+    const string &pkg = packages[i];
+    result &r = results[i];
+    r = { pkg, false, string () };
+    string ref, version;
+    if (!is_valid_package_name (pkg))
+      r.detail = "Invalid package name: " + pkg;
+    else if (!pinned_ref (pkg, ref, version))
+      r.detail = pkg + " is not pinned in the lockfile";
+    else
+      {
+        unique_ptr<host_lock> lock
+            = acquire_host_lock ("pkg-" + pkg, "fetching " + pkg);
+        progress.note (pkg, "fetching", false);
+        if (!lock->timed_out)
+          r.detail = fetch_cached_clone (
+              pkg, "https://aur.archlinux.org/" + pkg + ".git", ref, false);
+        r.ok = !r.detail.empty ();
+        if (r.ok)
+          lock->outcome = "ok";
+        else
+          r.detail = "Cannot fetch " + pkg;
+      }
+    progress.note (pkg, r.ok ? "fetched" : r.detail, true);
+  });
+  return results;
+}
+
+/**
+ * struct build_space - Admission of a batch's builds by disk space
+ * @root: Directory the builds run in
+ * @footprints: History loaded by load_footprints()
+ * @running: Builds admitted and not yet released
+ *
+ * As in install_packages_parallel(), a build that does not fit in the
+ * space_available() waits while other builds of the batch run and may
+ * release space, and with none left running it still starts unless build
+ * history says it really is this large.
+ */
+struct build_space
+{
+  string root;
+  map<string, unsigned long long> footprints;
+  size_t running = 0;
+  mutex lock;
+  condition_variable released;
+
+  // Wait until @package fits and claim its footprint for @dir; false if
+  // it cannot fit
+  bool
+  admit (const string &package, const string &dir,
+         unique_ptr<space_reservation> &claim)
+  {
+    bool known;
+    unsigned long long need = estimate_footprint (package, footprints, known);
+    unique_lock<mutex> guard (lock);
+    while (need > space_available (root) && running > 0)
+      released.wait (guard);
+    if (need > space_available (root) && known)
+      return false;
+    claim = reserve_space (package, dir, need);
+    running++;
+    return true;
+  }
+
+  // Give up the claim of an admitted build and wake the waiting ones
+  void
+  release (unique_ptr<space_reservation> &claim)
+  {
+    {
+      lock_guard<mutex> guard (lock);
+      claim.reset ();
+      running--;
+    }
+    released.notify_all ();
+  }
+};
+
+/**
+ * build - Build fetched AUR packages without installing them
+ * @packages: AUR package names whose clones fetch() prepared
+ * @report: Progress callback, may be empty
+ *
+ * Each clone is materialized into <cache_dir>/builds and built there with
+ * makepkg -s, once build_space admits it, holding a reserve_space() claim
+ * for its expected footprint so that concurrent installs see the space as
+ * taken. A package makepkg reports as already built (exit status 13)
+ * counts as built, so an interrupted batch resumes where it stopped.
+ *
+ * Return: One result per package, in the order of @packages
+ */
+vector<result>
+build (const vector<string> &packages, const progress_callback &report)
+{
+  string root = cache_dir () + "/builds";
+  make_dirs (root);
+  vector<result> results (packages.size ());
+  batch_progress progress (report, stage::build, packages.size ());
+  build_space space;
+  space.root = root;
+  space.footprints = load_footprints ();
+  run_parallel (packages.size (), [&] (size_t i) {
+    const string &pkg = packages[i];
+    result &r = results[i];
+    r = { pkg, false, string () };
+    string clone = cache_dir () + "/clones/" + pkg;
+    string dir = root + "/" + pkg;
+    materialize_stats stats;
+    if (!is_valid_package_name (pkg))
+      r.detail = "Invalid package name: " + pkg;
+    else if (access ((clone + "/.git").c_str (), F_OK) != 0)
+      r.detail = pkg + " has not been fetched";
+    else
+      {
+        unique_ptr<host_lock> lock
+            = acquire_host_lock ("pkg-" + pkg, "building " + pkg);
+        unique_ptr<space_reservation> claim;
+        if (lock->timed_out)
+          r.detail = "Timed out waiting for another build of " + pkg;
+        else if (!space.admit (pkg, dir, claim))
+          r.detail = "Not enough disk space to build " + pkg;
+        else
+          {
+            remove_tree_async (dir);
+            if (!materialize_tree (clone, dir, stats))
+              r.detail = "Cannot set up build directory " + dir;
+            else
+              {
+                progress.note (pkg, "building", false);
+                string mcmd = "cd " + dir + " && "
+                              + makepkg_command ("-s --noconfirm");
+                int rc = system (mcmd.c_str ());
+                if (rc != 0 && !(WIFEXITED (rc) && WEXITSTATUS (rc) == 13))
+                  r.detail = "makepkg failed for " + pkg;
+                else
+                  {
+                    // Packages that makepkg would write, as full paths
+                    string list = "cd " + dir + " && "
+                                  + makepkg_command ("--packagelist");
+                    auto add = [&r] (const char *f, size_t n) {
+                      string file (f, n);
+                      if (access (file.c_str (), F_OK) == 0)
+                        r.detail += (r.detail.empty () ? "" : " ") + file;
+                    };
+                    for_each_output_line (list, add);
+                    r.ok = !r.detail.empty ();
+                    if (!r.ok)
+                      r.detail = "makepkg built no package for " + pkg;
+                  }
+                record_footprint (pkg, dir);
+                if (r.ok)
+                  record_vcs_commits (pkg, dir);
+              }
+            remove_tree_async (dir);
+            space.release (claim);
+          }
+        if (r.ok)
+          lock->outcome = "ok";
+      }
+    progress.note (pkg, r.ok ? "built" : r.detail, true);
+  });
+  return results;
+}
+
+/**
+ * package_file_of - Pick the file of one package from a build's output
+ * @package: Package name
+ * @files: Space-separated package files, as in build() results
+ *
+ * Split packages build several files and makepkg may add a -debug
+ * package; only the requested one is installed.
+ *
+ * Return: Path of the file named <package>-<pkgver>-<pkgrel>-<arch>,
+ *         or empty string if there is none
+ */
+static string
+package_file_of (const string &package, const string &files)
+{
+  istringstream in (files);
+  string file;
+  while (in >> file)
+    {
+      string base = file.substr (file.find_last_of ('/') + 1);
+      size_t end = base.size ();
+      for (int field = 0; field < 3 && end != string::npos; ++field)
+        end = end ? base.rfind ('-', end - 1) : string::npos;
+      if (end != string::npos && base.compare (0, end, package) == 0
+          && end == package.size ())
+        return file;
+    }
+  return {};
+}
+
+/**
+ * install - Install packages from the sync databases and the AUR
+ * @names: Package names
+ * @report: Progress callback, may be empty
+ *
+ * The result of a missing name suggests close matches (see
+ * suggest_names()). With --json every name is reported as an "install"
+ * record.
+ *
+ * Return: One result per name, in the order of @names
+ */
+vector<result>
+install (const vector<string> &names, const progress_callback &report)
+{
+  json_batch events ("install", names);
+  map<string, result> done;
+  auto finish = [&] (const string &pkg, bool ok, const string &detail) {
+    done[pkg] = { pkg, ok, detail };
+  };
+  auto join = [] (const vector<string> &v) {
+    string out;
+    for (const auto &s : v)
+      out += " " + s;
+    return out;
+  };
+
+  if (report)
+    report ({ stage::classify, string (), "planning", 0, names.size () });
+  install_plan p = plan (names);
+  for (const auto &n : p.installed)
+    finish (n, true, "already installed");
+  for (const auto &n : p.missing)
+    {
+      string detail = "not found in the sync databases or the AUR";
+      vector<string> close = suggest_names (n, 5);
+      for (size_t i = 0; i < close.size (); ++i)
+        detail += (i ? ", " : "; did you mean ") + close[i];
+      finish (n, false, detail + (close.empty () ? "" : "?"));
+    }
+  if (report)
+    report ({ stage::classify, string (), "planned", names.size (),
+              names.size () });
+
+  // Every repo package in one transaction
+  if (!p.repo.empty ())
+    {
+      batch_progress progress (report, stage::install, p.repo.size ());
+      progress.note (string (), "installing repo packages", false);
+      bool ok = offline_mode && !repo_targets_cached (join (p.repo))
+                    ? false
+                    : run_pacman ("-S --needed --noconfirm" + join (p.repo))
+                          == 0;
+      for (const auto &n : p.repo)
+        {
+          finish (n, ok, ok ? string () : "pacman transaction failed");
+          progress.note (n, ok ? "installed" : "failed", true);
+        }
+    }
+
+  // Offline, packages built earlier are installed without a rebuild
+  map<string, string> files;
+  vector<string> to_fetch;
+  for (const auto &n : p.aur)
+    {
+      string ref, version;
+      string cached = offline_mode && pinned_ref (n, ref, version)
+                          ? find_cached_package (n, version)
+                          : string ();
+      if (cached.empty ())
+        to_fetch.push_back (n);
+      else
+        files[n] = cached;
+    }
+
+  vector<string> to_build;
+  for (const auto &r : fetch (to_fetch, report))
+    if (r.ok)
+      to_build.push_back (r.package);
+    else
+      finish (r.package, false, r.detail);
+  for (const auto &r : build (to_build, report))
+    {
+      string file = r.ok ? package_file_of (r.package, r.detail) : string ();
+      if (!file.empty ())
+        files[r.package] = file;
+      else
+        finish (r.package, false,
+                r.ok ? "makepkg built no file named " + r.package : r.detail);
+    }
+
+  // Everything built in one more transaction
+  if (!files.empty ())
+    {
+      batch_progress progress (report, stage::install, files.size ());
+      vector<string> paths;
+      for (const auto &f : files)
+        paths.push_back (f.second);
+      progress.note (string (), "installing AUR packages", false);
+      bool ok = run_pacman ("-U --noconfirm" + join (paths)) == 0;
+      for (const auto &f : files)
+        {
+          finish (f.first, ok, ok ? f.second : "pacman transaction failed");
+          progress.note (f.first, ok ? "installed" : "failed", true);
+        }
+    }
+
+  auto listed = [] (const vector<string> &v, const string &n) {
+    return find (v.begin (), v.end (), n) != v.end ();
+  };
+  vector<result> out;
+  for (size_t i = 0; i < names.size (); ++i)
+    {
+      const string &n = names[i];
+      auto it = done.find (n);
+      out.push_back (it != done.end () ? it->second
+                                       : result{ n, false, "not installed" });
+      json_event &ev = *events.events[i];
+      ev.detail = out.back ().detail;
+      if (!out.back ().ok)
+        ev.status = "failed";
+      else if (listed (p.installed, n))
+        ev.status = "skipped";
+      else
+        ev.status = "ok";
+      if (listed (p.repo, n))
+        ev.source = "repo";
+      else if (listed (p.aur, n))
+        ev.source = "aur";
+    }
+  return out;
+}
+
+/**
+ * struct daemon_state - Caches kept resident by auhd
+ * @installed: Installed snapshot, reloaded after local DB changes
+ * @installed_valid: False once inotify reported a local DB change
+ * @catalog: Sync catalog, reloaded after sync DB changes
+ * @catalog_valid: False once inotify reported a sync DB change
+ * @aur: AUR index
+ * @aur_refreshing: True while a background download is running
+ * @aur_ready: Set by the download thread when a new index can be loaded
+ * @aur_checked: When the AUR index was last checked for staleness
+ * @aur_mtime: aur_index_mtime() of the metadata @aur was loaded from
+ */
+struct daemon_state
+{
+  installed_snapshot installed;
+  bool installed_valid = false;
+  sync_catalog catalog;
+  bool catalog_valid = false;
+  aur_index aur;
+  bool aur_refreshing = false;
+  atomic<bool> aur_ready{ false };
+  time_t aur_checked = 0;
+  time_t aur_mtime = 0;
+};
+
+// The daemon checks whether the AUR dump needs a refresh this often
+static const long daemon_aur_check_interval = 60 * 60;
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+/**
+ * daemon_signal - Ask the daemon loop to exit
+ * @sig: Signal number (unused)
+ */
+static void
+daemon_signal (int sig)
+{
+  (void)sig;
+  daemon_stop = 1;
+}
+
+/**
+ * daemon_handle - Answer one client request
+ * @st: Daemon caches
+ * @request: Request line
+ *
+ * Requests:
+ * - "classify <pkg>...": one "<pkg> installed|repo|aur|missing" line each
+ * - "sync": explicitly installed packages present in the AUR index
+ * - "outdated": "<name>\t<version>\t<available>" lines, see list_outdated()
+ * - "search <limit> <term>...": search_hit_to_tsv() lines, see
+ *   search_packages()
+ * - "ping": empty reply
+ *
+ * Return: Reply text, starting with "ok" or "error" on its own line
+ */
+static string
+daemon_handle (daemon_state &st, const string &request)
+{
+  // Local DB caches are cheap to rebuild, so reload them lazily here
+  if (!st.installed_valid)
+    {
+      st.installed = load_installed_snapshot ();
+      st.installed_valid = true;
+    }
+  if (!st.catalog_valid)
+    {
+      st.catalog = load_sync_catalog ();
+      st.catalog_valid = true;
+    }
+
+  istringstream in (request);
+  string verb;
+  in >> verb;
+  string out = "ok\n";
+  if (verb == "ping")
+    return out;
+  if (verb == "classify")
+    {
+      string name;
+      while (in >> name)
+        {
+          if (!is_valid_package_name (name))
+            return "error invalid package name\n";
+          out += name + " "
+                 + classify_name (st.installed, st.catalog, st.aur, name)
+                 + "\n";
+        }
+      return out;
+    }
+  if (verb == "sync")
+    {
+      for (const auto &p : st.installed)
+        if (p.explicit_install && st.aur.count (st.installed.str (p.name)))
+          out += string (st.installed.str (p.name)) + "\n";
+      return out;
+    }
+  if (verb == "search")
+    {
+      size_t limit = 0;
+      vector<string> terms;
+      string term;
+      in >> limit;
+      while (in >> term)
+        terms.push_back (term);
+      for (const auto &h : search_packages (terms, limit ? limit : 20))
+        out += search_hit_to_tsv (h) + "\n";
+      return out;
+    }
+  if (verb == "outdated")
+    {
+      for (const auto &o : list_outdated (st.installed, st.catalog, st.aur))
+        out += o.name + "\t" + o.version + "\t" + o.available + "\n";
+      return out;
+    }
+  return "error unknown request\n";
+}
+
+/**
+ * daemon_serve_client - Read one request from a client and answer it
+ * @st: Daemon caches
+ * @fd: Accepted client socket; closed before returning
+ */
+static void
+daemon_serve_client (daemon_state &st, int fd)
+{
+  struct timeval tv = { 2, 0 };
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+
+  string request;
+  char buf[4096];
+  ssize_t n;
+  while (request.find ('\n') == string::npos
+         && (n = recv (fd, buf, sizeof (buf), 0)) > 0 && request.size () < 65536)
+    request.append (buf, n);
+  size_t nl = request.find ('\n');
+  if (nl != string::npos)
+    {
+      string reply = daemon_handle (st, request.substr (0, nl));
+      for (size_t off = 0; off < reply.size ();)
+        {
+          ssize_t w = send (fd, reply.data () + off, reply.size () - off,
+                            MSG_NOSIGNAL);
+          if (w <= 0)
+            break;
+          off += w;
+        }
+    }
+  close (fd);
+}
+
+/**
+ * run_daemon - Serve queries from resident caches (auhd)
+ *
+ * Loads the installed snapshot, the sync catalog and the AUR index once
+ * and answers CLI queries over a Unix socket (see daemon_socket_path()).
+ * inotify watches on the pacman local and sync databases invalidate the
+ * corresponding cache, which is reloaded on the next query. The AUR dump
+ * is re-checked hourly and downloaded on a background thread so queries
+ * are never blocked by the network. Runs until SIGINT or SIGTERM.
+ *
+ * Return: 0 on clean shutdown, 1 if the socket could not be set up
+ */
+int
+run_daemon ()
+{
+  signal (SIGPIPE, SIG_IGN);
+  signal (SIGINT, daemon_signal);
+  signal (SIGTERM, daemon_signal);
+
+  string path = daemon_socket_path (true);
+  if (path.empty ())
+    {
+      cerr << "No private directory for the daemon socket; set "
+              "XDG_RUNTIME_DIR\n";
+      return 1;
+    }
+  vector<string> probe;
+  if (daemon_request ("ping", probe))
+    {
+      cerr << "auhd is already running on " << path << '\n';
+      return 1;
+    }
+
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size () >= sizeof (addr.sun_path))
+    {
+      cerr << "Socket path too long: " << path << '\n';
+      return 1;
+    }
+  strcpy (addr.sun_path, path.c_str ());
+
+  int lfd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink (path.c_str ());
+  mode_t old_umask = umask (077);
+  bool bound = lfd >= 0
+               && bind (lfd, (struct sockaddr *)&addr, sizeof (addr)) == 0
+               && listen (lfd, 64) == 0;
+  umask (old_umask);
+  if (!bound)
+    {
+      cerr << "Failed to listen on " << path << '\n';
+      if (lfd >= 0)
+        close (lfd);
+      return 1;
+    }
+
+  int ifd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  const uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                        | IN_CLOSE_WRITE;
+  int local_wd = -1, sync_wd = -1;
+  if (ifd >= 0)
+    {
+      local_wd = inotify_add_watch (
+          ifd, (pacman_db_path () + "/local").c_str (), mask);
+      sync_wd = inotify_add_watch (ifd, (pacman_db_path () + "/sync").c_str (),
+                                   mask);
+    }
+  if (local_wd < 0 || sync_wd < 0)
+    cerr << "inotify unavailable; caches will not follow pacman changes\n";
+
+  daemon_state st;
+  refresh_aur_index (false);
+  st.aur = load_aur_index ();
+  st.aur_mtime = aur_index_mtime ();
+  st.aur_checked = time (NULL);
+  st.installed = load_installed_snapshot ();
+  st.installed_valid = true;
+  st.catalog = load_sync_catalog ();
+  st.catalog_valid = true;
+  cout << "auhd: " << st.installed.size () << " installed, "
+       << st.catalog.size () << " repo and " << st.aur.size ()
+       << " AUR packages in "
+       << format_bytes (st.installed.bytes () + st.catalog.bytes ()
+                        + st.aur.bytes ())
+       << "; listening on " << path << endl;
+
+  thread downloader;
+  while (!daemon_stop)
+    {
+      // Start an hourly AUR freshness check off the request path
+      if (!st.aur_refreshing
+          && time (NULL) - st.aur_checked >= daemon_aur_check_interval)
+        {
+          st.aur_refreshing = true;
+          st.aur_checked = time (NULL);
+          downloader = thread ([&st] () {
+            refresh_aur_index (false);
+            st.aur_ready = true;
+          });
+        }
+      if (st.aur_ready)
+        {
+          downloader.join ();
+          // An unchanged dump (HTTP 304) leaves the metadata untouched
+          if (aur_index_mtime () != st.aur_mtime)
+            {
+              st.aur = load_aur_index ();
+              st.aur_mtime = aur_index_mtime ();
+            }
+          st.aur_ready = false;
+          st.aur_refreshing = false;
+        }
+
+      struct pollfd fds[2] = { { lfd, POLLIN, 0 }, { ifd, POLLIN, 0 } };
+      int rc = poll (fds, ifd >= 0 ? 2 : 1, 1000);
+      if (rc < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          break;
+        }
+
+      if (ifd >= 0 && (fds[1].revents & POLLIN))
+        {
+          // Drain all pending events; any change invalidates the cache
+          alignas (struct inotify_event) char buf[8192];
+          ssize_t len;
+          while ((len = read (ifd, buf, sizeof (buf))) > 0)
+            for (char *p = buf; p < buf + len;)
+              {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                if (ev->wd == local_wd)
+                  st.installed_valid = false;
+                else if (ev->wd == sync_wd)
+                  st.catalog_valid = false;
+                p += sizeof (struct inotify_event) + ev->len;
+              }
+        }
+
+      if (fds[0].revents & POLLIN)
+        {
+          int cfd = accept4 (lfd, NULL, NULL, SOCK_CLOEXEC);
+          if (cfd >= 0)
+            daemon_serve_client (st, cfd);
+        }
+    }
+
+  if (downloader.joinable ())
+    downloader.join ();
+  close (lfd);
+  if (ifd >= 0)
+    close (ifd);
+  unlink (path.c_str ());
+  return 0;
+}
+
+/**
+ * complete - Print completion candidates for the shell completion scripts
+ * @argc: Argument count of main()
+ * @argv: Arguments of main(); argv[1] is "__complete"
+ *
+ * "auh __complete PREFIX" lists commands starting with PREFIX;
+ * "auh __complete COMMAND PREFIX" lists its package arguments. Installed
+ * package names come from the local database directory, all others from
+ * names.list, which is mapped and binary-searched in place. Nothing else
+ * is read and no network or pacman call is made; if names.list does not
+ * exist yet it is built once with the search index.
+ *
+ * Return: 0
+ */
+int
+complete (int argc, char **argv)
+{
+  static const char *const commands[]
+      = { "install", "remove", "update",   "clean", "autoremove",
+          "sync",    "outdated", "audit",  "apply",  "lock",
+          "search",  "info",     "query",  "daemon", "index" };
+
+  if (argc < 3 || argc > 4)
+    return 0;
+  const char *prefix = argv[argc - 1];
+  size_t plen = strlen (prefix);
+
+  if (argc == 3)
+    {
+      for (const char *c : commands)
+        if (strncmp (c, prefix, plen) == 0)
+          cout << c << '\n';
+      return 0;
+    }
+
+  string cmd = argv[2];
+  if (cmd == "remove" || cmd == "update")
+    {
+      // Local database entries are named <pkgname>-<pkgver>-<pkgrel>
+      string local = pacman_db_path () + "/local";
+      DIR *dir = opendir (local.c_str ());
+      if (!dir)
+        return 0;
+      struct dirent *ent;
+      while ((ent = readdir (dir)) != NULL)
+        {
+          const char *name = ent->d_name;
+          const char *rel = strrchr (name, '-');
+          if (name[0] == '.' || !rel || strncmp (name, prefix, plen) != 0)
+            continue;
+          const char *ver = rel;
+          while (ver > name && *--ver != '-')
+            ;
+          if (ver > name && (size_t)(ver - name) >= plen)
+            cout.write (name, ver - name) << '\n';
+        }
+      closedir (dir);
+      return 0;
+    }
+  if (cmd != "install" && cmd != "info" && cmd != "search")
+    return 0;
+
+  mapped_file m;
+  if (!map_file (completion_names_path (), m))
+    {
+      build_search_index ();
+      if (!map_file (completion_names_path (), m))
+        return 0;
+    }
+
+  // Find the first line not less than the prefix
+  const char *data = m.data;
+  size_t lo = 0, hi = m.size;
+  while (lo < hi)
+    {
+      size_t p = lo + (hi - lo) / 2;
+      while (p > lo && data[p - 1] != '\n')
+        --p;
+      const char *nl = (const char *)memchr (data + p, '\n', m.size - p);
+      size_t end = nl ? nl - data : m.size;
+      size_t len = end - p;
+      int c = memcmp (data + p, prefix, min (len, plen));
+      if (c < 0 || (c == 0 && len < plen))
+        lo = end + 1;
+      else
+        hi = p;
+    }
+
+  while (lo < m.size && m.size - lo >= plen
+         && memcmp (data + lo, prefix, plen) == 0)
+    {
+      const char *nl = (const char *)memchr (data + lo, '\n', m.size - lo);
+      size_t end = nl ? nl - data : m.size;
+      cout.write (data + lo, end - lo) << '\n';
+      lo = end + 1;
+    }
+  return 0;
+}
+
+} // namespace auh
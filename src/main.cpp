@@ -20,711 +20,17 @@
  * Contact: harshabhattacharyya510@duck.com
  */
 
-#include <algorithm>  // For remove, find
-#include <array>      // For fixed-size arrays
-#include <cstdio>     // For FILE, popen, pclose
-#include <cstdlib>    // For system, exit
-#include <getopt.h>   // For getopt_long
-#include <iostream>   // For cout, cerr
-#include <memory>     // For unique_ptr
-#include <sstream>    // For istringstream
-#include <string>     // For string operations
-#include <sys/wait.h> // For wait, WIFEXITED, WEXITSTATUS
-#include <unistd.h>   // For fork, pid_t
-#include <vector>     // For dynamic arrays
+#include <cerrno>   // For errno
+#include <cstdlib>  // For getenv, strtol
+#include <cstring>  // For strcmp, memmove
+#include <getopt.h> // For getopt_long
+#include <iostream> // For cout, cerr
+#include <string>   // For string operations
+#include <vector>   // For dynamic arrays
 
-using namespace std;
-
-/**
- * is_valid_package_name - Validate package name format
- * @name: Package name to validate
- *
- * Checks if a package name contains only allowed characters to prevent
- * command injection and ensure compatibility with pacman/AUR standards.
- * Package names should only contain: alphanumeric characters, dash (-),
- * underscore (_), dot (.), and plus (+).
- *
- * Return: true if the package name is valid, false otherwise
- */
-static bool
-is_valid_package_name (const string &name)
-{
-  // Package names should only contain alphanumeric, dash, underscore, dot, and
-  // plus
-  if (name.empty ())
-    return false;
-  for (char c : name)
-    {
-      if (!isalnum (c) && c != '-' && c != '_' && c != '.' && c != '+')
-        return false;
-    }
-  return true;
-}
-
-/**
- * run_capture - Execute command and capture output
- * @cmd: Shell command to execute
- *
- * Executes a shell command using popen and captures its standard output.
- * Uses a 4KB buffer for reading output. The pipe is automatically closed
- * via unique_ptr with custom deleter.
- *
- * Return: Captured output as string, or empty string on failure
- */
-static string
-run_capture (const string &cmd)
-{
-  array<char, 4096> buf;
-  string out;
-  // Use unique_ptr with pclose as deleter to ensure pipe is closed
-  unique_ptr<FILE, decltype (&pclose)> pipe (popen (cmd.c_str (), "r"),
-                                             pclose);
-  if (!pipe)
-    return {};
-  // Read output in chunks
-  while (fgets (buf.data (), buf.size (), pipe.get ()))
-    out += buf.data ();
-  return out;
-}
-
-/**
- * is_installed - Check if a package is installed
- * @package: Package name to check
- *
- * Uses pacman to query if a package is installed on the system.
- * Redirects output to /dev/null to suppress messages.
- *
- * Return: true if package is installed, false otherwise
- */
-static bool
-is_installed (const string &package)
-{
-  string cmd = "pacman -Q " + package + " > /dev/null 2>&1";
-  return system (cmd.c_str ()) == 0;
-}
-
-/**
- * is_in_main_repos - Check if a package is available in main repositories
- * @package: Package name to check
- *
- * Uses pacman to query if a package is available in the official Arch Linux
- * repositories (core, extra, community, multilib, etc.).
- *
- * Return: true if package is in main repos, false otherwise
- */
-static bool
-is_in_main_repos (const string &package)
-{
-  // Validate package name to prevent command injection
-  if (!is_valid_package_name (package))
-    return false;
-  
-  // Use pacman -Si for exact package lookup
-  string cmd = "pacman -Si " + package + " > /dev/null 2>&1";
-  return system (cmd.c_str ()) == 0;
-}
-
-/**
- * install_pkg - Install a package from AUR or main repos
- * @package: Package name to install
- * @url: Git URL of the package repository (for AUR)
- *
- * Installs a package by:
- * 1. Validating package name format
- * 2. Checking if already installed (skip if yes)
- * 3. Checking if package exists in main repos
- * 4. If in main repos, install via pacman -S
- * 5. If not in main repos, install from AUR:
- *    - Query AUR API to verify package exists
- *    - Clone the git repository
- *    - Build with makepkg
- *    - Install the built package
- *
- * Return: 0 on success, 1 on failure
- */
-int
-install_pkg (const string &package, const string &url)
-{
-  // Validate package name to prevent command injection
-  if (!is_valid_package_name (package))
-    {
-      cerr << "Invalid package name: " << package << '\n';
-      return 1;
-    }
-
-  // Skip if already installed
-  if (is_installed (package))
-    {
-      cout << package << " is already installed; skipping.\n";
-      return 0;
-    }
-
-  // Check if package is in main repos first
-  if (is_in_main_repos (package))
-    {
-      cout << "Found " << package << " in main repos, installing via pacman...\n";
-      string cmd = "sudo pacman -S --noconfirm " + package;
-      int rc = system (cmd.c_str ());
-      if (rc == 0)
-        {
-          cout << "Successfully installed " << package << " from main repos\n";
-          return 0;
-        }
-      else
-        {
-          cerr << "Failed to install " << package << " from main repos\n";
-          return 1;
-        }
-    }
-
-  // Package not in main repos, try AUR
-  cout << "Package not found in main repos, checking AUR...\n";
-
-  // Query AUR API to check if package exists
-  string pcmd = "curl -s \"https://aur.archlinux.org/rpc/?v=5&type=info&arg="
-                + package + "\" | jq -c .results";
-  string out = run_capture (pcmd);
-  // Trim trailing whitespace
-  while (!out.empty () && isspace ((unsigned char)out.back ()))
-    out.pop_back ();
-
-  // Empty results array means package not found
-  if (out == "[]")
-    {
-      cerr << "Package not found in main repos or AUR: " << package << '\n';
-      return 1;
-    }
-
-  // Clone the package repository
-  cout << "Cloning " << package << " from AUR...\n";
-  string ccmd = "git clone " + url + " &> /dev/null";
-  if (system (ccmd.c_str ()) != 0)
-    {
-      cerr << "git clone failed for " << package << '\n';
-      return 1;
-    }
-
-  // Build and install the package
-  cout << "Building " << package << "...\n";
-  string mcmd = "cd " + package + " && makepkg -si --noconfirm";
-  if (system (mcmd.c_str ()) != 0)
-    {
-      cerr << "makepkg failed for " << package << '\n';
-      return 1;
-    }
-
-  return 0;
-}
-
-/**
- * remove_pkg - Remove an installed package
- * @package: Package name to remove
- * @autoremove: If true, also remove dependencies not required by other packages
- * @purge: If true, also remove configuration files
- *
- * Removes a package using pacman:
- * -R: Remove package
- * -s: Remove dependencies not required by other packages (if autoremove is true)
- * -n: Remove configuration files (if purge is true)
- *
- * Flag combinations:
- * - autoremove=false, purge=false: -R (remove package only)
- * - autoremove=true, purge=false: -Rs (remove package + unneeded deps)
- * - autoremove=false, purge=true: -Rn (remove package + configs)
- * - autoremove=true, purge=true: -Rns (remove package + unneeded deps + configs)
- *
- * Return: 0 on success, 1 on failure
- */
-int
-remove_pkg (const string &package, bool autoremove = false, bool purge = false)
-{
-  // Validate package name to prevent command injection
-  if (!is_valid_package_name (package))
-    {
-      cerr << "Invalid package name: " << package << '\n';
-      return 1;
-    }
-
-  // Check if package is installed before attempting removal
-  if (!is_installed (package))
-    {
-      cout << package << " is not installed; skipping removal.\n";
-      return 0;
-    }
-  
-  // Build pacman flags based on options
-  string flags = "-R";
-  if (autoremove)
-    flags += "s";
-  if (purge)
-    flags += "n";
-  
-  string cmd = "sudo pacman " + flags + " --noconfirm " + package;
-  cout << "Removing " << package << "...\n";
-  int rc = system (cmd.c_str ());
-  if (rc != 0)
-    {
-      cerr << "Removal failed for " << package << " (code " << rc << ")\n";
-      return 1;
-    }
-  return 0;
-}
-
-/**
- * update_pkg - Update a package or perform system upgrade
- * @package: Package name to update, or empty string for full system upgrade
- *
- * If package is empty: performs full system upgrade using pacman -Syu
- * If package is specified: attempts to update via pacman first, then falls
- * back to rebuilding from AUR if needed.
- *
- * For AUR packages, the function:
- * 1. Creates a temporary directory in /tmp
- * 2. Clones the latest version from AUR
- * 3. Rebuilds and installs the package
- * 4. Cleans up the temporary directory
- *
- * Return: 0 on success, 1 on failure
- */
-int
-update_pkg (const string &package)
-{
-  if (package.empty ())
-    {
-      // Full system upgrade
-      cout << "Performing full system upgrade...\n";
-      int rc = system ("sudo pacman -Syu --noconfirm");
-      if (rc != 0)
-        {
-          cerr << "System update failed (code " << rc << ")\n";
-          return 1;
-        }
-      return 0;
-    }
-  else
-    {
-      // Update single package via pacman if available in repos;
-      // for AUR packages, rebuild using makepkg
-      if (is_installed (package))
-        {
-          cout << "Updating repo package " << package << "...\n";
-          int rc = system (("sudo pacman -S --noconfirm " + package).c_str ());
-          if (rc == 0)
-            return 0;
-          // Fall back to AUR rebuild if pacman update fails
-        }
-      
-      // Rebuild from AUR
-      cout << "Rebuilding AUR package " << package << "...\n";
-      string url = "https://aur.archlinux.org/" + package + ".git";
-      string tmpdir = "/tmp/auh_" + package;
-      
-      // Clean old directory, clone fresh copy, build and install
-      int rc = system (("rm -rf " + tmpdir + " && git clone " + url + " "
-                        + tmpdir + " &> /dev/null")
-                           .c_str ());
-      if (rc != 0)
-        {
-          cerr << "Failed to clone AUR for " << package << '\n';
-          return 1;
-        }
-      
-      rc = system (("cd " + tmpdir + " && makepkg -si --noconfirm").c_str ());
-      if (rc != 0)
-        {
-          cerr << "Rebuild/install failed for " << package << '\n';
-          return 1;
-        }
-      
-      // Clean up temporary directory
-      system (("rm -rf " + tmpdir).c_str ());
-      return 0;
-    }
-}
-
-/**
- * autoremove - Remove orphaned packages
- *
- * Removes packages that were installed as dependencies but are no longer
- * required by any installed package. This is the pacman equivalent of
- * apt's autoremove command.
- *
- * Uses 'pacman -Qdtq' to list orphaned packages and validates each before removal.
- *
- * Return: 0 on success, 1 on failure or if no orphans found
- */
-int
-autoremove ()
-{
-  // First, check if there are any orphaned packages
-  string check_cmd = "pacman -Qdtq";
-  string orphans = run_capture (check_cmd);
-  
-  // Trim trailing whitespace
-  while (!orphans.empty () && isspace ((unsigned char)orphans.back ()))
-    orphans.pop_back ();
-  
-  if (orphans.empty ())
-    {
-      cout << "No orphaned packages found.\n";
-      return 0;
-    }
-  
-  // Parse orphaned packages line by line and validate each
-  vector<string> orphan_pkgs;
-  istringstream stream (orphans);
-  string pkg;
-  
-  while (getline (stream, pkg))
-    {
-      // Trim trailing whitespace from package name
-      while (!pkg.empty () && isspace ((unsigned char)pkg.back ()))
-        pkg.pop_back ();
-      
-      if (pkg.empty ())
-        continue;
-      
-      // Validate package name to prevent command injection
-      if (!is_valid_package_name (pkg))
-        {
-          cerr << "Skipping invalid package name: " << pkg << '\n';
-          continue;
-        }
-      
-      orphan_pkgs.push_back (pkg);
-    }
-  
-  if (orphan_pkgs.empty ())
-    {
-      cout << "No valid orphaned packages to remove.\n";
-      return 0;
-    }
-  
-  // Build safe command with validated package names
-  string cmd = "sudo pacman -Rs --noconfirm";
-  for (const auto &p : orphan_pkgs)
-    cmd += " " + p;
-  
-  // Remove orphaned packages
-  cout << "Removing orphaned packages...\n";
-  int rc = system (cmd.c_str ());
-  if (rc == 0)
-    {
-      cout << "Successfully removed orphaned packages\n";
-      return 0;
-    }
-  else
-    {
-      cerr << "Failed to remove orphaned packages\n";
-      return 1;
-    }
-}
-
-/**
- * clean_cache - Clean the pacman package cache
- *
- * Runs 'pacman -Scc' to clean both the package cache and unused sync databases.
- * This frees up disk space by removing downloaded package files.
- *
- * Return: 0 on success, 1 on failure
- */
-int
-clean_cache ()
-{
-  string cmd = "sudo pacman -Scc --noconfirm";
-  int rc = system (cmd.c_str ());
-  if (rc == 0)
-    {
-      cout << "Successfully cleaned\n";
-      return 0;
-    }
-  else
-    {
-      cout << "System cleaning failed\n";
-      return 1;
-    }
-}
-
-/**
- * build_from_github - Build and install package from GitHub mirror
- * @package: Package name to install
- * @mirror_url_base: Base URL of the GitHub mirror (default: archlinux/aur)
- *
- * Installs a package from GitHub mirror instead of AUR. Useful when:
- * - AUR is experiencing downtime or DDOS
- * - Mirror is preferred for reliability
- * - Testing mirror functionality
- *
- * The function:
- * 1. Creates a temporary working directory
- * 2. Clones the package from GitHub mirror (shallow clone, single branch)
- * 3. Builds the package using makepkg with --skippgpcheck
- * 4. Installs the built package
- * 5. Cleans up the temporary directory
- *
- * Return: 0 on success, 1 on clone failure, 4 on build failure
- */
-int
-build_from_github (const std::string &package,
-                   const std::string &mirror_url_base
-                   = "https://github.com/archlinux/aur")
-{
-  // Create temporary working directory
-  const std::string tmpdir = "./auh_mirror_" + package;
-  
-  // Ensure clean temporary directory
-  std::string rm = "rm -rf " + tmpdir;
-  system (rm.c_str ());
-
-  // Clone mirror with shallow clone for speed (single branch, depth=1, no tags)
-  std::string clone_cmd = "git clone --single-branch --branch " + package
-                          + " --depth=1 " + mirror_url_base + ".git " + tmpdir
-                          + " 2>/dev/null";
-  if (system (clone_cmd.c_str ()) != 0)
-    {
-      std::cerr << "Failed to clone mirror for " << package << '\n';
-      return 1;
-    }
-
-  // Build and install package (skip PGP checks for mirror packages)
-  std::string mkcmd
-      = "cd " + tmpdir + " && makepkg -si --noconfirm --skippgpcheck";
-  int mkrc = system (mkcmd.c_str ());
-
-  // Clean up temporary directory
-  system (("rm -rf " + tmpdir).c_str ());
-
-  if (mkrc != 0)
-    {
-      std::cerr << "makepkg failed for " << package << " (code " << mkrc
-                << ")\n";
-      return 4;
-    }
-
-  std::cout << "Built and installed " << package << " from mirror branch.\n";
-  return 0;
-}
-
-/**
- * is_aur_up - Check if AUR is accessible
- *
- * Tests AUR availability by sending an HTTP request and checking the status code.
- * Uses curl to get the HTTP response code from the AUR website.
- *
- * Return: true if AUR is up (HTTP 200-399), false otherwise
- */
-bool
-is_aur_up ()
-{
-  const std::string url = "https://aur.archlinux.org";
-
-  // Get HTTP status code using curl
-  std::string curl_cmd = "curl -s -o /dev/null -w \"%{http_code}\" " + url;
-  std::string http_code_str = run_capture (curl_cmd);
-
-  int http_code = 0;
-  try
-    {
-      http_code = std::stoi (http_code_str);
-    }
-  catch (...)
-    {
-      std::cerr << "Failed to get AUR HTTP status code\n";
-      return 1;
-    }
-
-  // HTTP codes 200-399 indicate success/redirection (AUR is up)
-  std::string status_text;
-  if (http_code >= 200 && http_code < 400)
-    {
-      return true;
-    }
-  else
-    {
-      return false;
-    }
-}
-
-/**
- * install_packages_parallel - Install multiple packages in parallel
- * @packages: Vector of package names to install
- * @use_aur: If true, install from AUR; if false, use GitHub mirror
- *
- * Installs multiple packages in parallel using fork() to improve performance.
- * The function limits concurrent installations to prevent system overload.
- *
- * Process flow:
- * 1. Validates each package name before processing
- * 2. Forks child processes (up to max_concurrent limit)
- * 3. Each child installs one package
- * 4. Parent waits for children to complete
- * 5. Tracks failures and reports summary
- *
- * The parallel installation can significantly reduce total installation time
- * when installing multiple packages, especially for packages with no
- * interdependencies.
- *
- * Return: 0 if all packages installed successfully, 1 if any failed
- */
-int
-install_packages_parallel (const vector<string> &packages, bool use_aur)
-{
-  // Limit concurrent installations to prevent overwhelming the system
-  const size_t max_concurrent = 4;
-  vector<pid_t> children;
-  size_t pkg_idx = 0;
-  int failed_count = 0;
-
-  // Process packages: start new installations and wait for completions
-  while (pkg_idx < packages.size () || !children.empty ())
-    {
-      // Start new processes up to the concurrency limit
-      while (pkg_idx < packages.size () && children.size () < max_concurrent)
-        {
-          const string &pkg = packages[pkg_idx];
-
-          // Validate package name before processing to prevent injection attacks
-          if (!is_valid_package_name (pkg))
-            {
-              cerr << "Invalid package name: " << pkg << '\n';
-              failed_count++;
-              pkg_idx++;
-              continue;
-            }
-
-          pid_t pid = fork ();
-
-          if (pid == 0)
-            {
-              // Child process: install the package and exit with result code
-              string url = "https://aur.archlinux.org/" + pkg + ".git";
-              int result;
-              if (use_aur)
-                result = install_pkg (pkg, url);
-              else
-                result = build_from_github (pkg);
-              exit (result);
-            }
-          else if (pid > 0)
-            {
-              // Parent process: store child PID for tracking
-              children.push_back (pid);
-              pkg_idx++;
-            }
-          else
-            {
-              // Fork failed
-              cerr << "Failed to fork for package: " << pkg << '\n';
-              failed_count++;
-              pkg_idx++;
-            }
-        }
-
-      // Wait for at least one child to complete before starting more
-      if (!children.empty ())
-        {
-          int status;
-          pid_t finished = wait (&status);
-          if (finished > 0)
-            {
-              // Remove finished process from children vector
-              children.erase (
-                  remove (children.begin (), children.end (), finished),
-                  children.end ());
-
-              // Check exit status and track failures
-              if (WIFEXITED (status) && WEXITSTATUS (status) != 0)
-                {
-                  failed_count++;
-                }
-            }
-        }
-    }
-
-  // Report summary if there were failures
-  if (failed_count > 0)
-    {
-      cerr << failed_count << " package(s) failed to install.\n";
-      return 1;
-    }
-
-  return 0;
-}
-
-/**
- * sync_explicit - List explicitly installed AUR packages
- *
- * Queries pacman for all explicitly installed packages (-Qe), then checks
- * each one against the AUR API to determine which are from AUR.
- *
- * This is useful for:
- * - Auditing which packages came from AUR
- * - Managing your AUR package list
- * - Identifying packages for backup/migration
- *
- * The function validates package names and uses the AUR RPC API to check
- * package existence.
- *
- * Return: 0 on success
- */
-int
-sync_explicit ()
-{
-  // Get list of explicitly installed packages
-  string cmd = "pacman -Qeq";
-  string explicit_pkgs = run_capture (cmd);
-
-  if (explicit_pkgs.empty ())
-    {
-      cout << "No explicitly installed packages found.\n";
-      return 0;
-    }
-
-  cout << "Checking explicitly installed packages against AUR...\n";
-
-  // Parse package list using stringstream for cleaner line-by-line parsing
-  istringstream stream (explicit_pkgs);
-  string pkg;
-  int synced_count = 0;
-
-  while (getline (stream, pkg))
-    {
-      // Trim trailing whitespace from package name
-      while (!pkg.empty () && isspace ((unsigned char)pkg.back ()))
-        pkg.pop_back ();
-
-      if (pkg.empty ())
-        continue;
-
-      // Validate package name format
-      if (!is_valid_package_name (pkg))
-        {
-          cerr << "Skipping invalid package name: " << pkg << '\n';
-          continue;
-        }
-
-      // Query AUR API to check if package exists
-      string pcmd = "curl -s "
-                    "\"https://aur.archlinux.org/rpc/?v=5&type=info&arg="
-                    + pkg + "\" | jq -r '.results | length'";
-      string result = run_capture (pcmd);
-
-      // Trim whitespace from result
-      while (!result.empty () && isspace ((unsigned char)result.back ()))
-        result.pop_back ();
-
-      // If result is "1", package exists in AUR
-      if (result == "1")
-        {
-          cout << "Found AUR package: " << pkg << "\n";
-          synced_count++;
-        }
-    }
+#include "auh.h" // Engine, built as libauh
 
-  cout << "Total AUR packages found in explicitly installed: " << synced_count
-       << "\n";
-  return 0;
-}
+using namespace std;
 
 /**
  * print_usage - Display program usage information
@@ -741,12 +47,44 @@ print_usage ()
   cout << "  update      Update packages or perform full system upgrade\n";
   cout << "  clean       Clean package cache\n";
   cout << "  autoremove  Remove orphaned packages\n";
-  cout << "  sync        List explicitly installed AUR packages\n\n";
+  cout << "  sync        List explicitly installed AUR packages\n";
+  cout << "  outdated    List installed AUR packages with newer versions\n";
+  cout << "  audit       Report flagged, orphaned, deleted or renamed AUR packages\n";
+  cout << "  apply       Install and remove packages to match a manifest\n";
+  cout << "  lock        Pin AUR packages to their current commits\n";
+  cout << "  search      Search repo and AUR packages offline\n";
+  cout << "  info        Show details for repo and AUR packages\n";
+  cout << "  query       Filter AUR packages by votes, age, flags, maintainer\n";
+  cout << "  daemon      Run auhd, which keeps package caches resident\n";
+  cout << "  index       Rebuild or query the installed package index\n\n";
+  cout << "Global options:\n";
+  cout << "  --offline       Use local caches only; never touch the network\n";
+  cout << "  --json          Print results as JSON Lines; other output to stderr\n\n";
   cout << "Install options:\n";
-  cout << "  -g, --github    Install from GitHub mirror instead of AUR\n\n";
+  cout << "  -g, --github    Install from GitHub mirror instead of AUR\n";
+  cout << "  --locked[=FILE] Build the AUR commits pinned in FILE (auh.lock)\n\n";
+  cout << "Lock options:\n";
+  cout << "  -f, --file FILE Lockfile to update (default auh.lock)\n\n";
+  cout << "Update and outdated options:\n";
+  cout << "  --vcs           Only VCS packages whose upstream moved since their build\n\n";
   cout << "Remove options:\n";
   cout << "  -s, --autoremove    Also remove dependencies not required by other packages\n";
   cout << "  -p, --purge         Also remove configuration files\n\n";
+  cout << "Apply options:\n";
+  cout << "  -p, --prune     Also remove explicit packages missing from the manifest\n\n";
+  cout << "Search options:\n";
+  cout << "  -n, --limit N   Show at most N results (default 20)\n\n";
+  cout << "Audit options:\n";
+  cout << "  -s, --security        Check installed packages against security advisories\n";
+  cout << "  -a, --advisories FILE Use advisory JSON from FILE (implies --security)\n\n";
+  cout << "Query options:\n";
+  cout << "  --votes-below N, --votes-above N, --popularity-below X\n";
+  cout << "  --updated-before DAYS, --updated-within DAYS\n";
+  cout << "  --maintainer NAME, --flagged, --orphaned, --installed, --count\n\n";
+  cout << "Index options:\n";
+  cout << "  --apply-delta [pkgs]  Patch the index for changed packages (stdin if none)\n";
+  cout << "  --owns FILE           Show the package owning FILE\n";
+  cout << "  --required-by PKG     List installed packages depending on PKG\n\n";
   cout << "Examples:\n";
   cout << "  auh install yay pikaur       # Install packages from AUR or main repos\n";
   cout << "  auh install -g yay           # Install from GitHub mirror\n";
@@ -757,6 +95,45 @@ print_usage ()
   cout << "  auh autoremove               # Remove orphaned packages\n";
   cout << "  auh update                   # Full system upgrade\n";
   cout << "  auh update yay               # Update specific package\n";
+  cout << "  auh update --vcs             # Rebuild -git packages with upstream changes\n";
+}
+
+/**
+ * parse_number - Parse a non-negative number given to an option
+ * @arg: Option argument
+ * @value: Where the number is stored
+ *
+ * Return: true if all of @arg is a non-negative number in range,
+ *         false otherwise
+ */
+static bool
+parse_number (const char *arg, long &value)
+{
+  char *end;
+  errno = 0;
+  value = strtol (arg, &end, 10);
+  return end != arg && *end == '\0' && errno == 0 && value >= 0;
+}
+
+static bool
+parse_number (const char *arg, double &value)
+{
+  char *end;
+  errno = 0;
+  value = strtod (arg, &end);
+  return end != arg && *end == '\0' && errno == 0 && value >= 0;
+}
+
+/**
+ * print_progress - Show a progress report of the batch install
+ * @p: Report
+ */
+static void
+print_progress (const auh::progress &p)
+{
+  static const char *const steps[] = { "plan", "fetch", "build", "install" };
+  cout << "[" << steps[(int)p.step] << " " << p.done << "/" << p.total << "] "
+       << (p.package.empty () ? "" : p.package + ": ") << p.message << '\n';
 }
 
 /**
@@ -768,17 +145,61 @@ print_usage ()
  * handler functions.
  *
  * Supported commands:
- * - install: Install packages from AUR (supports -g/--github flag)
+ * - install: Install packages through auh::install, or from the GitHub
+ *   mirrors (-g/--github, or when the AUR is down)
  * - remove: Remove packages (supports -s/--autoremove flag)
- * - update: Update packages or perform full system upgrade
+ * - update: Update packages or perform full system upgrade (--vcs:
+ *   rebuild VCS packages whose upstream moved)
  * - clean: Clean package cache
  * - sync: List explicitly installed AUR packages
+ * - outdated: List installed AUR packages with newer versions (--vcs:
+ *   VCS packages whose upstream moved)
+ * - audit: Report problems with the installed foreign packages, or
+ *   security advisories affecting installed packages (-s/--security)
+ * - search: Search repo and AUR packages from the local index
+ * - query: Filter AUR packages by metadata predicates
+ * - info: Show details for several packages at once
+ * - daemon: Run auhd (also selected by invoking the binary as auhd)
+ * - index: Rebuild, patch (--apply-delta) or query the package index
  *
  * Return: 0 on success, 1 on error or invalid command
  */
 int
 main (int argc, char **argv)
 {
+  // Shell completion runs on every keypress: answer before anything else
+  if (argc >= 2 && strcmp (argv[1], "__complete") == 0)
+    return auh::complete (argc, argv);
+
+  // --offline and --json may appear anywhere; strip them before commands
+  // parse their options
+  auh::options opts;
+  string error;
+  const char *env_offline = getenv ("AUH_OFFLINE");
+  opts.offline = env_offline && *env_offline && strcmp (env_offline, "0") != 0;
+  for (int i = 1; i < argc;)
+    if (strcmp (argv[i], "--offline") == 0 || strcmp (argv[i], "--json") == 0)
+      {
+        if (strcmp (argv[i], "--json") == 0)
+          opts.json = true;
+        else
+          opts.offline = true;
+        memmove (argv + i, argv + i + 1, (argc - i) * sizeof (char *));
+        argc--;
+      }
+    else
+      i++;
+  if (!auh::configure (opts, error))
+    {
+      cerr << error << '\n';
+      return 1;
+    }
+
+  // Invoked as auhd (a symlink to auh): serve cached queries
+  string self = argv[0];
+  if (self.substr (self.find_last_of ('/') + 1) == "auhd")
+    return auh::run_daemon ();
+
   // Require at least one command argument
   if (argc < 2)
     {
@@ -797,6 +218,7 @@ main (int argc, char **argv)
       // Define long options for install command
       static struct option long_options[] = {
         {"github", no_argument, 0, 'g'},
+        {"locked", optional_argument, 0, 'l'},
         {0, 0, 0, 0}
       };
       
@@ -804,15 +226,18 @@ main (int argc, char **argv)
       optind = 2;
       
       // Parse options
-      while ((opt = getopt_long (argc, argv, "g", long_options, NULL)) != -1)
+      while ((opt = getopt_long (argc, argv, "gl::", long_options, NULL)) != -1)
         {
           switch (opt)
             {
             case 'g':
               use_github = true;
               break;
+            case 'l':
+              opts.lockfile = optarg ? optarg : "auh.lock";
+              break;
             default:
-              cout << "Usage: auh install [-g|--github] <packages...>\n";
+              cout << "Usage: auh install [-g|--github] [--locked[=FILE]] <packages...>\n";
               return 1;
             }
         }
@@ -820,7 +245,18 @@ main (int argc, char **argv)
       // Check if packages are provided
       if (optind >= argc)
         {
-          cout << "Usage: auh install [-g|--github] <packages...>\n";
+          cout << "Usage: auh install [-g|--github] [--locked[=FILE]] <packages...>\n";
+          return 1;
+        }
+
+      if (!opts.lockfile.empty () && !auh::configure (opts, error))
+        {
+          cerr << error << '\n';
+          return 1;
+        }
+      if (!opts.lockfile.empty () && use_github)
+        {
+          cerr << "--locked pins AUR commits and cannot be used with --github\n";
           return 1;
         }
       
@@ -833,14 +269,27 @@ main (int argc, char **argv)
       
       // Determine whether to use AUR or GitHub
       bool use_aur = !use_github;
-      if (use_aur)
+      if (use_aur && !opts.offline)
         {
           // Check AUR availability for automatic fallback
-          use_aur = is_aur_up ();
+          use_aur = auh::is_aur_up ();
         }
-      
-      // Install packages in parallel
-      return install_packages_parallel (packages, use_aur);
+
+      // GitHub mirrors are outside the batch API; build them in parallel
+      if (!use_aur)
+        return auh::install_packages_parallel (packages, false);
+
+      // Plan, fetch, build and install the whole batch through libauh
+      int failed = 0;
+      for (const auto &r : auh::install (packages, print_progress))
+        if (!r.ok)
+          {
+            cerr << r.package << ": " << r.detail << '\n';
+            failed++;
+          }
+      cout << packages.size () - failed << " of " << packages.size ()
+           << " package(s) installed\n";
+      return failed ? 1 : 0;
     }
   else if (cmd == "remove")
     {
@@ -885,36 +334,396 @@ main (int argc, char **argv)
       
       // Remove each package sequentially
       for (int i = optind; i < argc; ++i)
-        remove_pkg (argv[i], autoremove, purge);
+        auh::remove_pkg (argv[i], autoremove, purge);
     }
   else if (cmd == "update")
     {
+      // Parse update options
+      bool vcs = false;
+      int opt;
+
+      // Define long options for update command
+      static struct option long_options[] = {
+        {"vcs", no_argument, 0, 'V'},
+        {0, 0, 0, 0}
+      };
+
+      // Reset getopt state for proper parsing
+      optind = 2;
+
+      while ((opt = getopt_long (argc, argv, "", long_options, NULL)) != -1)
+        {
+          switch (opt)
+            {
+            case 'V':
+              vcs = true;
+              break;
+            default:
+              cout << "Usage: auh update [--vcs | packages...]\n";
+              return 1;
+            }
+        }
+      if (vcs)
+        {
+          if (optind != argc)
+            {
+              cout << "Usage: auh update [--vcs | packages...]\n";
+              return 1;
+            }
+          // Rebuild VCS packages whose upstream moved
+          return auh::update_vcs ();
+        }
+
       if (argc == 2)
         {
           // No package specified: full system update
-          update_pkg ("");
+          return auh::update_pkg ("");
         }
       else
         {
           // Update specified packages
-          for (int i = 2; i < argc; ++i)
-            update_pkg (argv[i]);
+          for (int i = optind; i < argc; ++i)
+            auh::update_pkg (argv[i]);
         }
     }
   else if (cmd == "clean")
     {
       // Clean package cache
-      clean_cache ();
+      auh::clean_cache ();
     }
   else if (cmd == "autoremove")
     {
       // Remove orphaned packages
-      autoremove ();
+      auh::autoremove ();
     }
   else if (cmd == "sync")
     {
       // List explicitly installed AUR packages
-      sync_explicit ();
+      auh::sync_explicit ();
+    }
+  else if (cmd == "outdated")
+    {
+      // Parse outdated options
+      bool vcs = false;
+      int opt;
+
+      // Define long options for outdated command
+      static struct option long_options[] = {
+        {"vcs", no_argument, 0, 'V'},
+        {0, 0, 0, 0}
+      };
+
+      // Reset getopt state for proper parsing
+      optind = 2;
+
+      while ((opt = getopt_long (argc, argv, "", long_options, NULL)) != -1)
+        {
+          switch (opt)
+            {
+            case 'V':
+              vcs = true;
+              break;
+            default:
+              cout << "Usage: auh outdated [--vcs]\n";
+              return 1;
+            }
+        }
+
+      // List AUR packages with newer versions available, or VCS packages
+      // whose upstream moved
+      return auh::outdated (vcs);
+    }
+  else if (cmd == "audit")
+    {
+      // Parse audit options
+      bool security = false;
+      string advisories;
+      int opt;
+
+      // Define long options for audit command
+      static struct option long_options[] = {
+        {"security", no_argument, 0, 's'},
+        {"advisories", required_argument, 0, 'a'},
+        {0, 0, 0, 0}
+      };
+
+      // Reset getopt state for proper parsing
+      optind = 2;
+
+      while ((opt = getopt_long (argc, argv, "sa:", long_options, NULL)) != -1)
+        {
+          switch (opt)
+            {
+            case 's':
+              security = true;
+              break;
+            case 'a':
+              security = true;
+              advisories = optarg;
+              break;
+            default:
+              cout << "Usage: auh audit [-s|--security] [-a|--advisories FILE]\n";
+              return 1;
+            }
+        }
+      if (optind != argc)
+        {
+          cout << "Usage: auh audit [-s|--security] [-a|--advisories FILE]\n";
+          return 1;
+        }
+
+      // Report flagged, orphaned, deleted and renamed AUR packages, or
+      // installed packages with security advisories
+      return auh::audit (security, advisories);
+    }
+  else if (cmd == "lock")
+    {
+      // Parse lock options
+      string lockfile = "auh.lock";
+      int opt;
+
+      // Define long options for lock command
+      static struct option long_options[] = {
+        {"file", required_argument, 0, 'f'},
+        {0, 0, 0, 0}
+      };
+
+      // Reset getopt state for proper parsing
+      optind = 2;
+
+      while ((opt = getopt_long (argc, argv, "f:", long_options, NULL)) != -1)
+        {
+          switch (opt)
+            {
+            case 'f':
+              lockfile = optarg;
+              break;
+            default:
+              cout << "Usage: auh lock [-f|--file FILE] [packages...]\n";
+              return 1;
+            }
+        }
+      return auh::lock_packages (vector<string> (argv + optind, argv + argc),
+                                 lockfile);
+    }
+  else if (cmd == "apply")
+    {
+      // Parse apply options
+      bool prune = false;
+      int opt;
+
+      // Define long options for apply command
+      static struct option long_options[] = {
+        {"prune", no_argument, 0, 'p'},
+        {0, 0, 0, 0}
+      };
+
+      // Reset getopt state for proper parsing
+      optind = 2;
+
+      while ((opt = getopt_long (argc, argv, "p", long_options, NULL)) != -1)
+        {
+          switch (opt)
+            {
+            case 'p':
+              prune = true;
+              break;
+            default:
+              cout << "Usage: auh apply [-p|--prune] <manifest>\n";
+              return 1;
+            }
+        }
+      if (optind != argc - 1)
+        {
+          cout << "Usage: auh apply [-p|--prune] <manifest>\n";
+          return 1;
+        }
+      return auh::apply_manifest (argv[optind], prune);
+    }
+  else if (cmd == "search")
+    {
+      // Parse search options
+      long limit = 20;
+      int opt;
+
+      // Define long options for search command
+      static struct option long_options[] = {
+        {"limit", required_argument, 0, 'n'},
+        {0, 0, 0, 0}
+      };
+
+      // Reset getopt state for proper parsing
+      optind = 2;
+
+      while ((opt = getopt_long (argc, argv, "n:", long_options, NULL)) != -1)
+        {
+          switch (opt)
+            {
+            case 'n':
+              if (!parse_number (optarg, limit) || limit == 0)
+                {
+                  cerr << "Invalid number: " << optarg << '\n';
+                  return 1;
+                }
+              break;
+            default:
+              cout << "Usage: auh search [-n|--limit N] <terms...>\n";
+              return 1;
+            }
+        }
+
+      if (optind >= argc)
+        {
+          cout << "Usage: auh search [-n|--limit N] <terms...>\n";
+          return 1;
+        }
+      return auh::search (vector<string> (argv + optind, argv + argc),
+                          limit);
+    }
+  else if (cmd == "info")
+    {
+      // Check if packages are provided
+      if (argc < 3)
+        {
+          cout << "Usage: auh info <packages...>\n";
+          return 1;
+        }
+      return auh::info (vector<string> (argv + 2, argv + argc));
+    }
+  else if (cmd == "query")
+    {
+      // Parse query predicates
+      auh::aur_query q;
+      bool count_only = false;
+      int opt;
+
+      // Define long options for query command
+      static struct option long_options[] = {
+        {"votes-below", required_argument, 0, 'v'},
+        {"votes-above", required_argument, 0, 'V'},
+        {"popularity-below", required_argument, 0, 'p'},
+        {"updated-before", required_argument, 0, 'b'},
+        {"updated-within", required_argument, 0, 'w'},
+        {"maintainer", required_argument, 0, 'm'},
+        {"flagged", no_argument, 0, 'f'},
+        {"orphaned", no_argument, 0, 'o'},
+        {"installed", no_argument, 0, 'i'},
+        {"count", no_argument, 0, 'c'},
+        {0, 0, 0, 0}
+      };
+
+      // Reset getopt state for proper parsing
+      optind = 2;
+
+      while ((opt = getopt_long (argc, argv, "", long_options, NULL)) != -1)
+        {
+          bool valid = true;
+          switch (opt)
+            {
+            case 'v':
+              valid = parse_number (optarg, q.votes_below);
+              break;
+            case 'V':
+              valid = parse_number (optarg, q.votes_above);
+              break;
+            case 'p':
+              valid = parse_number (optarg, q.popularity_below);
+              break;
+            case 'b':
+              valid = parse_number (optarg, q.updated_before_days);
+              break;
+            case 'w':
+              valid = parse_number (optarg, q.updated_within_days);
+              break;
+            case 'm':
+              q.maintainer = optarg;
+              break;
+            case 'f':
+              q.flagged = true;
+              break;
+            case 'o':
+              q.orphaned = true;
+              break;
+            case 'i':
+              q.installed = true;
+              break;
+            case 'c':
+              count_only = true;
+              break;
+            default:
+              cout << "Usage: auh query [predicates...] (see auh(1))\n";
+              return 1;
+            }
+          if (!valid)
+            {
+              cerr << "Invalid number: " << optarg << '\n';
+              return 1;
+            }
+        }
+      return auh::query (q, count_only);
+    }
+  else if (cmd == "index")
+    {
+      // Parse index options
+      bool apply_delta = false;
+      string owns, required_by;
+      int opt;
+
+      // Define long options for index command
+      static struct option long_options[] = {
+        {"apply-delta", no_argument, 0, 'a'},
+        {"owns", required_argument, 0, 'o'},
+        {"required-by", required_argument, 0, 'r'},
+        {0, 0, 0, 0}
+      };
+
+      // Reset getopt state for proper parsing
+      optind = 2;
+
+      while ((opt = getopt_long (argc, argv, "ao:r:", long_options, NULL))
+             != -1)
+        {
+          switch (opt)
+            {
+            case 'a':
+              apply_delta = true;
+              break;
+            case 'o':
+              owns = optarg;
+              break;
+            case 'r':
+              required_by = optarg;
+              break;
+            default:
+              cout << "Usage: auh index [--apply-delta [packages...] | "
+                      "--owns FILE | --required-by PKG]\n";
+              return 1;
+            }
+        }
+
+      if (!owns.empty ())
+        return auh::index_owner (owns);
+      if (!required_by.empty ())
+        return auh::index_required_by (required_by);
+      if (!apply_delta)
+        return auh::rebuild_index ();
+
+      // Targets come from the command line or, from the pacman hook
+      // (NeedsTargets), one per line on stdin
+      vector<string> targets (argv + optind, argv + argc);
+      if (targets.empty ())
+        {
+          string line;
+          while (getline (cin, line))
+            if (!line.empty ())
+              targets.push_back (line);
+        }
+      return auh::apply_index_delta (targets);
+    }
+  else if (cmd == "daemon")
+    {
+      // Keep caches resident and answer queries over a Unix socket
+      return auh::run_daemon ();
     }
   else
     {